@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+#include "fs_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Benchmark del file system nello stile di Google Benchmark: ogni benchmark
+// riceve il numero di iterazioni da eseguire e il runner lo aumenta finche' la
+// misura non dura almeno min_time. I risultati escono in JSON nello stesso
+// formato di --benchmark_format=json, cosi' si confrontano con gli stessi script.
+// L'output della libreria finisce in /dev/null: fa parte del costo misurato,
+// ma non deve mescolarsi al JSON.
+
+#define BENCH_IMAGE "bench.dat"
+#define BENCH_MAX_ITERATIONS 1000000000LL
+#define BENCH_IO_SIZE 4096
+
+typedef struct {
+    int64_t iterations;
+    int arg;
+    int64_t items;
+    int64_t bytes;
+    uint64_t real_ns;
+    uint64_t cpu_ns;
+    uint64_t real_start;
+    uint64_t cpu_start;
+    int error;
+} BenchState;
+
+typedef struct {
+    const char* name;
+    const char* arg_name;
+    void (*run)(BenchState* state);
+    int args[6];
+} Benchmark;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Le parti di preparazione si escludono dalla misura tra pause e resume.
+static void bench_resume(BenchState* s) {
+    s->real_start = clock_ns(CLOCK_MONOTONIC);
+    s->cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void bench_pause(BenchState* s) {
+    s->real_ns += clock_ns(CLOCK_MONOTONIC) - s->real_start;
+    s->cpu_ns += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - s->cpu_start;
+}
+
+// Generatore xorshift a seme fisso: ogni esecuzione ripete le stesse operazioni.
+static uint64_t rng_state;
+
+static void rng_seed(uint64_t seed) {
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+static uint64_t rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void fill_pattern(char* buf, int len) {
+    for (int i = 0; i < len; i++) {
+        buf[i] = 'a' + (char)(rng_next() % 26);
+    }
+}
+
+static int fresh_image(BenchState* s) {
+    rng_seed(42);
+    if (fs_initialize(BENCH_IMAGE) != 0) {
+        s->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Allocazione di un blocco con la FAT gia' occupata al arg per cento, in posizioni casuali.
+static void bm_alloc(BenchState* s) {
+    if (fresh_image(s) != 0) {
+        return;
+    }
+    int blocks = data_block_count();
+    for (int i = 1; i < blocks; i++) {
+        if ((int)(rng_next() % 100) < s->arg) {
+            fat_set(i, FAT_END);
+        }
+    }
+
+    enum { BATCH = 64 };
+    int batch[BATCH];
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i += BATCH) {
+        int n = s->iterations - i < BATCH ? (int)(s->iterations - i) : BATCH;
+        for (int j = 0; j < n; j++) {
+            batch[j] = get_free_block();
+            fat_set(batch[j], FAT_END);
+        }
+        for (int j = 0; j < n; j++) {
+            fat_set(batch[j], FAT_UNUSED);
+        }
+    }
+    bench_pause(s);
+    s->items = s->iterations;
+}
+
+// Ricerca di un file a caso in una directory con arg voci.
+static void bm_lookup(BenchState* s) {
+    if (fresh_image(s) != 0) {
+        return;
+    }
+    char name[32];
+    for (int i = 0; i < s->arg; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        create_file(name, "dat", 0, "");
+    }
+
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        snprintf(name, sizeof(name), "f%d", (int)(rng_next() % s->arg));
+        if (locate_file(name, "dat", 0) == NULL) {
+            s->error = 1;
+        }
+    }
+    bench_pause(s);
+    s->items = s->iterations;
+}
+
+static char* prepare_file(BenchState* s, int size) {
+    char* data = (char*)malloc(size);
+    if (!data || fresh_image(s) != 0) {
+        free(data);
+        s->error = 1;
+        return NULL;
+    }
+    fill_pattern(data, size);
+    if (create_file("bench", "dat", size, data) != 0) {
+        s->error = 1;
+    }
+    return data;
+}
+
+// Lettura sequenziale di tutto un file di arg byte, a blocchi di BENCH_IO_SIZE.
+static void bm_seq_read(BenchState* s) {
+    char* data = prepare_file(s, s->arg);
+    if (!data) {
+        return;
+    }
+    char buf[BENCH_IO_SIZE];
+    FileHandle handle;
+    handle.file_entry = locate_file("bench", "dat", 0);
+
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        handle.position = 0;
+        int n;
+        while ((n = read_file_content(&handle, buf, sizeof(buf))) > 0) {
+            s->bytes += n;
+        }
+    }
+    bench_pause(s);
+    free(data);
+}
+
+// Lettura di BENCH_IO_SIZE byte a un offset casuale allineato.
+static void bm_rand_read(BenchState* s) {
+    char* data = prepare_file(s, s->arg);
+    if (!data) {
+        return;
+    }
+    char buf[BENCH_IO_SIZE];
+    int slots = s->arg / BENCH_IO_SIZE > 0 ? s->arg / BENCH_IO_SIZE : 1;
+    FileHandle handle;
+    handle.file_entry = locate_file("bench", "dat", 0);
+
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        handle.position = 0;
+        seek_file(&handle, (int)(rng_next() % slots) * BENCH_IO_SIZE, SEEK_SET);
+        int n = read_file_content(&handle, buf, sizeof(buf));
+        s->bytes += n > 0 ? n : 0;
+    }
+    bench_pause(s);
+    free(data);
+}
+
+// Riscrittura sequenziale di un file di arg byte a blocchi di BENCH_IO_SIZE.
+static void bm_seq_write(BenchState* s) {
+    char* data = prepare_file(s, s->arg);
+    if (!data) {
+        return;
+    }
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        for (int off = 0; off < s->arg; off += BENCH_IO_SIZE) {
+            int len = s->arg - off < BENCH_IO_SIZE ? s->arg - off : BENCH_IO_SIZE;
+            int n = write_file_content("bench", "dat", data + off, off, len);
+            s->bytes += n > 0 ? n : 0;
+        }
+    }
+    bench_pause(s);
+    free(data);
+}
+
+static void bm_rand_write(BenchState* s) {
+    char* data = prepare_file(s, s->arg);
+    if (!data) {
+        return;
+    }
+    int slots = s->arg / BENCH_IO_SIZE > 0 ? s->arg / BENCH_IO_SIZE : 1;
+    int len = s->arg < BENCH_IO_SIZE ? s->arg : BENCH_IO_SIZE;
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        int off = (int)(rng_next() % slots) * BENCH_IO_SIZE;
+        int n = write_file_content("bench", "dat", data + off, off, len);
+        s->bytes += n > 0 ? n : 0;
+    }
+    bench_pause(s);
+    free(data);
+}
+
+static int write_host_file(const char* path, int size) {
+    char* data = (char*)malloc(size);
+    FILE* f = fopen(path, "wb");
+    if (!data || !f) {
+        free(data);
+        if (f) {
+            fclose(f);
+        }
+        return -1;
+    }
+    fill_pattern(data, size);
+    fwrite(data, 1, size, f);
+    fclose(f);
+    free(data);
+    return 0;
+}
+
+// Importazione con copy2fs di 16 file host da arg byte.
+static void bm_bulk_import(BenchState* s) {
+    enum { FILES = 16 };
+    char host[] = "/tmp/myfs_bench_XXXXXX";
+    int fd = mkstemp(host);
+    if (fd < 0 || fresh_image(s) != 0 || write_host_file(host, s->arg) != 0) {
+        s->error = 1;
+        return;
+    }
+    close(fd);
+
+    char name[32];
+    for (int64_t i = 0; i < s->iterations; i++) {
+        fresh_image(s);
+        bench_resume(s);
+        for (int f = 0; f < FILES; f++) {
+            snprintf(name, sizeof(name), "imp%d", f);
+            if (copy2fs(host, name, "bin") == 0) {
+                s->bytes += s->arg;
+            }
+        }
+        bench_pause(s);
+    }
+    s->items = s->iterations * FILES;
+    unlink(host);
+}
+
+// Esportazione con copy2host di 16 file da arg byte.
+static void bm_bulk_export(BenchState* s) {
+    enum { FILES = 16 };
+    char host[] = "/tmp/myfs_bench_XXXXXX";
+    int fd = mkstemp(host);
+    if (fd < 0 || fresh_image(s) != 0 || write_host_file(host, s->arg) != 0) {
+        s->error = 1;
+        return;
+    }
+    close(fd);
+
+    char name[32];
+    for (int f = 0; f < FILES; f++) {
+        snprintf(name, sizeof(name), "exp%d", f);
+        copy2fs(host, name, "bin");
+    }
+    bench_resume(s);
+    for (int64_t i = 0; i < s->iterations; i++) {
+        for (int f = 0; f < FILES; f++) {
+            snprintf(name, sizeof(name), "exp%d", f);
+            if (copy2host(name, "bin", host) == 0) {
+                s->bytes += s->arg;
+            }
+        }
+    }
+    bench_pause(s);
+    s->items = s->iterations * FILES;
+    unlink(host);
+}
+
+// Creazione di arg directory di fila, su un'immagine nuova a ogni iterazione.
+static void bm_mkdir_storm(BenchState* s) {
+    char name[32];
+    for (int64_t i = 0; i < s->iterations; i++) {
+        if (fresh_image(s) != 0) {
+            return;
+        }
+        bench_resume(s);
+        for (int d = 0; d < s->arg; d++) {
+            snprintf(name, sizeof(name), "d%d", d);
+            create_dir(name);
+        }
+        bench_pause(s);
+    }
+    s->items = s->iterations * s->arg;
+}
+
+static void bm_mkfile_storm(BenchState* s) {
+    char name[32];
+    for (int64_t i = 0; i < s->iterations; i++) {
+        if (fresh_image(s) != 0) {
+            return;
+        }
+        bench_resume(s);
+        for (int f = 0; f < s->arg; f++) {
+            snprintf(name, sizeof(name), "f%d", f);
+            create_file(name, "txt", 5, "hello");
+        }
+        bench_pause(s);
+    }
+    s->items = s->iterations * s->arg;
+}
+
+static const Benchmark benchmarks[] = {
+    {"BM_AllocBlock", "fill_pct", bm_alloc, {0, 50, 90, 99, -1}},
+    {"BM_Lookup", "entries", bm_lookup, {8, 64, 512, -1}},
+    {"BM_SeqRead", "bytes", bm_seq_read, {4096, 65536, 1048576, -1}},
+    {"BM_RandRead", "bytes", bm_rand_read, {65536, 1048576, -1}},
+    {"BM_SeqWrite", "bytes", bm_seq_write, {4096, 65536, 1048576, -1}},
+    {"BM_RandWrite", "bytes", bm_rand_write, {65536, 1048576, -1}},
+    {"BM_BulkImport", "bytes", bm_bulk_import, {4096, 262144, -1}},
+    {"BM_BulkExport", "bytes", bm_bulk_export, {4096, 262144, -1}},
+    {"BM_MkdirStorm", "dirs", bm_mkdir_storm, {100, -1}},
+    {"BM_MkfileStorm", "files", bm_mkfile_storm, {100, 1000, -1}},
+};
+
+// Come Google Benchmark: si riparte con piu' iterazioni finche' la misura non
+// supera min_time, stimando quante ne servono dalla durata dell'ultimo tentativo.
+static BenchState run_benchmark(const Benchmark* b, int arg, double min_time) {
+    BenchState s;
+    int64_t iterations = 1;
+    for (;;) {
+        memset(&s, 0, sizeof(s));
+        s.iterations = iterations;
+        s.arg = arg;
+        b->run(&s);
+        double seconds = s.real_ns / 1e9;
+        if (s.error || seconds >= min_time || iterations >= BENCH_MAX_ITERATIONS) {
+            return s;
+        }
+        double multiplier = seconds > 0 ? min_time * 1.4 / seconds : 10;
+        if (multiplier > 10) {
+            multiplier = 10;
+        }
+        int64_t next = (int64_t)(iterations * multiplier);
+        iterations = next > iterations ? next : iterations + 1;
+    }
+}
+
+static void print_context(FILE* out) {
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    time_t now = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    fprintf(out, "{\n  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"host_name\": \"%s\",\n", host);
+    fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "    \"block_size\": %d,\n", BLOCK_SIZE);
+    fprintf(out, "    \"volume_size\": %lld,\n", (long long)TOTAL_BLOCKS * BLOCK_SIZE);
+#ifdef __OPTIMIZE__
+    fprintf(out, "    \"library_build_type\": \"release\"\n");
+#else
+    fprintf(out, "    \"library_build_type\": \"debug\"\n");
+#endif
+    fprintf(out, "  },\n  \"benchmarks\": [\n");
+}
+
+int main(int argc, char** argv) {
+    const char* filter = NULL;
+    const char* out_path = NULL;
+    double min_time = 0.2;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--out=", 6) == 0) {
+            out_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--min_time=", 11) == 0) {
+            min_time = atof(argv[i] + 11);
+        } else {
+            fprintf(stderr, "Usage: %s [--filter=<substring>] [--out=<file.json>] [--min_time=<seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fflush(stdout);
+    int json_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (json_fd < 0 || null_fd < 0) {
+        perror("bench");
+        return 1;
+    }
+    FILE* out = out_path ? fopen(out_path, "w") : fdopen(json_fd, "w");
+    if (!out) {
+        perror("bench");
+        return 1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+
+    print_context(out);
+    int first = 1;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        const Benchmark* b = &benchmarks[i];
+        for (int a = 0; b->args[a] >= 0; a++) {
+            char name[128];
+            snprintf(name, sizeof(name), "%s/%s:%d", b->name, b->arg_name, b->args[a]);
+            if (filter && !strstr(name, filter)) {
+                continue;
+            }
+            BenchState s = run_benchmark(b, b->args[a], min_time);
+            fflush(stdout);
+            double real = s.iterations ? (double)s.real_ns / s.iterations : 0;
+            double cpu = s.iterations ? (double)s.cpu_ns / s.iterations : 0;
+            double seconds = s.real_ns / 1e9;
+
+            fprintf(stderr, "%-40s %14.0f ns %14.0f ns %12lld%s\n", name, real, cpu, (long long)s.iterations, s.error ? "  ERROR" : "");
+            fprintf(out, "%s    {\n", first ? "" : ",\n");
+            fprintf(out, "      \"name\": \"%s\",\n", name);
+            fprintf(out, "      \"run_type\": \"iteration\",\n");
+            fprintf(out, "      \"iterations\": %lld,\n", (long long)s.iterations);
+            fprintf(out, "      \"real_time\": %.2f,\n", real);
+            fprintf(out, "      \"cpu_time\": %.2f,\n", cpu);
+            fprintf(out, "      \"time_unit\": \"ns\"");
+            if (s.bytes && seconds > 0) {
+                fprintf(out, ",\n      \"bytes_per_second\": %.2f", s.bytes / seconds);
+            }
+            if (s.items && seconds > 0) {
+                fprintf(out, ",\n      \"items_per_second\": %.2f", s.items / seconds);
+            }
+            if (s.error) {
+                fprintf(out, ",\n      \"error_occurred\": true");
+            }
+            fprintf(out, "\n    }");
+            first = 0;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    unlink(BENCH_IMAGE);
+    return 0;
+}
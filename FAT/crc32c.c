@@ -0,0 +1,96 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+typedef uint32_t (*CrcFn)(uint32_t crc, const unsigned char* p, size_t len);
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static CrcFn crc_fn = NULL;
+static const char* crc_isa = "slice-by-8";
+static uint32_t crc_table[8][256];
+
+static void build_tables() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t)i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+// Otto byte per passo, ognuno con la propria tabella (little endian).
+static uint32_t crc_slice8(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Eseguita una sola volta tramite pthread_once: lo scrub in background e il
+// thread principale possono calcolare il primo CRC nello stesso momento.
+static void select_crc() {
+    build_tables();
+    crc_fn = crc_slice8;
+    crc_isa = "slice-by-8";
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_fn = crc_sse42;
+        crc_isa = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&crc_once, select_crc);
+    return ~crc_fn(~crc, (const unsigned char*)data, len);
+}
+
+const char* crc32c_isa() {
+    pthread_once(&crc_once, select_crc);
+    return crc_isa;
+}
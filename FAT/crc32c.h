@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (polinomio di Castagnoli). Con SSE4.2 usa l'istruzione crc32, altrimenti
+// una tabella slice-by-8; la scelta avviene alla prima chiamata, da
+// qualunque thread.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+const char* crc32c_isa();
+
+#endif
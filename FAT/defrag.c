@@ -0,0 +1,371 @@
+#include "fs_internal.h"
+#include "storage.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Deframmentazione incrementale. Un passaggio visita l'albero directory per
+// directory; per ogni catena spezzata in piu' corse cerca una corsa libera
+// abbastanza lunga, ci copia i blocchi, la collega e solo alla fine sposta
+// first_block sulla copia. Un'interruzione lascia al piu' la copia non collegata,
+// che fsck riconosce come blocchi persi. Lo stato del passaggio e' fatto di soli
+// numeri di blocco, cosi' puo' avanzare a piccoli passi tra un comando e l'altro.
+
+#define DEFRAG_STEP_BLOCKS 256
+#define DEFRAG_PAUSE_US 10000
+
+static int* defrag_queue;
+static int defrag_queue_len;
+static int defrag_queue_capacity;
+static int defrag_dir = FAT_END;
+static int defrag_slot;
+static int defrag_running;
+static int defrag_compact;
+
+static int defrag_files;
+static int defrag_blocks;
+static int defrag_freed;
+
+static pthread_t defrag_thread;
+static int defrag_thread_started;
+static volatile int defrag_stop_requested;
+
+static int queue_push(int block) {
+    if (defrag_queue_len == defrag_queue_capacity) {
+        int capacity = defrag_queue_capacity ? defrag_queue_capacity * 2 : 64;
+        int* grown = (int*)realloc(defrag_queue, capacity * sizeof(int));
+        if (!grown) {
+            return -1;
+        }
+        defrag_queue = grown;
+        defrag_queue_capacity = capacity;
+    }
+    defrag_queue[defrag_queue_len++] = block;
+    return 0;
+}
+
+static DirectoryEntry* block_entries(int block) {
+    return (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+}
+
+// Una directory messa in coda puo' essere stata rimossa nel frattempo: il suo
+// primo blocco e' ancora valido solo se contiene la voce "." che punta a se stesso.
+static int is_dir_start(int block) {
+    if (block == 0) {
+        return 1;
+    }
+    if (block < 1 || block >= data_block_count() || fat_table[block] == FAT_UNUSED || fat_table[block] == FAT_TAIL) {
+        return 0;
+    }
+    DirectoryEntry* self = block_entries(block);
+    return strcmp(self->name, ".") == 0 && self->is_dir && self->first_block == block;
+}
+
+static DirectoryEntry* dir_slot(int first, int slot) {
+    int per_block = slots_per_block();
+    int block = first;
+    for (int hops = slot / per_block; hops > 0; hops--) {
+        block = fat_table[block];
+        if (block == FAT_END || block < 0 || block >= fs->fat_entries) {
+            return NULL;
+        }
+    }
+    return &block_entries(block)[slot % per_block];
+}
+
+// current_dir e i puntatori parent risalendo fino alla radice puntano alle voci
+// "." nei primi blocchi delle directory: vanno spostati insieme al blocco.
+static void rebase_dir_pointers(int old_block, int new_block) {
+    char* lo = (char*)block_entries(old_block);
+    char* hi = lo + fs->bytes_per_block;
+    char* to = (char*)block_entries(new_block);
+    if ((char*)current_dir >= lo && (char*)current_dir < hi) {
+        current_dir = (DirectoryEntry*)(to + ((char*)current_dir - lo));
+    }
+    for (DirectoryEntry* dir = current_dir; dir->parent != NULL; dir = dir->parent) {
+        if ((char*)dir->parent >= lo && (char*)dir->parent < hi) {
+            dir->parent = (DirectoryEntry*)(to + ((char*)dir->parent - lo));
+        }
+    }
+}
+
+// Aggiorna i riferimenti al primo blocco di una directory spostata: la sua
+// voce ".", le voci ".." delle sottodirectory e i puntatori in memoria.
+static void dir_moved(int old_first, int new_first) {
+    int per_block = slots_per_block();
+    block_entries(new_first)[0].first_block = new_first;
+    for (int block = new_first; block != FAT_END; block = fat_table[block]) {
+        DirectoryEntry* slots = block_entries(block);
+        for (int i = 0; i < per_block; i++) {
+            DirectoryEntry* entry = &slots[i];
+            if (!entry->is_dir || is_free_slot(entry) || (unsigned char)entry->name[0] == INLINE_DATA_ENTRY ||
+                strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0 || !is_dir_start(entry->first_block)) {
+                continue;
+            }
+            DirectoryEntry* dotdot = &block_entries(entry->first_block)[1];
+            if (strcmp(dotdot->name, "..") == 0) {
+                dotdot->first_block = new_first;
+            }
+        }
+    }
+    rebase_dir_pointers(old_first, new_first);
+}
+
+// Sposta la catena della voce in una corsa contigua. Restituisce i blocchi
+// copiati, 0 se la catena e' gia' contigua o non puo' essere spostata.
+static int relocate_chain(DirectoryEntry* entry) {
+    int block_size = fs->bytes_per_block;
+    int blocks = data_block_count();
+    int first = entry->first_block;
+    if (first <= 0 || first >= blocks) {
+        return 0;
+    }
+
+    // I blocchi condivisi dalla deduplicazione (block_refs > 1) hanno altri
+    // riferimenti entranti che qui non si possono aggiornare: quelle catene
+    // restano dove sono. Un file importato con dedup ma non condiviso ha i
+    // blocchi a 1 e si sposta portando con se' i conteggi.
+    int len = 0;
+    for (int b = first; b != FAT_END; b = fat_table[b]) {
+        if (b <= 0 || b >= blocks || fat_table[b] == FAT_UNUSED || fat_table[b] == FAT_TAIL || block_refs[b] > 1 || len >= blocks) {
+            return 0;
+        }
+        len++;
+    }
+    if (chain_extents(first) <= 1) {
+        return 0;
+    }
+
+    int got = 0;
+    int start = alloc_extent(len, FAT_END, &got);
+    if (start == FAT_FULL || got < len) {
+        return 0;
+    }
+
+    int b = first;
+    for (int i = 0; i < len; i++, b = fat_table[b]) {
+        memcpy(&data_blocks[(size_t)(start + i) * block_size], &data_blocks[(size_t)b * block_size], block_size);
+        fat_set(start + i, i + 1 < len ? start + i + 1 : FAT_END);
+        crc_table[start + i] = crc_table[b];
+        block_refs[start + i] = block_refs[b];
+    }
+    storage_sync_range(&data_blocks[(size_t)start * block_size], (size_t)len * block_size);
+    storage_sync_range(&fat_table[start], len * sizeof(int));
+    storage_sync_range(&block_refs[start], len * sizeof(uint16_t));
+
+    entry->first_block = start;
+    entry->blocks = len;
+    entry->extents = 1;
+    if (entry->is_dir) {
+        dir_moved(first, start);
+    }
+    storage_sync_range(entry, sizeof(DirectoryEntry));
+
+    release_chain(first);
+    defrag_files++;
+    defrag_blocks += len;
+    return len;
+}
+
+// Ricompatta le voci di una directory all'inizio della sua catena, nello stesso
+// ordine, e libera i blocchi rimasti vuoti. Le voci inline restano accostate
+// ai loro blocchi di dati; il primo blocco non cambia.
+static int compact_dir(int first) {
+    int block_size = fs->bytes_per_block;
+    int per_block = slots_per_block();
+    int count = 1 + chain_length(fat_table[first]);
+    if (count <= 1) {
+        return 0;
+    }
+    char* buffer = (char*)calloc(count, block_size);
+    if (!buffer) {
+        return 0;
+    }
+
+    int out_block = 0;
+    int out_slot = 0;
+    for (int block = first; block != FAT_END; block = fat_table[block]) {
+        DirectoryEntry* slots = block_entries(block);
+        for (int i = 0; i < per_block; i++) {
+            DirectoryEntry* entry = &slots[i];
+            if (is_free_slot(entry) || (unsigned char)entry->name[0] == INLINE_DATA_ENTRY) {
+                continue;
+            }
+            int group = 1;
+            if (!entry->is_dir && (entry->flags & FILE_INLINE) && entry->entry_count > 0 && i + entry->entry_count < per_block) {
+                group += entry->entry_count;
+            }
+            if (out_slot + group > per_block) {
+                out_block++;
+                out_slot = 0;
+            }
+            memcpy(buffer + out_block * block_size + out_slot * sizeof(DirectoryEntry), entry, group * sizeof(DirectoryEntry));
+            out_slot += group;
+            i += group - 1;
+        }
+    }
+
+    int used = out_block + 1;
+    if (used >= count) {
+        free(buffer);
+        return 0;
+    }
+
+    int block = first;
+    for (int i = 0; i < used - 1; i++) {
+        block = fat_table[block];
+    }
+    int rest = fat_table[block];
+
+    block = first;
+    for (int i = 0; i < used; i++, block = fat_table[block]) {
+        memcpy(block_entries(block), buffer + i * block_size, block_size);
+        dir_tags_invalidate(block);
+    }
+    free(buffer);
+
+    block = first;
+    for (int i = 0; i < used - 1; i++) {
+        block = fat_table[block];
+    }
+    fat_set(block, FAT_END);
+    release_chain(rest);
+    defrag_freed += count - used;
+    return count - used;
+}
+
+static int defrag_begin(int compact_dirs) {
+    defrag_queue_len = 0;
+    defrag_dir = FAT_END;
+    defrag_slot = 0;
+    defrag_files = 0;
+    defrag_blocks = 0;
+    defrag_freed = 0;
+    defrag_compact = compact_dirs;
+    if (queue_push(0) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    defrag_running = 1;
+    return 0;
+}
+
+// Avanza il passaggio in corso di circa budget blocchi copiati. Restituisce 1 se
+// resta del lavoro, 0 quando il passaggio e' finito.
+int fs_defrag_step(int budget) {
+    if (!fs) {
+        return FILE_READ_ERROR;
+    }
+    if (!defrag_running && defrag_begin(defrag_compact) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if (defrag_dir != FAT_END && !is_dir_start(defrag_dir)) {
+        defrag_dir = FAT_END;
+    }
+
+    while (budget > 0) {
+        if (defrag_dir == FAT_END) {
+            if (defrag_queue_len == 0) {
+                defrag_running = 0;
+                fs_save();
+                printf("defrag: %d files moved (%d blocks), %d directory blocks freed\n",
+                       defrag_files, defrag_blocks, defrag_freed);
+                return 0;
+            }
+            defrag_dir = defrag_queue[--defrag_queue_len];
+            defrag_slot = 0;
+            if (!is_dir_start(defrag_dir)) {
+                defrag_dir = FAT_END;
+                continue;
+            }
+            if (defrag_compact) {
+                budget -= compact_dir(defrag_dir);
+            }
+        }
+
+        DirectoryEntry* entry = dir_slot(defrag_dir, defrag_slot++);
+        if (entry == NULL) {
+            defrag_dir = FAT_END;
+            continue;
+        }
+        budget--;
+        if (is_free_slot(entry) || (unsigned char)entry->name[0] == INLINE_DATA_ENTRY || entry == (DirectoryEntry*)data_blocks ||
+            strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+            continue;
+        }
+        if (entry->is_dir) {
+            budget -= relocate_chain(entry);
+            if (queue_push(entry->first_block) != 0) {
+                return FILE_WRITE_ERROR;
+            }
+        } else if (!(entry->flags & (FILE_INLINE | FILE_SPARSE)) && entry->first_block != FAT_END) {
+            budget -= relocate_chain(entry);
+        }
+    }
+    return 1;
+}
+
+int fs_defrag(int compact_dirs) {
+    fs_defrag_stop();
+    if (!fs) {
+        printf("defrag: No file system loaded\n");
+        return FILE_READ_ERROR;
+    }
+    if (defrag_begin(compact_dirs) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    int res;
+    while ((res = fs_defrag_step(DEFRAG_STEP_BLOCKS)) > 0) {
+    }
+    return res;
+}
+
+// Il thread di sottofondo lavora a piccoli passi sotto il lock del file system,
+// lasciando spazio ai comandi della shell tra un passo e l'altro. Non si blocca
+// mai sul lock, cosi' fs_defrag_stop puo' aspettarlo anche mentre lo tiene chi chiama.
+static void* defrag_worker(void* arg) {
+    (void)arg;
+    while (!defrag_stop_requested) {
+        if (!fs_trylock()) {
+            usleep(DEFRAG_PAUSE_US);
+            continue;
+        }
+        int res = fs_defrag_step(DEFRAG_STEP_BLOCKS);
+        fs_unlock();
+        if (res <= 0) {
+            break;
+        }
+        usleep(DEFRAG_PAUSE_US);
+    }
+    return NULL;
+}
+
+int fs_defrag_start(int compact_dirs) {
+    if (!fs) {
+        printf("defrag: No file system loaded\n");
+        return FILE_READ_ERROR;
+    }
+    fs_defrag_stop();
+    if (defrag_begin(compact_dirs) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    defrag_stop_requested = 0;
+    if (pthread_create(&defrag_thread, NULL, defrag_worker, NULL) != 0) {
+        printf("defrag: Could not start background thread\n");
+        return FILE_WRITE_ERROR;
+    }
+    defrag_thread_started = 1;
+    printf("defrag: Running in background\n");
+    return 0;
+}
+
+void fs_defrag_stop() {
+    if (!defrag_thread_started) {
+        return;
+    }
+    defrag_stop_requested = 1;
+    pthread_join(defrag_thread, NULL);
+    defrag_thread_started = 0;
+}
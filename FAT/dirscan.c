@@ -0,0 +1,98 @@
+#include "dirscan.h"
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86 1
+#endif
+
+typedef void (*ScanFn)(const DirectoryEntry* dir, int slots, SlotMasks* masks);
+
+static ScanFn scan_fn = NULL;
+static const char* scan_isa = "scalar";
+
+static void scan_scalar(const DirectoryEntry* dir, int slots, SlotMasks* masks) {
+    masks->free = 0;
+    masks->inlined = 0;
+    for (int i = 0; i < slots; i++) {
+        unsigned char first = (unsigned char)dir[i].name[0];
+        masks->free |= (unsigned)(first == 0x00 || first == DELETED_ENTRY) << i;
+        masks->inlined |= (unsigned)(first == INLINE_DATA_ENTRY) << i;
+    }
+}
+
+#ifdef DIRSCAN_X86
+// Le voci sono a passo di sizeof(DirectoryEntry): i primi byte dei nomi vengono
+// raccolti in un vettore e confrontati tutti insieme.
+__attribute__((target("sse2")))
+static void scan_sse2(const DirectoryEntry* dir, int slots, SlotMasks* masks) {
+    masks->free = 0;
+    masks->inlined = 0;
+    for (int base = 0; base < slots; base += 16) {
+        int n = slots - base < 16 ? slots - base : 16;
+        uint8_t first[16] __attribute__((aligned(16))) = {0};
+        for (int i = 0; i < n; i++) {
+            first[i] = (uint8_t)dir[base + i].name[0];
+        }
+        __m128i v = _mm_load_si128((const __m128i*)first);
+        __m128i empty = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8((char)DELETED_ENTRY)));
+        __m128i cont = _mm_cmpeq_epi8(v, _mm_set1_epi8(INLINE_DATA_ENTRY));
+        unsigned lanes = (1u << n) - 1;
+        masks->free |= ((unsigned)_mm_movemask_epi8(empty) & lanes) << base;
+        masks->inlined |= ((unsigned)_mm_movemask_epi8(cont) & lanes) << base;
+    }
+}
+
+// Gather a 32 bit degli otto primi byte a passo di voce; le corsie oltre
+// l'ultima voce sono mascherate per non leggere fuori dal blocco.
+__attribute__((target("avx2")))
+static void scan_avx2(const DirectoryEntry* dir, int slots, SlotMasks* masks) {
+    const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i offsets = _mm256_mullo_epi32(lane_ids, _mm256_set1_epi32((int)sizeof(DirectoryEntry)));
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    masks->free = 0;
+    masks->inlined = 0;
+    for (int base = 0; base < slots; base += 8) {
+        int n = slots - base < 8 ? slots - base : 8;
+        __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane_ids);
+        __m256i v = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)&dir[base], offsets, active, 1);
+        v = _mm256_and_si256(v, low_byte);
+        __m256i empty = _mm256_or_si256(_mm256_cmpeq_epi32(v, _mm256_setzero_si256()),
+                                        _mm256_cmpeq_epi32(v, _mm256_set1_epi32(DELETED_ENTRY)));
+        __m256i cont = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(INLINE_DATA_ENTRY));
+        unsigned lanes = (1u << n) - 1;
+        masks->free |= ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(empty)) & lanes) << base;
+        masks->inlined |= ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(cont)) & lanes) << base;
+    }
+}
+#endif
+
+static void select_scan() {
+    scan_fn = scan_scalar;
+    scan_isa = "scalar";
+#ifdef DIRSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_fn = scan_avx2;
+        scan_isa = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_fn = scan_sse2;
+        scan_isa = "sse2";
+    }
+#endif
+}
+
+void dir_scan_block(const DirectoryEntry* dir, int slots, SlotMasks* masks) {
+    if (!scan_fn) {
+        select_scan();
+    }
+    scan_fn(dir, slots, masks);
+}
+
+const char* dir_scan_isa() {
+    if (!scan_fn) {
+        select_scan();
+    }
+    return scan_isa;
+}
@@ -0,0 +1,26 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include "file_system.h"
+
+// Maschere di occupazione di un blocco di directory: il bit i descrive la voce
+// i. free vale per le voci con name[0] 0x00 o DELETED_ENTRY, inlined per le
+// voci di continuazione dei file inline. La versione (AVX2, SSE2 o scalare)
+// viene scelta alla prima chiamata in base alla CPU.
+
+typedef struct {
+    unsigned free;
+    unsigned inlined;
+} SlotMasks;
+
+// slots non puo' superare 32.
+void dir_scan_block(const DirectoryEntry* dir, int slots, SlotMasks* masks);
+const char* dir_scan_isa();
+
+// Voci in uso che non sono continuazioni inline.
+static inline unsigned slot_live_mask(const SlotMasks* masks, int slots) {
+    unsigned all = slots >= 32 ? ~0u : (1u << slots) - 1;
+    return ~(masks->free | masks->inlined) & all;
+}
+
+#endif
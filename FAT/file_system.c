@@ -1,34 +1,436 @@
-#include "file_system.h"
+#define _GNU_SOURCE
+#include "fs_internal.h"
+#include "lz.h"
+#include "perf.h"
+#include "hostio.h"
+#include "storage.h"
+#include "dirscan.h"
+#include "crc32c.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 FileSystem *fs;
 DirectoryEntry *current_dir;
 int *fat_table;
+uint16_t *block_refs;
+uint32_t *crc_table;
 char *data_blocks;
 FILE *file_system_file;
 
+// Deduplicazione: indice in memoria impronta -> blocco, ricostruito dalla tabella dei riferimenti
+typedef struct {
+    uint64_t fingerprint;
+    int block;
+} DedupSlot;
+
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int alloc_hint = 1;
+static int discard_enabled = 0;
+
+static size_t image_size = 0;
+
+static int verbose = 1;
+static int deferred_save = 0;
+static int save_pending = 0;
+
+// Transazione aperta: fs_save e fs_sync non scrivono nulla finche' fs_txn_commit
+// non rende durevoli tutte le modifiche insieme, passando dal giornale.
+static int txn_active = 0;
+static DirectoryEntry* txn_saved_dir = NULL;
+// La transazione e' quella del gruppo di salvataggi differiti (vedi join_group_txn):
+// si chiude alla prossima fs_sync insieme a tutto il gruppo.
+static int group_txn = 0;
+static char journal_path[PATH_MAX + 16];
+
+// Contatori dello spazio libero, tenuti aggiornati da fat_set.
+static int free_block_count = 0;
+
+// Corse libere per tratti di FREE_RUN_CHUNK blocchi, in un albero di segmenti:
+// ogni nodo tiene la corsa libera in testa e in coda al tratto che copre e la
+// piu' lunga al suo interno. fat_set segna il tratto del blocco che cambia
+// stato; prima di ogni richiesta si ricalcolano i tratti segnati e i loro
+// antenati, senza ripercorrere la FAT.
+#define FREE_RUN_CHUNK 256
+
+typedef struct {
+    int start;
+    int len;
+    int head;
+    int tail;
+    int best;
+    int best_start;
+} RunNode;
+
+static RunNode *run_tree = NULL;
+static int run_leaves = 0;
+static int run_chunks = 0;
+static unsigned char *run_dirty = NULL;
+static int *run_dirty_list = NULL;
+static int run_dirty_count = 0;
+
+static int dedup_enabled = 0;
+static DedupSlot *dedup_index = NULL;
+static int dedup_capacity = 0;
+static int dedup_used = 0;
+
+#define COMPRESS_NO_GAIN 0
+
+#define TAIL_OPEN_CLUSTERS 8
+
+static int tail_packing_enabled = 0;
+static int tail_open[TAIL_OPEN_CLUSTERS];
+static int tail_open_loaded = 0;
+
+// Lettura anticipata della catena del file letto in sequenza: ra_block e' il
+// primo blocco non ancora segnalato, che si trova alla posizione ra_limit.
+#define READAHEAD_BLOCKS 1024
+
+static DirectoryEntry* ra_file = NULL;
+static int ra_block = FAT_END;
+static int ra_limit = 0;
+
+// Impronte dei nomi: per ogni blocco di directory un byte per voce, ricavato da
+// nome, estensione e is_dir, che find_entry confronta tutte insieme prima di
+// leggere le voci. L'ultimo byte dice se le impronte del blocco sono valide;
+// vengono calcolate alla prima ricerca e scartate quando il blocco viene
+// occupato o liberato. Il valore 0 indica una voce che non puo' corrispondere.
+#define DIR_TAG_SLOTS 16
+#define DIR_TAG_VALID (DIR_TAG_SLOTS - 1)
+
+typedef struct {
+    uint8_t tag[DIR_TAG_SLOTS];
+} DirTags;
+
+static DirTags *dir_tags = NULL;
+static int dir_tags_count = 0;
+
+static int compression_enabled = 0;
+static int chunk_cache_first = FAT_END;
+static int chunk_cache_index = -1;
+static int chunk_cache_len = 0;
+static char chunk_cache[COMPRESS_CHUNK_SIZE];
+
+static void dedup_reset_index();
+static int unshare_file(DirectoryEntry* file);
+static int inflate_file(DirectoryEntry* file);
+static int alloc_chain_from(const char* data, int len);
+static int store_file_data(DirectoryEntry* entry, const char* data, int size);
+static int chain_block_at(int block, int hops);
+static int write_chain(int block, const char* data, int size);
+static void zero_chain_range(int block, int from, int to);
+static int read_file_data(FileHandle *handle, char *buffer, int size);
+static int write_file_data(const char* name, const char* ext, const char* data, int offset, int size);
+static int commit_txn();
+static int read_sparse(FileHandle* handle, char* buffer, int size);
+static void release_file_storage(DirectoryEntry* file);
+static int make_sparse(DirectoryEntry* file);
+static void release_sparse(DirectoryEntry* file);
+static void release_sparse_maps(int node, int level);
+static int write_sparse(DirectoryEntry* file, const char* data, int offset, int size);
+static int seek_data_or_hole(DirectoryEntry* file, int offset, int want_data);
+static void tail_release(DirectoryEntry* file);
+static char* tail_data(const DirectoryEntry* file);
+static int unpack_tail(DirectoryEntry* file);
+static int pack_tail(DirectoryEntry* file);
+static int read_compressed(FileHandle* handle, char* buffer, int size);
+static void dir_tag_update(const DirectoryEntry* entry);
+
+// Il blocco 0 e' riservato e non conta mai come libero.
+static int run_free(int block) {
+    return block > 0 && fat_table[block] == FAT_UNUSED;
+}
+
+static void run_leaf(int chunk) {
+    RunNode* node = &run_tree[run_leaves + chunk];
+    int start = chunk * FREE_RUN_CHUNK;
+    int end = start + FREE_RUN_CHUNK < data_block_count() ? start + FREE_RUN_CHUNK : data_block_count();
+    node->start = start;
+    node->len = end - start;
+    node->head = 0;
+    while (start + node->head < end && run_free(start + node->head)) {
+        node->head++;
+    }
+    node->tail = 0;
+    while (node->tail < node->len && run_free(end - 1 - node->tail)) {
+        node->tail++;
+    }
+    node->best = 0;
+    node->best_start = FAT_END;
+    int i = start;
+    while (i < end) {
+        if (!run_free(i)) {
+            i++;
+            continue;
+        }
+        int run = i;
+        while (i < end && run_free(i)) {
+            i++;
+        }
+        if (i - run > node->best) {
+            node->best = i - run;
+            node->best_start = run;
+        }
+    }
+}
+
+// A parita' di lunghezza vince la corsa piu' a sinistra, come in una scansione.
+static void run_combine(int index) {
+    RunNode* node = &run_tree[index];
+    const RunNode* left = &run_tree[2 * index];
+    const RunNode* right = &run_tree[2 * index + 1];
+    node->start = left->start;
+    node->len = left->len + right->len;
+    node->head = left->head == left->len ? left->len + right->head : left->head;
+    node->tail = right->tail == right->len ? right->len + left->tail : right->tail;
+    node->best = left->best;
+    node->best_start = left->best_start;
+    if (left->tail + right->head > node->best) {
+        node->best = left->tail + right->head;
+        node->best_start = left->start + left->len - left->tail;
+    }
+    if (right->best > node->best) {
+        node->best = right->best;
+        node->best_start = right->best_start;
+    }
+}
+
+static void run_tree_build() {
+    free(run_tree);
+    free(run_dirty);
+    free(run_dirty_list);
+    run_chunks = (data_block_count() + FREE_RUN_CHUNK - 1) / FREE_RUN_CHUNK;
+    run_leaves = 1;
+    while (run_leaves < run_chunks) {
+        run_leaves *= 2;
+    }
+    run_tree = (RunNode*)calloc(2 * (size_t)run_leaves, sizeof(RunNode));
+    run_dirty = (unsigned char*)calloc(run_chunks, 1);
+    run_dirty_list = (int*)malloc(run_chunks * sizeof(int));
+    run_dirty_count = 0;
+    if (!run_tree || !run_dirty || !run_dirty_list) {
+        printf("reset_caches: Not enough memory for the free run index\n");
+        free(run_tree);
+        free(run_dirty);
+        free(run_dirty_list);
+        run_tree = NULL;
+        run_dirty = NULL;
+        run_dirty_list = NULL;
+        return;
+    }
+    for (int chunk = 0; chunk < run_chunks; chunk++) {
+        run_leaf(chunk);
+    }
+    // Le foglie oltre l'ultimo tratto restano vuote, con start alla fine del volume.
+    for (int chunk = run_chunks; chunk < run_leaves; chunk++) {
+        run_tree[run_leaves + chunk].start = data_block_count();
+        run_tree[run_leaves + chunk].best_start = FAT_END;
+    }
+    for (int i = run_leaves - 1; i >= 1; i--) {
+        run_combine(i);
+    }
+}
+
+// Ricalcola i tratti cambiati dall'ultima richiesta e i nodi sopra di loro.
+static void run_tree_flush() {
+    while (run_dirty_count > 0) {
+        int chunk = run_dirty_list[--run_dirty_count];
+        run_dirty[chunk] = 0;
+        run_leaf(chunk);
+        for (int i = (run_leaves + chunk) / 2; i >= 1; i /= 2) {
+            run_combine(i);
+        }
+    }
+}
+
+// Inizio della prima corsa libera lunga almeno want, scendendo dalla radice:
+// a sinistra se basta il figlio sinistro, poi la corsa a cavallo dei due figli,
+// poi a destra. Nella foglia la corsa e' tutta interna al tratto.
+static int run_tree_first_fit(int want) {
+    if (run_tree[1].best < want) {
+        return FAT_FULL;
+    }
+    int index = 1;
+    while (index < run_leaves) {
+        const RunNode* left = &run_tree[2 * index];
+        const RunNode* right = &run_tree[2 * index + 1];
+        if (left->best >= want) {
+            index = 2 * index;
+        } else if (left->tail + right->head >= want) {
+            return left->start + left->len - left->tail;
+        } else {
+            index = 2 * index + 1;
+        }
+    }
+    const RunNode* leaf = &run_tree[index];
+    int i = leaf->start;
+    int end = leaf->start + leaf->len;
+    while (i < end) {
+        if (!run_free(i)) {
+            i++;
+            continue;
+        }
+        int run = i;
+        while (i < end && i - run < want && run_free(i)) {
+            i++;
+        }
+        if (i - run >= want) {
+            return run;
+        }
+    }
+    return FAT_FULL;
+}
+
+// Lunghezza della corsa libera piu' lunga e in *start il suo inizio. Senza
+// l'indice, se non e' stato possibile allocarlo, si scandisce la FAT.
+static int largest_free_run(int* start) {
+    if (run_tree) {
+        run_tree_flush();
+        *start = run_tree[1].best > 0 ? run_tree[1].best_start : FAT_END;
+        return run_tree[1].best;
+    }
+    int blocks = data_block_count();
+    int best = 0;
+    *start = FAT_END;
+    int i = 1;
+    while (i < blocks) {
+        if (fat_table[i] != FAT_UNUSED) {
+            i++;
+            continue;
+        }
+        int run = i;
+        while (i < blocks && fat_table[i] == FAT_UNUSED) {
+            i++;
+        }
+        if (i - run > best) {
+            best = i - run;
+            *start = run;
+        }
+    }
+    return best;
+}
+
+// Scarta le strutture in memoria derivate dall'immagine; vanno ricostruite
+// quando l'immagine viene caricata o modificata dall'esterno (fsck).
+void reset_caches() {
+    dedup_reset_index();
+    chunk_cache_first = FAT_END;
+    tail_open_loaded = 0;
+    alloc_hint = 1;
+
+    free_block_count = 0;
+    int blocks = data_block_count();
+    for (int i = 0; i < blocks; i++) {
+        if (fat_table[i] == FAT_UNUSED) {
+            free_block_count++;
+        }
+    }
+    run_tree_build();
+
+    free(dir_tags);
+    dir_tags_count = slots_per_block() < DIR_TAG_VALID ? blocks : 0;
+    dir_tags = dir_tags_count ? (DirTags*)calloc(dir_tags_count, sizeof(DirTags)) : NULL;
+    if (!dir_tags) {
+        dir_tags_count = 0;
+    }
+}
+
+static void map_regions(void* mapped) {
+    fat_table = (int*)((char*)mapped + sizeof(FileSystem));
+    block_refs = (uint16_t*)((char*)fat_table + fs->fat_size);
+    crc_table = (uint32_t*)((char*)block_refs + fs->refs_size);
+    data_blocks = (char*)crc_table + fs->crc_size;
+    reset_caches();
+}
+
+// Il numero di blocchi dati si ricava dalla dimensione dell'immagine: data_size
+// nell'intestazione e' un int e oltre 2 GiB resta saturo.
+int data_block_count() {
+    size_t blocks = (image_size - (size_t)(data_blocks - (char*)fs)) / fs->bytes_per_block;
+    return blocks < (size_t)fs->fat_entries ? (int)blocks : fs->fat_entries;
+}
+
+// Ogni modifica della FAT passa da qui, per tenere aggiornati i contatori.
+void fat_set(int block, int value) {
+    int was_free = fat_table[block] == FAT_UNUSED;
+    fat_table[block] = value;
+    if (was_free == (value == FAT_UNUSED) || block >= data_block_count()) {
+        return;
+    }
+    dir_tags_invalidate(block);
+    crc_table[block] = 0;
+    if (was_free) {
+        free_block_count--;
+    } else {
+        free_block_count++;
+    }
+    int chunk = block / FREE_RUN_CHUNK;
+    if (run_tree && !run_dirty[chunk]) {
+        run_dirty[chunk] = 1;
+        run_dirty_list[run_dirty_count++] = chunk;
+    }
+}
+
+// Rilascia l'immagine aperta in precedenza, prima di crearne o caricarne un'altra.
+static void unmap_current() {
+    if (file_system_file) {
+        if (txn_active) {
+            fs_txn_commit();
+        }
+        if (save_pending) {
+            fs_sync();
+        }
+        storage_unmap(fs, image_size);
+        fclose(file_system_file);
+        file_system_file = NULL;
+        fs = NULL;
+    }
+}
+
 int fs_initialize(const char* file_path) {
+    return fs_initialize_size(file_path, TOTAL_BLOCKS);
+}
+
+int fs_initialize_size(const char* file_path, int total_blocks) {
+    if (total_blocks < FS_MIN_BLOCKS || total_blocks > FS_MAX_BLOCKS) {
+        printf("Error: Volume size must be between %d and %d blocks\n", FS_MIN_BLOCKS, FS_MAX_BLOCKS);
+        return INIT_ERROR;
+    }
+
+    unmap_current();
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", file_path);
+    unlink(journal_path);
     int fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
     if (fd == -1) {
         printf("Error opening file system file\n");
         return INIT_ERROR;
     }
 
-    if (ftruncate(fd, FILE_SYSTEM_SIZE) == -1) {
+    // Troncando prima a zero, l'immagine riparte come file sparso di soli zeri:
+    // FAT, riferimenti e dati non vanno azzerati a mano.
+    size_t size = (size_t)total_blocks * BLOCK_SIZE;
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
         printf("Error setting file size\n");
         close(fd);
         return INIT_ERROR;
     }
 
-    void* mapped = mmap(NULL, FILE_SYSTEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mapped == MAP_FAILED) {
+    size_t metadata = sizeof(FileSystem) + (size_t)total_blocks * (sizeof(int) + sizeof(uint16_t) + sizeof(uint32_t));
+    void* mapped = storage_map(fd, size, metadata);
+    if (mapped == NULL) {
         printf("Error mapping file\n");
         close(fd);
         return INIT_ERROR;
@@ -37,26 +439,26 @@ int fs_initialize(const char* file_path) {
     file_system_file = fdopen(fd, "wb+");
     if (!file_system_file) {
         printf("Error creating file system file\n");
-        munmap(mapped, FILE_SYSTEM_SIZE);
+        storage_unmap(mapped, size);
         close(fd);
         return INIT_ERROR;
     }
 
     fs = (FileSystem*)mapped;
+    image_size = size;
     fs->bytes_per_block = BLOCK_SIZE;
-    fs->total_blocks = TOTAL_BLOCKS;
-    fs->fat_entries = TOTAL_BLOCKS;
+    fs->total_blocks = total_blocks;
+    fs->fat_entries = total_blocks;
     fs->fat_size = fs->fat_entries * sizeof(int);
-    fs->data_size = FILE_SYSTEM_SIZE - fs->fat_size - sizeof(FileSystem);
+    fs->refs_size = fs->fat_entries * sizeof(uint16_t);
+    fs->crc_size = fs->fat_entries * sizeof(uint32_t);
+    size_t data_size = size - fs->fat_size - fs->refs_size - fs->crc_size - sizeof(FileSystem);
+    fs->data_size = data_size > INT_MAX ? INT_MAX : (int)data_size;
+    fs->features = FS_FEATURE_CHECKSUMS;
+    fs->entry_size = sizeof(DirectoryEntry);
     strcpy(fs->current_directory, "ROOT");
 
-    fat_table = (int*)((char*)mapped + sizeof(FileSystem));
-    for (int i = 0; i < fs->fat_entries; i++) {
-        fat_table[i] = FAT_UNUSED;
-    }
-
-    data_blocks = (char*)mapped + sizeof(FileSystem) + fs->fat_size;
-    memset(data_blocks, 0x00, fs->data_size);
+    map_regions(mapped);
 
     current_dir = (DirectoryEntry*)data_blocks;
     current_dir->first_block = 0;
@@ -65,22 +467,58 @@ int fs_initialize(const char* file_path) {
     current_dir->entry_count = 0;
     current_dir->is_dir = 1;
     current_dir->parent = NULL;
-    fat_table[0] = FAT_END;
+    fat_set(0, FAT_END);
+    // Con la cache l'immagine nuova esiste solo in memoria finche' non la si salva.
+    fs_save();
 
-    printf("fs_initialize: Created new file system: PASSED\n");
+    fs_log("fs_initialize: Created new file system: PASSED\n");
 
     return 0;
 }
 
 int fs_load(const char* file_path) {
+    unmap_current();
     int fd = open(file_path, O_RDWR);
     if (fd == -1) {
         printf("Error opening file system file\n");
         return INIT_ERROR;
     }
 
-    void* mapped = mmap(NULL, FILE_SYSTEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mapped == MAP_FAILED) {
+    // Un commit interrotto dopo aver completato il giornale va finito prima di
+    // leggere qualunque cosa, intestazione compresa.
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", file_path);
+    int recovered = storage_recover(fd, journal_path);
+    if (recovered < 0) {
+        printf("Error: Could not replay the journal %s\n", journal_path);
+        close(fd);
+        return INIT_ERROR;
+    }
+    if (recovered > 0) {
+        printf("fs_load: Replayed an interrupted transaction from %s\n", journal_path);
+    }
+
+    // La dimensione del volume sta nell'intestazione, letta prima di mappare.
+    FileSystem header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) == -1 ||
+        header.bytes_per_block != BLOCK_SIZE || header.total_blocks < FS_MIN_BLOCKS || header.total_blocks > FS_MAX_BLOCKS ||
+        st.st_size < (off_t)header.total_blocks * BLOCK_SIZE || header.fat_entries != header.total_blocks ||
+        header.fat_size != header.fat_entries * (int)sizeof(int) || header.refs_size != header.fat_entries * (int)sizeof(uint16_t) ||
+        header.crc_size != header.fat_entries * (int)sizeof(uint32_t)) {
+        printf("Error: Not a valid file system image\n");
+        close(fd);
+        return INIT_ERROR;
+    }
+    if (header.entry_size != (int)sizeof(DirectoryEntry)) {
+        printf("Error: Image uses an incompatible directory entry format (%d bytes, expected %d)\n",
+               header.entry_size, (int)sizeof(DirectoryEntry));
+        close(fd);
+        return INIT_ERROR;
+    }
+
+    size_t size = (size_t)header.total_blocks * BLOCK_SIZE;
+    void* mapped = storage_map(fd, size, sizeof(FileSystem) + header.fat_size + header.refs_size + header.crc_size);
+    if (mapped == NULL) {
         printf("Error mapping file\n");
         close(fd);
         return INIT_ERROR;
@@ -89,40 +527,197 @@ int fs_load(const char* file_path) {
     file_system_file = fdopen(fd, "rb+");
     if (!file_system_file) {
         printf("Error opening file system file\n");
-        munmap(mapped, FILE_SYSTEM_SIZE);
+        storage_unmap(mapped, size);
         close(fd);
         return INIT_ERROR;
     }
 
     fs = (FileSystem*)mapped;
-    fat_table = (int*)((char*)mapped + sizeof(FileSystem));
-    data_blocks = (char*)mapped + sizeof(FileSystem) + fs->fat_size;
+    image_size = size;
+    map_regions(mapped);
     current_dir = (DirectoryEntry*)data_blocks;
 
-    printf("fs_load: PASSED\n");
-    printf("fs_load: Loaded file system from DATATICUS file.\n");
+    fs_log("fs_load: PASSED\n");
+    fs_log("fs_load: Loaded file system from DATATICUS file.\n");
 
     return 0;
 }
 
+// Con i salvataggi differiti fs_save si limita a ricordare che l'immagine va
+// sincronizzata; lo fara' fs_sync, chiamata esplicitamente o alla disattivazione.
 int fs_save() {
+    if (deferred_save && file_system_file) {
+        save_pending = 1;
+        return 0;
+    }
+    return fs_sync();
+}
+
+int fs_sync() {
     if (!file_system_file) {
         printf("fs_save: File system file not open\n");
         return FILE_WRITE_ERROR;
     }
+    if (txn_active) {
+        if (group_txn) {
+            return commit_txn();
+        }
+        save_pending = 1;
+        return 0;
+    }
 
-    if (msync(fs, FILE_SYSTEM_SIZE, MS_SYNC) == -1) {
+    uint64_t start = perf_begin();
+    int res = storage_sync(fs, image_size);
+    perf_end(PERF_SAVE, start, perf_hops, res == 0 ? image_size : 0);
+    if (res == -1) {
         printf("fs_save: Failed to sync memory to file\n");
         return FILE_WRITE_ERROR;
     }
+    save_pending = 0;
+
+    fs_log("fs_save: PASSED\n");
+    fs_log("fs_save: Successfully saved file system to DATATICUS file.\n");
+
+    return 0;
+}
+
+void fs_set_deferred_save(int enabled) {
+    deferred_save = enabled;
+    if (!enabled && (save_pending || group_txn)) {
+        fs_sync();
+    }
+}
+
+// Le operazioni che vogliono essere atomiche, con i salvataggi differiti attivi,
+// non aprono e chiudono una transazione propria: ne aprono una per il gruppo,
+// se non ce n'e' gia' una, e la lasciano chiudere alla sincronizzazione del
+// gruppo, con un solo giornale e un solo fdatasync per tutte.
+static int join_group_txn() {
+    if (txn_active) {
+        return 0;
+    }
+    if (fs_txn_begin() != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    group_txn = 1;
+    return 0;
+}
+
+int fs_txn_begin() {
+    if (!file_system_file) {
+        printf("txn: No file system loaded\n");
+        return INIT_ERROR;
+    }
+    // Chi apre una transazione esplicita chiude prima quella del gruppo.
+    if (group_txn && commit_txn() != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if (txn_active) {
+        printf("txn: A transaction is already open\n");
+        return FILE_WRITE_ERROR;
+    }
+    // Cio' che precede la transazione viene reso durevole per conto suo.
+    if (save_pending && fs_sync() != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if (storage_txn_begin(fs, image_size) != 0) {
+        printf("txn: Could not start a transaction (%s)\n", strerror(errno));
+        return FILE_WRITE_ERROR;
+    }
+    txn_active = 1;
+    txn_saved_dir = current_dir;
+    fs_log("txn: Started\n");
+    return 0;
+}
+
+int fs_txn_commit() {
+    if (!txn_active) {
+        printf("txn: No transaction open\n");
+        return FILE_WRITE_ERROR;
+    }
+    if (storage_txn_overflowed() && !group_txn) {
+        printf("txn: The transaction outgrew the cache and was aborted\n");
+        fs_txn_abort();
+        return FILE_WRITE_ERROR;
+    }
+    return commit_txn();
+}
 
-    printf("fs_save: PASSED\n");
-    printf("fs_save: Successfully saved file system to DATATICUS file.\n");
+static int commit_txn() {
+    uint64_t start = perf_begin();
+    int res = storage_txn_commit(fs, image_size, journal_path);
+    perf_end(PERF_SAVE, start, perf_hops, 0);
+    if (res != 0) {
+        printf("txn: Commit failed (%s), the transaction is still open\n", strerror(errno));
+        return FILE_WRITE_ERROR;
+    }
+    txn_active = 0;
+    group_txn = 0;
+    save_pending = 0;
+    fs_log("txn: Committed\n");
+    return 0;
+}
 
+// L'immagine torna com'era a fs_txn_begin, e con lei la directory corrente; le
+// strutture in memoria derivate dall'immagine vanno ricostruite.
+int fs_txn_abort() {
+    if (!txn_active || group_txn) {
+        printf("txn: No transaction open\n");
+        return FILE_WRITE_ERROR;
+    }
+    if (storage_txn_abort(fs, image_size) != 0) {
+        printf("txn: Abort failed (%s)\n", strerror(errno));
+        return FILE_WRITE_ERROR;
+    }
+    txn_active = 0;
+    save_pending = 0;
+    current_dir = txn_saved_dir;
+    ra_file = NULL;
+    reset_caches();
+    fs_log("txn: Aborted\n");
     return 0;
 }
 
+// Messaggi di avanzamento delle operazioni, soppressi in modalita' silenziosa.
+// Errori e risultati richiesti esplicitamente (ls, read, ...) usano printf.
+void fs_log(const char* format, ...) {
+    if (!verbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void fs_set_verbose(int enabled) {
+    verbose = enabled;
+}
+
+// Serializza l'accesso all'immagine tra la shell e i lavori in sottofondo.
+void fs_lock() {
+    pthread_mutex_lock(&fs_mutex);
+}
+
+int fs_trylock() {
+    return pthread_mutex_trylock(&fs_mutex) == 0;
+}
 
+// Chi rilascia il lucchetto ha finito la sua operazione: e' il punto in cui una
+// transazione cresciuta oltre la cache puo' essere annullata senza lasciare
+// un'operazione a meta'.
+void fs_unlock() {
+    if (txn_active && storage_txn_overflowed()) {
+        // Quella del gruppo contiene comandi gia' conclusi: va chiusa, non annullata.
+        if (group_txn) {
+            commit_txn();
+        } else {
+            printf("txn: The transaction outgrew the cache and was aborted\n");
+            fs_txn_abort();
+        }
+    }
+    pthread_mutex_unlock(&fs_mutex);
+}
 
 DirectoryEntry* get_current_dir() {
     return current_dir;
@@ -132,129 +727,490 @@ FileSystem* get_fs() {
     return fs;
 }
 
-int get_free_block() {
-    for (int i = 1; i < fs->fat_entries; i++) {
+// Next-fit: la ricerca riparte da dove si era fermata l'ultima volta.
+static int find_free_block() {
+    if (free_block_count == 0) {
+        return FAT_FULL;
+    }
+    int blocks = data_block_count();
+    if (alloc_hint < 1 || alloc_hint >= blocks) {
+        alloc_hint = 1;
+    }
+    for (int n = 0; n < blocks - 1; n++) {
+        int i = alloc_hint + n < blocks ? alloc_hint + n : alloc_hint + n - (blocks - 1);
+        PERF_HOP();
         if (fat_table[i] == FAT_UNUSED) {
+            alloc_hint = i + 1;
             return i;
         }
     }
     return FAT_FULL;
 }
 
+int get_free_block() {
+    uint64_t start = perf_begin();
+    uint64_t hops = perf_hops;
+    int block = find_free_block();
+    perf_end(PERF_GET_FREE_BLOCK, start, hops, 0);
+    return block;
+}
 
-DirectoryEntry* find_empty_dir_entry() {
-    int block = current_dir->first_block;
-    while (block != FAT_END) {
-        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-        for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-            DirectoryEntry* entry = &dir[i];
-            if (entry->name[0] == 0x00 || (unsigned char)entry->name[0] == DELETED_ENTRY) {
-                return entry;
-            }
+// Cerca want blocchi liberi contigui, provando prima a partire da near.
+// Restituisce l'inizio della corsa trovata e in *got la sua lunghezza, che e'
+// minore di want solo se nel volume non esiste una corsa abbastanza lunga.
+int alloc_extent(int want, int near, int* got) {
+    int blocks = data_block_count();
+    if (near > 0 && near < blocks) {
+        int len = 0;
+        while (near + len < blocks && len < want && fat_table[near + len] == FAT_UNUSED) {
+            len++;
+        }
+        if (len == want) {
+            *got = len;
+            return near;
         }
-        block = fat_table[block];
     }
-    return NULL;
-}
 
-int cd(const char* dir_name) {
-    printf("Changing to directory: %s\n", dir_name);
+    // Se nemmeno la corsa piu' lunga basta, e' lei la migliore possibile.
+    int largest_start;
+    int largest = largest_free_run(&largest_start);
+    if (largest < want) {
+        *got = largest;
+        return largest > 0 ? largest_start : FAT_FULL;
+    }
+    if (run_tree) {
+        *got = want;
+        return run_tree_first_fit(want);
+    }
 
-    if (strcmp(dir_name, ".") == 0) {
-        return INVALID_DIRECTORY; 
+    int best = FAT_FULL;
+    int best_len = 0;
+    int i = 1;
+    while (i < blocks && best_len < want) {
+        if (fat_table[i] != FAT_UNUSED) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < blocks && i - start < want && fat_table[i] == FAT_UNUSED) {
+            i++;
+        }
+        if (i - start > best_len) {
+            best = start;
+            best_len = i - start;
+        }
     }
+    *got = best_len;
+    return best;
+}
 
-    if (strcmp(dir_name, "..") == 0) {
-        if (current_dir->parent != NULL) {
-            current_dir = current_dir->parent;
-            strcpy(fs->current_directory, current_dir->name);
+// Blocchi e corse contigue della catena del file, tenuti nella voce perche'
+// fs_stat_file non debba percorrerla. Va chiamata da chi costruisce o accorcia
+// la catena; reserve_chain, che la allunga, aggiunge solo i blocchi nuovi.
+void count_chain(DirectoryEntry* file) {
+    file->blocks = 0;
+    file->extents = 0;
+    int prev = FAT_END;
+    for (int b = file->first_block; b != FAT_END && b > 0 && b < fs->fat_entries; b = fat_table[b]) {
+        file->blocks++;
+        if (b != prev + 1) {
+            file->extents++;
         }
-        return 0;
+        prev = b;
     }
+}
 
-    int block = current_dir->first_block;
-    while (block != FAT_END) {
-        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-        for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-            DirectoryEntry* entry = &dir[i];
-            if (strcmp(entry->name, dir_name) == 0 && entry->is_dir) {
-                current_dir = (DirectoryEntry*)&data_blocks[entry->first_block * fs->bytes_per_block];
-                current_dir->parent = dir;
-                strcpy(fs->current_directory, entry->name);
-                return 0;
-            }
+// Allunga la catena del file finche' copre bytes byte, a corse contigue quando
+// possibile. Non scrive dati e non cambia la dimensione del file.
+static int reserve_chain(DirectoryEntry* file, int bytes) {
+    int block_size = fs->bytes_per_block;
+    int needed = (bytes + block_size - 1) / block_size;
+    int count = 0;
+    int last = FAT_END;
+    for (int b = file->first_block; b != FAT_END && b > 0 && b < fs->fat_entries; b = fat_table[b]) {
+        last = b;
+        count++;
+    }
+
+    while (count < needed) {
+        int got = 0;
+        int start = alloc_extent(needed - count, last == FAT_END ? FAT_END : last + 1, &got);
+        if (start == FAT_FULL || got == 0) {
+            return FAT_FULL;
         }
-        block = fat_table[block];
-        if (block < 0 || block >= fs->fat_entries) {
-            printf("Error: Block index out of bounds: %d\n", block);
-            return FILE_NOT_FOUND;
+        for (int b = start; b < start + got; b++) {
+            fat_set(b, FAT_END);
+            if (last == FAT_END) {
+                file->first_block = b;
+            } else {
+                fat_set(last, b);
+            }
+            if (b != last + 1) {
+                file->extents++;
+            }
+            file->blocks++;
+            last = b;
         }
+        count += got;
+        alloc_hint = start + got;
     }
-    return FILE_NOT_FOUND;
+    return 0;
 }
 
+void fs_set_discard(int enabled) {
+    discard_enabled = enabled;
+    fs_log("discard: %s\n", enabled ? "enabled" : "disabled");
+}
 
-void ls() {
-    if (current_dir == NULL) {
-        printf("Error: current_dir is NULL\n");
+// I blocchi liberati non vengono azzerati: chi li rialloca azzera solo cio' che
+// un lettore potrebbe vedere. Con discard attivo lo spazio viene anche restituito
+// al file system host con un buco nel file immagine.
+static void discard_blocks(int start, int count) {
+    // Un buco scavato durante una transazione raggiungerebbe il file subito.
+    if (!discard_enabled || count <= 0 || !file_system_file || txn_active) {
         return;
     }
+    off_t offset = (off_t)(data_blocks - (char*)fs) + (off_t)start * fs->bytes_per_block;
+    if (fallocate(fileno(file_system_file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t)count * fs->bytes_per_block) == -1) {
+        printf("discard: Hole punching not supported (%s), disabling discard\n", strerror(errno));
+        discard_enabled = 0;
+    }
+}
 
-    int block = current_dir->first_block;
-    printf("Contents of directory (%s):\n", fs->current_directory);
-    while (block != FAT_END) {
-        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-        for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-            DirectoryEntry* entry = &dir[i];
-            if (entry->name[0] == 0x00) {
-                continue;
-            }
-            if ((unsigned char)entry->name[0] == DELETED_ENTRY) {
-                continue;
-            }
-            if (entry->is_dir) {
-                printf("%.25s/\t", entry->name);
-            } else {
-                printf("%.25s.%.3s\t", entry->name, entry->extension);
-            }
+// Rilascia un riferimento alla catena che parte da block. I blocchi condivisi dalla
+// deduplicazione (block_refs > 1) perdono solo un riferimento e fermano il rilascio,
+// perche' il resto della catena appartiene ancora a un altro file.
+// Il contenuto dei blocchi appena liberati non serve piu': se ne rilascia la memoria.
+static void drop_blocks(int start, int count) {
+    if (count <= 0) {
+        return;
+    }
+    storage_advise(&data_blocks[(size_t)start * fs->bytes_per_block], (size_t)count * fs->bytes_per_block, STORAGE_DONTNEED);
+    discard_blocks(start, count);
+}
+
+void release_chain(int block) {
+    chunk_cache_first = FAT_END;
+    ra_file = NULL;
+    int run_start = FAT_END;
+    int run_len = 0;
+    while (block != FAT_END && block > 0 && block < fs->fat_entries) {
+        if (block_refs[block] > 1) {
+            block_refs[block]--;
+            break;
         }
+        block_refs[block] = 0;
         int next_block = fat_table[block];
-        if (next_block == FAT_UNUSED || next_block == FAT_END || next_block < 0 || next_block >= fs->fat_entries) {
-            break;
+        fat_set(block, FAT_UNUSED);
+        if (block == run_start + run_len) {
+            run_len++;
+        } else {
+            drop_blocks(run_start, run_len);
+            run_start = block;
+            run_len = 1;
         }
         block = next_block;
     }
-    printf("\n");
+    drop_blocks(run_start, run_len);
 }
 
-int create_dir(const char* name) {
-    printf("Creating directory: %s\n", name);
+// Integrita' dei cluster: crc_table tiene il CRC32C di ogni cluster di dati dei
+// file, ricalcolato da chi lo scrive; 0 indica un cluster non coperto (libero,
+// directory, indici e mappe), e fat_set lo azzera a ogni allocazione o rilascio.
+static uint32_t block_crc(int block) {
+    uint32_t crc = crc32c(0, &data_blocks[(size_t)block * fs->bytes_per_block], fs->bytes_per_block);
+    return crc ? crc : 1;
+}
 
-    DirectoryEntry* entry = find_empty_dir_entry();
-    if (entry == NULL) {
-        printf("Error: No empty directory entry found\n");
-        return DIR_CREATE_ERROR;
+void block_crc_update(int block) {
+    if (fs->features & FS_FEATURE_CHECKSUMS) {
+        crc_table[block] = block_crc(block);
     }
+}
 
-    memset(entry->name, ' ', sizeof(entry->name));
-    strncpy(entry->name, name, sizeof(entry->name) - 1); // Assicurati di non superare la lunghezza massima
-    entry->name[sizeof(entry->name) - 1] = '\0';
-    entry->size = 0;
-    entry->is_dir = 1;
-
-    int block = get_free_block();
-    if (block == FAT_FULL) {
-        printf("Error: No free block available\n");
-        return DIR_CREATE_ERROR;
+// 0 se il cluster e' integro o non coperto, CHECKSUM_ERROR altrimenti.
+int block_crc_verify(int block) {
+    if (!(fs->features & FS_FEATURE_CHECKSUMS) || crc_table[block] == 0 || crc_table[block] == block_crc(block)) {
+        return 0;
     }
+    return CHECKSUM_ERROR;
+}
 
-    printf("Allocating block %d for directory %s\n", block, name);
-    fat_table[block] = FAT_END;
-    DirectoryEntry* new_dir = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-    memset(new_dir, 0, fs->bytes_per_block);
+static int check_block(int block) {
+    if (block_crc_verify(block) != 0) {
+        printf("Error: Checksum mismatch in block %d\n", block);
+        return CHECKSUM_ERROR;
+    }
+    return 0;
+}
 
-    entry->first_block = block;
-    strncpy(new_dir[0].name, ".", sizeof(new_dir[0].name) - 1);
+// Disattivati, i CRC smettono di essere aggiornati; alla riattivazione la tabella
+// riparte vuota e i cluster tornano coperti man mano che vengono riscritti.
+int fs_set_checksums(int enabled) {
+    if (!fs) {
+        printf("checksum: No file system loaded\n");
+        return INIT_ERROR;
+    }
+    if (enabled && !(fs->features & FS_FEATURE_CHECKSUMS)) {
+        memset(crc_table, 0, fs->crc_size);
+        fs->features |= FS_FEATURE_CHECKSUMS;
+    } else if (!enabled) {
+        fs->features &= ~FS_FEATURE_CHECKSUMS;
+    }
+    fs_save();
+    fs_log("checksum: %s (%s)\n", enabled ? "enabled" : "disabled", crc32c_isa());
+    return 0;
+}
+
+int slots_per_block() {
+    return fs->bytes_per_block / sizeof(DirectoryEntry);
+}
+
+static int slot_in_block(const DirectoryEntry* entry) {
+    return (int)((((const char*)entry - data_blocks) % fs->bytes_per_block) / sizeof(DirectoryEntry));
+}
+
+int is_free_slot(const DirectoryEntry* entry) {
+    return entry->name[0] == 0x00 || (unsigned char)entry->name[0] == DELETED_ENTRY;
+}
+
+// Cerca extra_slots + 1 voci libere consecutive nello stesso blocco della directory
+// corrente; se non ci sono, la catena della directory viene estesa di un blocco.
+DirectoryEntry* find_empty_dir_run(int extra_slots) {
+    int per_block = slots_per_block();
+    if (extra_slots >= per_block) {
+        return NULL;
+    }
+
+    int block = current_dir->first_block;
+    int last_block = block;
+    while (block != FAT_END) {
+        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        SlotMasks masks;
+        dir_scan_block(dir, per_block, &masks);
+        // Bit i resta acceso se le voci da i a i + extra_slots sono tutte libere.
+        unsigned run = masks.free;
+        for (int k = 1; k <= extra_slots && run; k++) {
+            run &= masks.free >> k;
+        }
+        if (run) {
+            return &dir[__builtin_ctz(run)];
+        }
+        last_block = block;
+        PERF_HOP();
+        block = fat_table[block];
+    }
+
+    int new_block = get_free_block();
+    if (new_block == FAT_FULL) {
+        return NULL;
+    }
+    memset(&data_blocks[(size_t)new_block * fs->bytes_per_block], 0x00, fs->bytes_per_block);
+    fat_set(new_block, FAT_END);
+    fat_set(last_block, new_block);
+    return (DirectoryEntry*)&data_blocks[(size_t)new_block * fs->bytes_per_block];
+}
+
+DirectoryEntry* find_empty_dir_entry() {
+    return find_empty_dir_run(0);
+}
+
+// Copia fra buf e i dati inline di file, a partire da pos: le voci di continuazione
+// hanno il primo byte riservato al marcatore INLINE_DATA_ENTRY.
+static void inline_copy(DirectoryEntry* file, int pos, char* buf, int len, int to_file) {
+    while (len > 0) {
+        char* slot = (char*)(file + 1 + pos / INLINE_SLOT_DATA) + 1;
+        int slot_offset = pos % INLINE_SLOT_DATA;
+        int chunk = INLINE_SLOT_DATA - slot_offset < len ? INLINE_SLOT_DATA - slot_offset : len;
+        if (to_file) {
+            memcpy(slot + slot_offset, buf, chunk);
+        } else {
+            memcpy(buf, slot + slot_offset, chunk);
+        }
+        buf += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+}
+
+// Garantisce che i dati inline possano arrivare a new_size byte, occupando le voci
+// libere che seguono. Restituisce -1 se il file va spostato nei cluster.
+static int inline_reserve(DirectoryEntry* file, int new_size) {
+    int needed = (new_size + INLINE_SLOT_DATA - 1) / INLINE_SLOT_DATA;
+    if (needed <= file->entry_count) {
+        return 0;
+    }
+    if (needed > INLINE_MAX_SLOTS || slot_in_block(file) + needed >= slots_per_block()) {
+        return -1;
+    }
+    for (int i = file->entry_count + 1; i <= needed; i++) {
+        if (!is_free_slot(&file[i])) {
+            return -1;
+        }
+    }
+    for (int i = file->entry_count + 1; i <= needed; i++) {
+        memset(&file[i], 0x00, sizeof(DirectoryEntry));
+        file[i].name[0] = INLINE_DATA_ENTRY;
+    }
+    file->entry_count = needed;
+    return 0;
+}
+
+static void free_inline_slots(DirectoryEntry* file) {
+    for (int i = 1; i <= file->entry_count; i++) {
+        file[i].name[0] = DELETED_ENTRY;
+    }
+    file->entry_count = 0;
+}
+
+// Sposta un file inline in una catena di cluster, quando cresce oltre lo spazio inline.
+static int promote_inline(DirectoryEntry* file) {
+    char content[INLINE_MAX_SIZE];
+    inline_copy(file, 0, content, file->size, 0);
+
+    int first;
+    if (file->size > 0) {
+        first = alloc_chain_from(content, file->size);
+    } else {
+        first = get_free_block();
+        if (first != FAT_FULL) {
+            memset(&data_blocks[(size_t)first * fs->bytes_per_block], 0x00, fs->bytes_per_block);
+            fat_set(first, FAT_END);
+        }
+    }
+    if (first == FAT_FULL) {
+        return FAT_FULL;
+    }
+
+    free_inline_slots(file);
+    file->first_block = first;
+    count_chain(file);
+    file->flags &= ~FILE_INLINE;
+    fs_log("promote_inline: %.25s.%.3s moved to block %d\n", file->name, file->extension, first);
+    return 0;
+}
+
+// Porta un file inline nel formato sparso; i suoi dati, se ci sono, finiscono
+// nel blocco logico 0.
+static int inline_to_sparse(DirectoryEntry* file) {
+    char content[INLINE_MAX_SIZE];
+    inline_copy(file, 0, content, file->size, 0);
+
+    DirectoryEntry sparse = *file;
+    sparse.first_block = FAT_END;
+    sparse.entry_count = 0;
+    if (file->size > 0 && write_sparse(&sparse, content, 0, file->size) < 0) {
+        release_sparse(&sparse);
+        return FAT_FULL;
+    }
+
+    free_inline_slots(file);
+    file->first_block = sparse.first_block;
+    file->entry_count = sparse.entry_count;
+    file->flags = (file->flags & ~FILE_INLINE) | FILE_SPARSE;
+    fs_log("inline_to_sparse: %.25s.%.3s converted to a sparse file\n", file->name, file->extension);
+    return 0;
+}
+
+int cd(const char* dir_name) {
+    fs_log("Changing to directory: %s\n", dir_name);
+
+    if (strcmp(dir_name, ".") == 0) {
+        return INVALID_DIRECTORY; 
+    }
+
+    if (strcmp(dir_name, "..") == 0) {
+        if (current_dir->parent != NULL) {
+            current_dir = current_dir->parent;
+            strcpy(fs->current_directory, current_dir->name);
+        }
+        return 0;
+    }
+
+    int block = current_dir->first_block;
+    while (block != FAT_END) {
+        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        for (int i = 0; i < slots_per_block(); i++) {
+            DirectoryEntry* entry = &dir[i];
+            if (strcmp(entry->name, dir_name) == 0 && entry->is_dir) {
+                DirectoryEntry* parent = current_dir;
+                current_dir = (DirectoryEntry*)&data_blocks[(size_t)entry->first_block * fs->bytes_per_block];
+                current_dir->parent = parent;
+                strcpy(fs->current_directory, entry->name);
+                return 0;
+            }
+        }
+        PERF_HOP();
+        block = fat_table[block];
+        if (block < 0 || block >= fs->fat_entries) {
+            printf("Error: Block index out of bounds: %d\n", block);
+            return FILE_NOT_FOUND;
+        }
+    }
+    return FILE_NOT_FOUND;
+}
+
+
+void ls() {
+    if (current_dir == NULL) {
+        printf("Error: current_dir is NULL\n");
+        return;
+    }
+
+    int block = current_dir->first_block;
+    int per_block = slots_per_block();
+    printf("Contents of directory (%s):\n", fs->current_directory);
+    while (block != FAT_END) {
+        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        SlotMasks masks;
+        dir_scan_block(dir, per_block, &masks);
+        for (unsigned live = slot_live_mask(&masks, per_block); live; live &= live - 1) {
+            DirectoryEntry* entry = &dir[__builtin_ctz(live)];
+            if (entry->is_dir) {
+                printf("%.25s/\t", entry->name);
+            } else {
+                printf("%.25s.%.3s\t", entry->name, entry->extension);
+            }
+        }
+        int next_block = fat_table[block];
+        if (next_block == FAT_UNUSED || next_block == FAT_END || next_block < 0 || next_block >= fs->fat_entries) {
+            break;
+        }
+        block = next_block;
+    }
+    printf("\n");
+}
+
+int create_dir(const char* name) {
+    fs_log("Creating directory: %s\n", name);
+
+    DirectoryEntry* entry = find_empty_dir_entry();
+    if (entry == NULL) {
+        printf("Error: No empty directory entry found\n");
+        return DIR_CREATE_ERROR;
+    }
+
+    memset(entry->name, ' ', sizeof(entry->name));
+    strncpy(entry->name, name, sizeof(entry->name) - 1); // Assicurati di non superare la lunghezza massima
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    entry->size = 0;
+    entry->is_dir = 1;
+    entry->flags = 0;
+    dir_tag_update(entry);
+
+    int block = get_free_block();
+    if (block == FAT_FULL) {
+        printf("Error: No free block available\n");
+        return DIR_CREATE_ERROR;
+    }
+
+    fs_log("Allocating block %d for directory %s\n", block, name);
+    fat_set(block, FAT_END);
+    DirectoryEntry* new_dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+    memset(new_dir, 0, fs->bytes_per_block);
+
+    entry->first_block = block;
+    strncpy(new_dir[0].name, ".", sizeof(new_dir[0].name) - 1);
     new_dir[0].name[sizeof(new_dir[0].name) - 1] = '\0';
     new_dir[0].first_block = block;
     new_dir[0].is_dir = 1;
@@ -270,52 +1226,60 @@ int create_dir(const char* name) {
 
     fs_save();
 
-    printf("Directory created: %s at block %d\n", entry->name, block);
+    fs_log("Directory created: %s at block %d\n", entry->name, block);
 
     return 0;
 }
 
 
 int create_file(const char* name, const char* ext, int size, const char* data) {
-    DirectoryEntry* entry = find_empty_dir_entry();
+    return create_file_with_hint(name, ext, size, data, 0);
+}
+
+// size_hint e' la dimensione finale prevista: i cluster vengono riservati subito,
+// contigui quando possibile, e i dati iniziali scritti al loro interno.
+int create_file_with_hint(const char* name, const char* ext, int size, const char* data, int size_hint) {
+    int is_inline = size <= INLINE_MAX_SIZE && size_hint <= INLINE_MAX_SIZE;
+    int inline_slots = (size + INLINE_SLOT_DATA - 1) / INLINE_SLOT_DATA;
+    DirectoryEntry* entry = find_empty_dir_run(is_inline ? inline_slots : 0);
     if (entry == NULL) {
         return FILE_CREATE_ERROR;
     }
 
     memset(entry->name, ' ', sizeof(entry->name));
-    memset(entry->extension, ' ', sizeof(entry->extension));
+    memset(entry->extension, 0x00, sizeof(entry->extension));
 
     strncpy(entry->name, name, 24);
     entry->name[24] = '\0';
-    strncpy(entry->extension, ext, 3);
-    entry->extension[3] = '\0';
+    memcpy(entry->extension, ext, strnlen(ext, sizeof(entry->extension)));
     entry->size = size;
     entry->is_dir = 0;
-
-    int block = get_free_block();
-    if (block == FAT_FULL) {
-        return FILE_CREATE_ERROR;
-    }
-
+    entry->flags = 0;
     entry->parent = current_dir;
-    entry->first_block = block;
-    int block_size = fs->bytes_per_block;
-    int blocks_needed = (size + block_size - 1) / block_size;
-    int current_block = block;
+    entry->entry_count = 0;
+    entry->blocks = 0;
+    entry->extents = 0;
+    dir_tag_update(entry);
+
+    if (is_inline) {
+        entry->flags = FILE_INLINE;
+        entry->first_block = FAT_END;
+        inline_reserve(entry, size);
+        inline_copy(entry, 0, (char*)data, size, 1);
+        fs_save();
+        return 0;
+    }
 
-    for (int i = 0; i < blocks_needed; i++) {
-        if (current_block >= fs->fat_entries) {
-            printf("Error: Invalid block allocation.\n");
+    if (size_hint > size) {
+        entry->first_block = FAT_END;
+        if (reserve_chain(entry, size_hint) != 0 || write_chain(entry->first_block, data, size) < 0) {
+            release_chain(entry->first_block);
+            entry->name[0] = DELETED_ENTRY;
             return FILE_CREATE_ERROR;
         }
-        memcpy(&data_blocks[current_block * block_size], &data[i * block_size], block_size);
-        int next_block = get_free_block();
-        if (i == blocks_needed - 1) {
-            fat_table[current_block] = FAT_END;
-        } else {
-            fat_table[current_block] = next_block;
-        }
-        current_block = next_block;
+    } else if (store_file_data(entry, data, size) != 0) {
+        entry->name[0] = DELETED_ENTRY;
+        return FILE_CREATE_ERROR;
     }
 
     fs_save();
@@ -323,74 +1287,133 @@ int create_file(const char* name, const char* ext, int size, const char* data) {
     return 0;
 }
 
-DirectoryEntry* locate_file(const char* name, const char* ext, char is_dir) {
+static uint8_t name_tag(const char* name, const char* ext, char is_dir) {
+    if (name[0] == 0x00 || (unsigned char)name[0] == DELETED_ENTRY || name[0] == INLINE_DATA_ENTRY) {
+        return 0;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0, n = strnlen(name, 24); i < n; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    hash = (hash ^ '.') * 16777619u;
+    for (size_t i = 0, n = strnlen(ext, 3); i < n; i++) {
+        hash = (hash ^ (unsigned char)ext[i]) * 16777619u;
+    }
+    hash = (hash ^ (unsigned char)is_dir) * 16777619u;
+    uint8_t tag = (uint8_t)(hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24));
+    return tag ? tag : 1;
+}
+
+static uint8_t entry_tag(const DirectoryEntry* entry) {
+    char ext[4];
+    memcpy(ext, entry->extension, 3);
+    ext[3] = '\0';
+    return name_tag(entry->name, ext, entry->is_dir);
+}
+
+void dir_tags_invalidate(int block) {
+    if (block >= 0 && block < dir_tags_count) {
+        dir_tags[block].tag[DIR_TAG_VALID] = 0;
+    }
+}
+
+// Da chiamare quando una voce gia' in uso cambia nome, estensione o tipo.
+static void dir_tag_update(const DirectoryEntry* entry) {
+    int block = (int)(((const char*)entry - data_blocks) / fs->bytes_per_block);
+    if (block >= 0 && block < dir_tags_count && dir_tags[block].tag[DIR_TAG_VALID]) {
+        dir_tags[block].tag[slot_in_block(entry)] = entry_tag(entry);
+    }
+}
+
+// Maschera delle voci del blocco la cui impronta vale tag.
+static unsigned dir_tag_match(int block, const DirectoryEntry* dir, uint8_t tag) {
+    int per_block = slots_per_block();
+    unsigned all = (1u << per_block) - 1;
+    if (tag == 0 || block < 0 || block >= dir_tags_count) {
+        return all;
+    }
+    DirTags* tags = &dir_tags[block];
+    if (!tags->tag[DIR_TAG_VALID]) {
+        for (int i = 0; i < per_block; i++) {
+            tags->tag[i] = entry_tag(&dir[i]);
+        }
+        tags->tag[DIR_TAG_VALID] = 1;
+    }
+#ifdef __SSE2__
+    __m128i hits = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)tags->tag), _mm_set1_epi8((char)tag));
+    return (unsigned)_mm_movemask_epi8(hits) & all;
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < per_block; i++) {
+        mask |= (unsigned)(tags->tag[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+static DirectoryEntry* find_entry(const char* name, const char* ext, char is_dir) {
     int block = current_dir->first_block;
-    printf("locate_file: Searching for %s.%s in directory %s\n", name, ext, current_dir->name);
+    uint8_t tag = name_tag(name, ext, is_dir);
+    fs_log("locate_file: Searching for %s.%s in directory %s\n", name, ext, current_dir->name);
     while (block != FAT_END) {
-        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-        for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-            DirectoryEntry* entry = &dir[i];
-            printf("locate_file: Checking entry %.25s.%.3s\n", entry->name, entry->extension);
+        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        unsigned candidates = dir_tag_match(block, dir, tag);
+        while (candidates) {
+            DirectoryEntry* entry = &dir[__builtin_ctz(candidates)];
+            candidates &= candidates - 1;
+            fs_log("locate_file: Checking entry %.25s.%.3s\n", entry->name, entry->extension);
             if (strncmp(entry->name, name, 24) == 0 && strncmp(entry->extension, ext, 3) == 0 && entry->is_dir == is_dir) {
-                printf("locate_file: Found %.25s.%.3s\n", name, ext);
+                fs_log("locate_file: Found %.25s.%.3s\n", name, ext);
                 return entry;
             }
         }
+        PERF_HOP();
         block = fat_table[block];
     }
-    printf("locate_file: %s.%s not found\n", name, ext);
+    fs_log("locate_file: %s.%s not found\n", name, ext);
     return NULL;
 }
 
+DirectoryEntry* locate_file(const char* name, const char* ext, char is_dir) {
+    uint64_t start = perf_begin();
+    uint64_t hops = perf_hops;
+    DirectoryEntry* entry = find_entry(name, ext, is_dir);
+    perf_end(PERF_LOCATE_FILE, start, hops, 0);
+    return entry;
+}
+
 
 
 int is_directory_empty(DirectoryEntry* dir) {
     int block = dir->first_block;
+    int per_block = slots_per_block();
     while (block != FAT_END) {
-        DirectoryEntry* d = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-        for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-            DirectoryEntry* entry = &d[i];
-            if (entry->name[0] != 0x00 && (unsigned char)entry->name[0] != DELETED_ENTRY && strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
-                return 0; 
+        DirectoryEntry* d = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        SlotMasks masks;
+        dir_scan_block(d, per_block, &masks);
+        for (unsigned used = ~masks.free & ((1u << per_block) - 1); used; used &= used - 1) {
+            DirectoryEntry* entry = &d[__builtin_ctz(used)];
+            if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+                return 0;
             }
         }
+        PERF_HOP();
         block = fat_table[block];
     }
     return 1; 
 }
 
 int remove_file(const char* name, const char* ext) {
-    printf("Attempting to remove file: %s.%s\n", name, ext);
+    fs_log("Attempting to remove file: %s.%s\n", name, ext);
     DirectoryEntry* file = locate_file(name, ext, 0);
     if (file == NULL) {
         printf("File not found: %s.%s\n", name, ext);
         return FILE_NOT_FOUND;
     }
 
-    printf("Removing file: %s.%s\n", name, ext);
-
-    int current_block = file->first_block;
-    int next_block;
-
-    while (current_block != FAT_END && current_block != 0) {
-
-
-        next_block = fat_table[current_block];
-        if (next_block < 0 || next_block >= fs->fat_entries) {
-            fat_table[current_block] = FAT_UNUSED;
-            memset(&data_blocks[current_block * fs->bytes_per_block], 0x00, fs->bytes_per_block);
-            break;
-        }
-
-        fat_table[current_block] = FAT_UNUSED;
-        memset(&data_blocks[current_block * fs->bytes_per_block], 0x00, fs->bytes_per_block);
-
-        if (next_block == FAT_END || next_block == 0) {
-            break;
-        }
+    fs_log("Removing file: %s.%s\n", name, ext);
 
-        current_block = next_block;
-    }
+    release_file_storage(file);
 
     file->name[0] = DELETED_ENTRY;
 
@@ -399,13 +1422,13 @@ int remove_file(const char* name, const char* ext) {
         return FILE_WRITE_ERROR;
     }
 
-    printf("File removed: %s.%s\n", name, ext);
+    fs_log("File removed: %s.%s\n", name, ext);
     return 0;
 }
 
 
 int remove_dir(const char* name, int recursive) {
-    printf("Attempting to remove directory: %s\n", name);
+    fs_log("Attempting to remove directory: %s\n", name);
     DirectoryEntry* dir = locate_file(name, "", 1);
     if (dir == NULL) {
         printf("Directory not found: %s\n", name);
@@ -413,7 +1436,7 @@ int remove_dir(const char* name, int recursive) {
     }
 
     if (is_directory_empty(dir)) {
-        printf("Directory is empty: %s\n", name);
+        fs_log("Directory is empty: %s\n", name);
         return remove_empty_dir(dir);
     } else if (recursive == 1) {
         DirectoryEntry* temp = current_dir;
@@ -421,10 +1444,12 @@ int remove_dir(const char* name, int recursive) {
 
         int block = dir->first_block;
         while (block != FAT_END) {
-            DirectoryEntry* d = (DirectoryEntry*)&data_blocks[block * fs->bytes_per_block];
-            for (int i = 0; i < fs->bytes_per_block / sizeof(DirectoryEntry); i++) {
-                DirectoryEntry* entry = &d[i];
-                if (entry->name[0] == 0x00 || entry->name[0] == DELETED_ENTRY || strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+            DirectoryEntry* d = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+            SlotMasks masks;
+            dir_scan_block(d, slots_per_block(), &masks);
+            for (unsigned live = slot_live_mask(&masks, slots_per_block()); live; live &= live - 1) {
+                DirectoryEntry* entry = &d[__builtin_ctz(live)];
+                if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
                     continue;
                 }
                 if (entry->is_dir) {
@@ -435,11 +1460,12 @@ int remove_dir(const char* name, int recursive) {
                     if (res != 0) return res;
                 }
             }
+            PERF_HOP();
             block = fat_table[block];
         }
 
         current_dir = temp;
-        printf("Directory removed: %s\n", name);
+        fs_log("Directory removed: %s\n", name);
         return remove_empty_dir(dir);
     } else {
         printf("Directory not empty and recursive flag not set: %s\n", name);
@@ -452,363 +1478,1827 @@ int remove_dir(const char* name, int recursive) {
 int remove_empty_dir(DirectoryEntry* dir) {
     int current_block = dir->first_block;
     while (current_block != FAT_END) {
-        printf("Clearing block %d\n", current_block);
-        memset(&data_blocks[current_block * fs->bytes_per_block], 0x00, fs->bytes_per_block);
+        fs_log("Clearing block %d\n", current_block);
+        discard_blocks(current_block, 1);
         int next_block = fat_table[current_block];
-        fat_table[current_block] = FAT_UNUSED;
+        fat_set(current_block, FAT_UNUSED);
         current_block = next_block;
     }
 
     memset(dir, 0x00, sizeof(DirectoryEntry));
 
     fs_save();
-    printf("Directory removed.\n");
+    fs_log("Directory removed.\n");
     return 0;
 }
 
+#define RENAME_MAX_PATH 256
 
-void display_fs_image(unsigned int max_bytes) {
-    if (max_bytes > fs->bytes_per_block * fs->total_blocks) {
-        max_bytes = fs->bytes_per_block * fs->total_blocks;
+// Porta current_dir sulla directory che contiene l'ultimo componente di path, a
+// partire dalla radice se il percorso inizia con '/'. leaf resta vuoto quando il
+// percorso indica una directory ("/", "a/").
+static int enter_path_parent(char* path, char** leaf) {
+    char* component = path;
+    if (*component == '/') {
+        current_dir = (DirectoryEntry*)data_blocks;
+        strcpy(fs->current_directory, current_dir->name);
     }
-    for (int i = 0; i < max_bytes; i++) {
-        printf(" <%02x> ", *(fat_table + i));
+    *leaf = path + strlen(path);
+    while (*component == '/') {
+        component++;
     }
-    printf("\n"); 
+    while (*component) {
+        char* slash = strchr(component, '/');
+        if (!slash) {
+            *leaf = component;
+            return 0;
+        }
+        *slash = '\0';
+        if (strcmp(component, ".") != 0 && cd(component) != 0) {
+            return FILE_NOT_FOUND;
+        }
+        component = slash + 1;
+        while (*component == '/') {
+            component++;
+        }
+    }
+    return 0;
 }
 
-
-
-int read_file_content(FileHandle *handle, char *buffer, int size) {
-    if (!handle || !handle->file_entry || !buffer || size <= 0) {
-        printf("read_file_content: Invalid parameters\n");
-        return FILE_READ_ERROR;
+// Divide leaf in nome ed estensione all'ultimo punto, troncandoli come create_file.
+static void split_leaf(const char* leaf, char* name, char* ext) {
+    const char* dot = strrchr(leaf, '.');
+    int name_len = dot && dot != leaf ? (int)(dot - leaf) : (int)strlen(leaf);
+    memset(name, 0, 25);
+    memset(ext, 0, 4);
+    memcpy(name, leaf, name_len < 24 ? name_len : 24);
+    if (dot && dot != leaf) {
+        strncpy(ext, dot + 1, 3);
     }
+}
 
-    DirectoryEntry* file_entry = handle->file_entry;
-    int bytes_read = 0;
-    int total_size = file_entry->size;
-    int current_block = file_entry->first_block;
-    int byte_offset = handle->position % BLOCK_SIZE;
-
-    if (handle->position >= total_size) {
-        buffer[0] = '\0';
-        return 0;
+// Cerca prima un file con l'estensione indicata, poi una directory con il nome intero.
+static DirectoryEntry* locate_leaf(const char* leaf) {
+    char name[25];
+    char ext[4];
+    split_leaf(leaf, name, ext);
+    DirectoryEntry* entry = locate_file(name, ext, 0);
+    if (entry == NULL) {
+        memset(name, 0, sizeof(name));
+        strncpy(name, leaf, 24);
+        entry = locate_file(name, "", 1);
     }
+    return entry;
+}
 
-    int blocks_to_skip = handle->position / BLOCK_SIZE;
-    for (int i = 0; i < blocks_to_skip; i++) {
-        current_block = fat_table[current_block];
-        if (current_block == FAT_END) {
-            return bytes_read;
+// Vero se la directory che inizia in block e' dir_block o sta al suo interno:
+// si risale lungo le voci ".." fino alla radice.
+static int dir_is_within(int block, int dir_block) {
+    for (int hops = 0; hops < fs->total_blocks; hops++) {
+        if (block == dir_block) {
+            return 1;
+        }
+        if (block == 0) {
+            return 0;
         }
+        block = ((DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block])[1].first_block;
     }
+    return 1;
+}
 
-    while (bytes_read < size && handle->position < total_size) {
-        int bytes_to_copy = BLOCK_SIZE - byte_offset;
-        if (bytes_read + bytes_to_copy > size) {
-            bytes_to_copy = size - bytes_read;
-        }
-        if (handle->position + bytes_to_copy > total_size) {
-            bytes_to_copy = total_size - handle->position;
-        }
+// Sposta o rinomina un file o una directory. Cambiano solo le voci di directory
+// (la voce stessa, le sue voci inline e, per una directory, la sua voce ".."):
+// i cluster dei dati restano dove sono. Se dst_path indica una directory
+// esistente, la voce vi viene spostata con il nome che ha. Le modifiche passano
+// da una transazione, cosi' un crash lascia la voce nella vecchia posizione o
+// nella nuova, mai in entrambe o in nessuna.
+int fs_rename(const char* src_path, const char* dst_path) {
+    if (!file_system_file) {
+        printf("rename: No file system loaded\n");
+        return INIT_ERROR;
+    }
+    if (strlen(src_path) >= RENAME_MAX_PATH || strlen(dst_path) >= RENAME_MAX_PATH) {
+        printf("rename: Path too long\n");
+        return INVALID_DIRECTORY;
+    }
 
-        if (current_block >= fs->fat_entries || current_block == FAT_UNUSED || current_block == 0) {
-            return FILE_READ_ERROR;
-        }
+    char src[RENAME_MAX_PATH];
+    char dst[RENAME_MAX_PATH];
+    strcpy(src, src_path);
+    strcpy(dst, dst_path);
 
-        printf("read_file_content: Reading %d bytes from block %d\n", bytes_to_copy, current_block); 
-        memcpy(buffer + bytes_read, data_blocks + current_block * BLOCK_SIZE + byte_offset, bytes_to_copy);
-        bytes_read += bytes_to_copy;
-        handle->position += bytes_to_copy;
-        byte_offset = 0;
+    DirectoryEntry* saved_dir = current_dir;
+    char saved_name[sizeof(fs->current_directory)];
+    memcpy(saved_name, fs->current_directory, sizeof(saved_name));
 
-        if (handle->position < total_size) {
-            int next_block = fat_table[current_block];
-            if (next_block == FAT_END) {
-                break;
-            }
-            if (next_block >= fs->fat_entries || next_block == FAT_UNUSED || next_block == 0) {
-                return FILE_READ_ERROR;
-            }
-            current_block = next_block;
-        }
+    char* leaf;
+    DirectoryEntry* entry = NULL;
+    if (enter_path_parent(src, &leaf) == 0 && *leaf && strcmp(leaf, ".") != 0 && strcmp(leaf, "..") != 0) {
+        entry = locate_leaf(leaf);
+    }
+    DirectoryEntry* src_dir = current_dir;
+    current_dir = saved_dir;
+    memcpy(fs->current_directory, saved_name, sizeof(saved_name));
+    if (entry == NULL) {
+        printf("rename: Not found: %s\n", src_path);
+        return FILE_NOT_FOUND;
+    }
+
+    char name[25];
+    char ext[4];
+    int res = enter_path_parent(dst, &leaf);
+    if (res == 0 && (*leaf == '\0' || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0)) {
+        res = strcmp(leaf, "..") == 0 ? cd(leaf) : 0;
+        leaf = "";
+    } else if (res == 0 && locate_file(leaf, "", 1) != NULL) {
+        res = cd(leaf);
+        leaf = "";
+    }
+    if (*leaf == '\0') {
+        // Destinazione e' una directory: il nome resta quello della sorgente.
+        memcpy(name, entry->name, 24);
+        name[24] = '\0';
+        memset(ext, 0, sizeof(ext));
+        memcpy(ext, entry->extension, 3);
+    } else if (entry->is_dir) {
+        memset(name, 0, sizeof(name));
+        strncpy(name, leaf, 24);
+        memset(ext, 0, sizeof(ext));
+    } else {
+        split_leaf(leaf, name, ext);
+    }
+    DirectoryEntry* dst_dir = current_dir;
+    DirectoryEntry* existing = res == 0 ? locate_file(name, ext, entry->is_dir) : NULL;
+    current_dir = saved_dir;
+    memcpy(fs->current_directory, saved_name, sizeof(saved_name));
+
+    if (res != 0) {
+        printf("rename: Destination directory not found: %s\n", dst_path);
+        return FILE_NOT_FOUND;
+    }
+    if (name[0] == '\0' || (unsigned char)name[0] == DELETED_ENTRY || name[0] == INLINE_DATA_ENTRY) {
+        printf("rename: Invalid name: %s\n", dst_path);
+        return FILE_CREATE_ERROR;
+    }
+    if (existing == entry) {
+        return 0;
+    }
+    if (existing != NULL) {
+        printf("rename: Destination already exists: %s\n", dst_path);
+        return FILE_CREATE_ERROR;
+    }
+    if (entry->is_dir && dir_is_within(dst_dir->first_block, entry->first_block)) {
+        printf("rename: Cannot move a directory inside itself: %s\n", src_path);
+        return INVALID_DIRECTORY;
+    }
+
+    // Dentro una transazione, esplicita o del gruppo, la rinomina ne fa parte;
+    // altrimenti ne apre e chiude una propria.
+    int own_txn = !txn_active && !deferred_save;
+    if (own_txn ? fs_txn_begin() != 0 : join_group_txn() != 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    DirectoryEntry* target = entry;
+    if (dst_dir->first_block != src_dir->first_block) {
+        int extra = entry->flags & FILE_INLINE ? entry->entry_count : 0;
+        current_dir = dst_dir;
+        target = find_empty_dir_run(extra);
+        current_dir = saved_dir;
+        if (target == NULL) {
+            printf("rename: No empty directory entry found\n");
+            if (own_txn) {
+                fs_txn_abort();
+                current_dir = saved_dir;
+            }
+            return FILE_CREATE_ERROR;
+        }
+        memcpy(target, entry, (size_t)(extra + 1) * sizeof(DirectoryEntry));
+        for (int i = 0; i <= extra; i++) {
+            entry[i].name[0] = DELETED_ENTRY;
+        }
+        if (ra_file == entry) {
+            ra_file = NULL;
+        }
+        if (target->is_dir) {
+            DirectoryEntry* self = (DirectoryEntry*)&data_blocks[(size_t)target->first_block * fs->bytes_per_block];
+            self[0].parent = dst_dir;
+            self[1].parent = dst_dir;
+            self[1].first_block = dst_dir->first_block;
+        } else {
+            target->parent = dst_dir;
+        }
+    }
+    memcpy(target->name, name, sizeof(name));
+    memcpy(target->extension, ext, 3);
+    dir_tag_update(target);
+
+    // La directory corrente rinominata cambia anche il nome mostrato.
+    if (target->is_dir && target->first_block == current_dir->first_block && current_dir != (DirectoryEntry*)data_blocks) {
+        strcpy(fs->current_directory, target->name);
+    }
+
+    fs_save();
+    if (own_txn && fs_txn_commit() != 0) {
+        fs_txn_abort();
+        current_dir = saved_dir;
+        memcpy(fs->current_directory, saved_name, sizeof(saved_name));
+        return FILE_WRITE_ERROR;
+    }
+    fs_log("rename: %s -> %s\n", src_path, dst_path);
+    return 0;
+}
+
+
+void display_fs_image(unsigned int max_bytes) {
+    if ((size_t)max_bytes > (size_t)fs->bytes_per_block * fs->total_blocks) {
+        max_bytes = (size_t)fs->bytes_per_block * fs->total_blocks;
+    }
+    for (unsigned int i = 0; i < max_bytes; i++) {
+        printf(" <%02x> ", *(fat_table + i));
+    }
+    printf("\n"); 
+}
+
+
+
+int read_file_content(FileHandle *handle, char *buffer, int size) {
+    if (!handle || !handle->file_entry || !buffer || size <= 0) {
+        printf("read_file_content: Invalid parameters\n");
+        return FILE_READ_ERROR;
+    }
+
+    int bytes_read = fs_read(handle, buffer, size);
+    if (bytes_read < 0) {
+        return bytes_read;
     }
 
     if (bytes_read < size) {
         buffer[bytes_read] = '\0';
+    }
+
+    printf("File content:\n%.*s\n", bytes_read, buffer);
+
+    return bytes_read;
+}
+
+// Come read_file_content, ma senza stampare il contenuto letto.
+int fs_read(FileHandle *handle, char *buffer, int size) {
+    if (!handle || !handle->file_entry || !buffer || size <= 0) {
+        return FILE_READ_ERROR;
+    }
+
+    uint64_t start = perf_begin();
+    uint64_t hops = perf_hops;
+    int bytes_read = read_file_data(handle, buffer, size);
+    perf_end(PERF_READ, start, hops, bytes_read > 0 ? bytes_read : 0);
+    return bytes_read;
+}
+
+// Segnala i blocchi della catena fino a READAHEAD_BLOCKS oltre la posizione di
+// lettura, raggruppati in corse contigue. Si riparte dal blocco corrente quando
+// cambia il file o la lettura salta fuori dalla finestra; altrimenti si
+// prosegue da ra_block, cosi' ogni anello viene seguito una volta sola. I passi
+// non entrano nelle statistiche: non fanno parte della lettura richiesta.
+static void readahead_chain(DirectoryEntry* file, int position, int block, int chain_size) {
+    int window = READAHEAD_BLOCKS * BLOCK_SIZE;
+    position -= position % BLOCK_SIZE;
+    if (ra_file != file || position > ra_limit || position + window < ra_limit) {
+        ra_file = file;
+        ra_block = block;
+        ra_limit = position;
+    }
+    if (ra_limit - position >= window / 2) {
+        return;
+    }
+
+    int blocks = data_block_count();
+    int run_start = FAT_END;
+    int run_len = 0;
+    while (ra_limit - position < window && ra_limit < chain_size && ra_block > 0 && ra_block < blocks) {
+        if (ra_block != run_start + run_len) {
+            if (run_len > 0) {
+                storage_advise(&data_blocks[(size_t)run_start * BLOCK_SIZE], (size_t)run_len * BLOCK_SIZE, STORAGE_WILLNEED);
+            }
+            run_start = ra_block;
+            run_len = 0;
+        }
+        run_len++;
+        ra_block = fat_table[ra_block];
+        ra_limit += BLOCK_SIZE;
+    }
+    if (run_len > 0) {
+        storage_advise(&data_blocks[(size_t)run_start * BLOCK_SIZE], (size_t)run_len * BLOCK_SIZE, STORAGE_WILLNEED);
+    }
+}
+
+// Legge dalla posizione corrente del handle, qualunque sia il formato del file.
+static int read_file_data(FileHandle *handle, char *buffer, int size) {
+    if (handle->file_entry->flags & FILE_COMPRESSED) {
+        return read_compressed(handle, buffer, size);
+    }
+
+    if (handle->file_entry->flags & FILE_SPARSE) {
+        return read_sparse(handle, buffer, size);
+    }
+
+    if (handle->file_entry->flags & FILE_INLINE) {
+        int bytes_read = handle->file_entry->size - handle->position;
+        if (bytes_read > size) {
+            bytes_read = size;
+        }
+        if (bytes_read < 0) {
+            bytes_read = 0;
+        }
+        inline_copy(handle->file_entry, handle->position, buffer, bytes_read, 0);
+        handle->position += bytes_read;
+        return bytes_read;
+    }
+
+    DirectoryEntry* file_entry = handle->file_entry;
+    int bytes_read = 0;
+    int total_size = file_entry->size;
+    int chain_size = (file_entry->flags & FILE_TAIL_PACKED) ? total_size / BLOCK_SIZE * BLOCK_SIZE : total_size;
+    int current_block = file_entry->first_block;
+    int byte_offset = handle->position % BLOCK_SIZE;
+
+    if (handle->position >= total_size) {
+        buffer[0] = '\0';
+        return 0;
+    }
+
+    int blocks_to_skip = handle->position < chain_size ? handle->position / BLOCK_SIZE : 0;
+    for (int i = 0; i < blocks_to_skip; i++) {
+        PERF_HOP();
+        current_block = fat_table[current_block];
+        if (current_block == FAT_END) {
+            return bytes_read;
+        }
+    }
+
+    while (bytes_read < size && handle->position < chain_size) {
+        int bytes_to_copy = BLOCK_SIZE - byte_offset;
+        if (bytes_read + bytes_to_copy > size) {
+            bytes_to_copy = size - bytes_read;
+        }
+        if (handle->position + bytes_to_copy > chain_size) {
+            bytes_to_copy = chain_size - handle->position;
+        }
+
+        if (current_block >= fs->fat_entries || current_block == FAT_UNUSED || current_block == 0) {
+            return FILE_READ_ERROR;
+        }
+
+        readahead_chain(file_entry, handle->position, current_block, chain_size);
+        if (check_block(current_block) != 0) {
+            return CHECKSUM_ERROR;
+        }
+        fs_log("read_file_content: Reading %d bytes from block %d\n", bytes_to_copy, current_block); 
+        memcpy(buffer + bytes_read, data_blocks + (size_t)current_block * BLOCK_SIZE + byte_offset, bytes_to_copy);
+        bytes_read += bytes_to_copy;
+        handle->position += bytes_to_copy;
+        byte_offset = 0;
+
+        if (handle->position < chain_size) {
+            int next_block = fat_table[current_block];
+            if (next_block == FAT_END) {
+                break;
+            }
+            if (next_block >= fs->fat_entries || next_block == FAT_UNUSED || next_block == 0) {
+                return FILE_READ_ERROR;
+            }
+            current_block = next_block;
+        }
+    }
+
+    if ((file_entry->flags & FILE_TAIL_PACKED) && bytes_read < size && handle->position >= chain_size) {
+        int bytes_to_copy = total_size - handle->position;
+        if (bytes_to_copy > size - bytes_read) {
+            bytes_to_copy = size - bytes_read;
+        }
+        memcpy(buffer + bytes_read, tail_data(file_entry) + handle->position - chain_size, bytes_to_copy);
+        bytes_read += bytes_to_copy;
+        handle->position += bytes_to_copy;
+    }
+
+    return bytes_read;
+}
+
+
+int write_file_content(const char* name, const char* ext, const char* data, int offset, int size) {
+    uint64_t start = perf_begin();
+    uint64_t hops = perf_hops;
+    int res = write_file_data(name, ext, data, offset, size);
+    perf_end(PERF_WRITE, start, hops, res > 0 ? res : 0);
+    return res;
+}
+
+static int write_file_data(const char* name, const char* ext, const char* data, int offset, int size) {
+    fs_log("write_file_content: Received %d bytes to write to file '%s.%s'\n", size, name, ext); 
+
+    DirectoryEntry* file = locate_file(name, ext, 0);
+    if (file == NULL) {
+        return FILE_NOT_FOUND;
+    }
+    ra_file = NULL;
+
+    if (offset == -1) {
+        offset = file->size;
+    }
+
+    if (unshare_file(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    if ((file->flags & FILE_COMPRESSED) && inflate_file(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    if (file->flags & FILE_INLINE) {
+        int new_size = offset + size > file->size ? offset + size : file->size;
+        if (inline_reserve(file, new_size) == 0) {
+            if (offset > file->size) {
+                char zeros[INLINE_MAX_SIZE] = { 0 };
+                inline_copy(file, file->size, zeros, offset - file->size, 1);
+            }
+            inline_copy(file, offset, (char*)data, size, 1);
+            file->size = new_size;
+            fs_save();
+            fs_log("write_file_content: Written %d bytes inline to file '%s.%s' starting at offset %d\n", size, name, ext, offset);
+            return size;
+        }
+        // Se la scrittura rende il file sparso, i dati inline passano direttamente
+        // nella mappa: una catena allocherebbe il blocco logico 0 anche se vuoto.
+        if (offset / fs->bytes_per_block > (file->size > 0 ? 1 : 0)) {
+            if (inline_to_sparse(file) != 0) {
+                return FILE_WRITE_ERROR;
+            }
+        } else if (promote_inline(file) != 0) {
+            return FILE_WRITE_ERROR;
+        }
+    }
+
+    if ((file->flags & FILE_TAIL_PACKED) && unpack_tail(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    // Una scrittura che salta almeno un cluster intero oltre la fine della catena
+    // passa al formato sparso invece di allocare i cluster intermedi.
+    if (!(file->flags & FILE_SPARSE) && offset / fs->bytes_per_block > chain_length(file->first_block) &&
+        make_sparse(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    if (file->flags & FILE_SPARSE) {
+        int written = write_sparse(file, data, offset, size);
+        if (written < 0) {
+            printf("write_file_content: No space left for %d bytes at offset %d\n", size, offset);
+            return FILE_WRITE_ERROR;
+        }
+        if (offset + written > file->size) {
+            file->size = offset + written;
+        }
+        fs_save();
+        fs_log("write_file_content: Written %d bytes to sparse file '%s.%s' starting at offset %d\n", written, name, ext, offset);
+        return written;
+    }
+
+    // Tutti i cluster che servono vengono riservati prima di scrivere,
+    // cosi' il ciclo di scrittura segue solo la catena.
+    if (reserve_chain(file, offset + size) != 0) {
+        printf("write_file_content: No space left for %d bytes at offset %d\n", size, offset);
+        return FILE_WRITE_ERROR;
+    }
+
+    // I cluster riservati o riusati non sono azzerati: il tratto fra la vecchia
+    // fine del file e offset diventerebbe leggibile, quindi va azzerato ora.
+    if (offset > file->size) {
+        zero_chain_range(file->first_block, file->size, offset);
+    }
+
+    int block_size = fs->bytes_per_block;
+    int current_block = chain_block_at(file->first_block, offset / block_size);
+    int byte_offset = offset % block_size;
+    int bytes_written = 0;
+
+    while (bytes_written < size) {
+        if (current_block == FAT_END || current_block <= 0 || current_block >= fs->fat_entries) {
+            printf("write_file_content: Error - current_block %d is out of bounds, unused, or invalid\n", current_block);
+            return FILE_WRITE_ERROR;
+        }
+
+        int bytes_to_write = (size - bytes_written > block_size - byte_offset) ? block_size - byte_offset : size - bytes_written;
+        memcpy(&data_blocks[(size_t)current_block * block_size + byte_offset], data + bytes_written, bytes_to_write);
+        block_crc_update(current_block);
+
+        bytes_written += bytes_to_write;
+        byte_offset = 0;
+        PERF_HOP();
+        current_block = fat_table[current_block];
+    }
+
+    file->size = offset + bytes_written > file->size ? offset + bytes_written : file->size;
+
+    if (tail_packing_enabled) {
+        pack_tail(file);
+    }
+
+    fs_save();
+
+    fs_log("write_file_content: Written %d bytes to file '%s.%s' starting at offset %d\n", bytes_written, name, ext, offset);
+
+    return bytes_written;
+}
+
+
+
+int seek_file(FileHandle *handle, int offset, int origin) {
+    int new_position = handle->position;
+
+    if (origin == SEEK_SET) {
+        new_position = offset;
+    } else if (origin == SEEK_CUR) {
+        new_position += offset;
+    } else if (origin == SEEK_END) {
+        new_position = handle->file_entry->size + offset; 
+    } else if (origin == FS_SEEK_DATA || origin == FS_SEEK_HOLE) {
+        new_position = seek_data_or_hole(handle->file_entry, offset, origin == FS_SEEK_DATA);
+    } else {
+        return -1;
+    }
+
+    if (new_position < 0 || new_position > handle->file_entry->size) {
+        return -1; 
+    }
+
+    handle->position = new_position;
+    return 0;
+}
+
+// Copia data in una catena nuova di blocchi privati.
+// Restituisce il primo blocco oppure FAT_FULL.
+static int alloc_chain_from(const char* data, int len) {
+    int block_size = fs->bytes_per_block;
+    int first = FAT_END;
+    int prev = FAT_END;
+    for (int done = 0; done < len; done += block_size) {
+        int block = get_free_block();
+        if (block == FAT_FULL) {
+            release_chain(first);
+            return FAT_FULL;
+        }
+        int chunk = len - done < block_size ? len - done : block_size;
+        memcpy(&data_blocks[(size_t)block * block_size], data + done, chunk);
+        memset(&data_blocks[(size_t)block * block_size + chunk], 0x00, block_size - chunk);
+        fat_set(block, FAT_END);
+        block_crc_update(block);
+        if (prev == FAT_END) {
+            first = block;
+        } else {
+            fat_set(prev, block);
+        }
+        prev = block;
+    }
+    return first;
+}
+
+// Legge size byte di una catena non compressa partendo dal primo blocco.
+// Azzera i byte [from, to) di una catena gia' allocata.
+static void zero_chain_range(int block, int from, int to) {
+    int block_size = fs->bytes_per_block;
+    block = chain_block_at(block, from / block_size);
+    while (from < to && block != FAT_END && block > 0 && block < fs->fat_entries) {
+        int byte_offset = from % block_size;
+        int len = block_size - byte_offset < to - from ? block_size - byte_offset : to - from;
+        memset(&data_blocks[(size_t)block * block_size + byte_offset], 0x00, len);
+        block_crc_update(block);
+        from += len;
+        PERF_HOP();
+        block = fat_table[block];
+    }
+}
+
+// Scrive size byte all'inizio di una catena gia' allocata.
+static int write_chain(int block, const char* data, int size) {
+    int block_size = fs->bytes_per_block;
+    for (int done = 0; done < size; done += block_size) {
+        if (block == FAT_END || block <= 0 || block >= fs->fat_entries) {
+            return FILE_WRITE_ERROR;
+        }
+        int chunk = size - done < block_size ? size - done : block_size;
+        memcpy(&data_blocks[(size_t)block * block_size], data + done, chunk);
+        block_crc_update(block);
+        PERF_HOP();
+        block = fat_table[block];
+    }
+    return size;
+}
+
+static int chain_block_at(int block, int hops) {
+    for (int i = 0; i < hops; i++) {
+        PERF_HOP();
+        block = fat_table[block];
+        if (block == FAT_END || block <= 0 || block >= fs->fat_entries) {
+            return FILE_READ_ERROR;
+        }
+    }
+    return block;
+}
+
+void fs_set_compression(int enabled) {
+    compression_enabled = enabled;
+    fs_log("compression: %s\n", enabled ? "enabled" : "disabled");
+}
+
+// Comprime buffer a chunk di COMPRESS_CHUNK_SIZE byte e lo scrive in una catena nuova.
+// Restituisce il primo blocco, COMPRESS_NO_GAIN se la versione compressa non occupa
+// meno blocchi di quella normale, oppure un codice di errore.
+static int compress_write_chain(const char* buffer, int size) {
+    int block_size = fs->bytes_per_block;
+    int chunk_count = (size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    int index_bytes = sizeof(CompressedHeader) + chunk_count * sizeof(ChunkEntry);
+    int index_blocks = (index_bytes + block_size - 1) / block_size;
+    int chunk_blocks = (COMPRESS_CHUNK_SIZE + block_size - 1) / block_size;
+    int plain_blocks = (size + block_size - 1) / block_size;
+
+    char* staging = (char*)calloc(index_blocks + chunk_count * chunk_blocks, block_size);
+    if (!staging) {
+        return FILE_WRITE_ERROR;
+    }
+
+    CompressedHeader* header = (CompressedHeader*)staging;
+    ChunkEntry* chunks = (ChunkEntry*)(staging + sizeof(CompressedHeader));
+    header->chunk_count = chunk_count;
+    header->index_blocks = index_blocks;
+
+    int used_blocks = index_blocks;
+    for (int i = 0; i < chunk_count; i++) {
+        int raw_len = size - i * COMPRESS_CHUNK_SIZE < COMPRESS_CHUNK_SIZE ? size - i * COMPRESS_CHUNK_SIZE : COMPRESS_CHUNK_SIZE;
+        char* dst = staging + used_blocks * block_size;
+        int stored_len = lz_compress(buffer + i * COMPRESS_CHUNK_SIZE, raw_len, dst, raw_len - 1);
+        if (stored_len == LZ_ERROR) {
+            memcpy(dst, buffer + i * COMPRESS_CHUNK_SIZE, raw_len);
+            stored_len = raw_len;
+        }
+        chunks[i].first_block = used_blocks;
+        chunks[i].stored_len = stored_len;
+        chunks[i].raw_len = raw_len;
+        used_blocks += (stored_len + block_size - 1) / block_size;
+    }
+
+    if (used_blocks >= plain_blocks) {
+        free(staging);
+        return COMPRESS_NO_GAIN;
+    }
+
+    int first = alloc_chain_from(staging, used_blocks * block_size);
+    free(staging);
+    if (first == FAT_FULL) {
+        return FAT_FULL;
+    }
+    fs_log("compress: %d bytes stored in %d blocks instead of %d\n", size, used_blocks, plain_blocks);
+    return first;
+}
+
+// Porta nella cache il chunk richiesto: legge la sua voce dell'indice, salta
+// direttamente ai suoi blocchi e decomprime solo quelli.
+static int load_chunk(const DirectoryEntry* file, int chunk) {
+    if (chunk_cache_first == file->first_block && chunk_cache_index == chunk) {
+        return chunk_cache_len;
+    }
+
+    int block_size = fs->bytes_per_block;
+    CompressedHeader* header = (CompressedHeader*)&data_blocks[(size_t)file->first_block * block_size];
+    if (chunk < 0 || chunk >= (int)header->chunk_count) {
+        return FILE_READ_ERROR;
+    }
+
+    int pos = sizeof(CompressedHeader) + chunk * sizeof(ChunkEntry);
+    int block = chain_block_at(file->first_block, pos / block_size);
+    if (block < 0) {
+        return FILE_READ_ERROR;
+    }
+    if (check_block(block) != 0) {
+        return CHECKSUM_ERROR;
+    }
+    ChunkEntry entry;
+    memcpy(&entry, &data_blocks[(size_t)block * block_size + pos % block_size], sizeof(entry));
+    if (entry.raw_len > COMPRESS_CHUNK_SIZE || entry.stored_len > entry.raw_len) {
+        return FILE_READ_ERROR;
+    }
+
+    block = chain_block_at(block, entry.first_block - pos / block_size);
+    if (block < 0) {
+        return FILE_READ_ERROR;
+    }
+
+    char stored[COMPRESS_CHUNK_SIZE];
+    char* dst = entry.stored_len == entry.raw_len ? chunk_cache : stored;
+    for (int done = 0; done < entry.stored_len; done += block_size) {
+        if (block == FAT_END || block <= 0 || block >= fs->fat_entries) {
+            return FILE_READ_ERROR;
+        }
+        if (check_block(block) != 0) {
+            return CHECKSUM_ERROR;
+        }
+        int len = entry.stored_len - done < block_size ? entry.stored_len - done : block_size;
+        memcpy(dst + done, &data_blocks[(size_t)block * block_size], len);
+        PERF_HOP();
+        block = fat_table[block];
+    }
+
+    chunk_cache_first = FAT_END;
+    if (dst == stored && lz_decompress(stored, entry.stored_len, chunk_cache, entry.raw_len) != entry.raw_len) {
+        printf("load_chunk: Corrupted chunk %d\n", chunk);
+        return FILE_READ_ERROR;
+    }
+
+    chunk_cache_first = file->first_block;
+    chunk_cache_index = chunk;
+    chunk_cache_len = entry.raw_len;
+    return chunk_cache_len;
+}
+
+static int read_compressed(FileHandle* handle, char* buffer, int size) {
+    DirectoryEntry* file_entry = handle->file_entry;
+    int bytes_read = 0;
+
+    while (bytes_read < size && handle->position < file_entry->size) {
+        int chunk = handle->position / COMPRESS_CHUNK_SIZE;
+        int chunk_offset = handle->position % COMPRESS_CHUNK_SIZE;
+        int chunk_len = load_chunk(file_entry, chunk);
+        if (chunk_len < 0) {
+            return chunk_len;
+        }
+        int bytes_to_copy = chunk_len - chunk_offset;
+        if (bytes_to_copy > size - bytes_read) {
+            bytes_to_copy = size - bytes_read;
+        }
+        if (bytes_to_copy <= 0) {
+            return FILE_READ_ERROR;
+        }
+        memcpy(buffer + bytes_read, chunk_cache + chunk_offset, bytes_to_copy);
+        bytes_read += bytes_to_copy;
+        handle->position += bytes_to_copy;
+    }
+
+    return bytes_read;
+}
+
+// Riporta un file compresso al formato normale, prima di una scrittura sul posto.
+static int inflate_file(DirectoryEntry* file) {
+    char* content = (char*)malloc(file->size > 0 ? file->size : 1);
+    if (!content) {
+        return FILE_WRITE_ERROR;
+    }
+    for (int pos = 0; pos < file->size; pos += COMPRESS_CHUNK_SIZE) {
+        int len = load_chunk(file, pos / COMPRESS_CHUNK_SIZE);
+        if (len < 0) {
+            free(content);
+            return len;
+        }
+        memcpy(content + pos, chunk_cache, len);
+    }
+
+    int first = alloc_chain_from(content, file->size);
+    free(content);
+    if (first == FAT_FULL) {
+        printf("inflate_file: No space left to decompress %.25s.%.3s\n", file->name, file->extension);
+        return FAT_FULL;
+    }
+    release_chain(file->first_block);
+    file->first_block = first;
+    count_chain(file);
+    file->flags &= ~FILE_COMPRESSED;
+    return 0;
+}
+
+int fs_compress_file(const char* name, const char* ext) {
+    DirectoryEntry* file = locate_file(name, ext, 0);
+    if (file == NULL) {
+        return FILE_NOT_FOUND;
+    }
+    if ((file->flags & (FILE_COMPRESSED | FILE_INLINE)) || file->size == 0) {
+        return 0;
+    }
+
+    char* content = (char*)malloc(file->size);
+    if (!content) {
+        return FILE_WRITE_ERROR;
+    }
+    FileHandle handle;
+    handle.file_entry = file;
+    handle.position = 0;
+    int got = read_file_data(&handle, content, file->size);
+    if (got != file->size) {
+        free(content);
+        return got < 0 ? got : FILE_READ_ERROR;
+    }
+
+    int first = compress_write_chain(content, file->size);
+    free(content);
+    if (first == COMPRESS_NO_GAIN) {
+        printf("compress: %.25s.%.3s does not compress, left unchanged\n", name, ext);
+        return 0;
+    }
+    if (first < 0) {
+        return FILE_WRITE_ERROR;
+    }
+
+    release_file_storage(file);
+    file->first_block = first;
+    count_chain(file);
+    file->flags = FILE_COMPRESSED;
+    fs_save();
+    return 0;
+}
+
+// Impronta di un blocco: quattro accumulatori indipendenti su 32 byte per giro,
+// cosi' il compilatore puo' vettorizzare il ciclo interno.
+#define FP_PRIME1 0x9E3779B185EBCA87ULL
+#define FP_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define FP_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t fp_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t block_fingerprint(const char* data, int len) {
+    uint64_t acc[4] = { FP_PRIME1 + FP_PRIME2, FP_PRIME2, 0, -FP_PRIME1 };
+    for (int i = 0; i + 32 <= len; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t v;
+            memcpy(&v, data + i + lane * 8, sizeof(v));
+            acc[lane] = fp_rotl(acc[lane] + v * FP_PRIME2, 31) * FP_PRIME1;
+        }
+    }
+    uint64_t h = fp_rotl(acc[0], 1) + fp_rotl(acc[1], 7) + fp_rotl(acc[2], 12) + fp_rotl(acc[3], 18);
+    h ^= h >> 33;
+    h *= FP_PRIME2;
+    h ^= h >> 29;
+    h *= FP_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void dedup_reset_index() {
+    free(dedup_index);
+    dedup_index = NULL;
+    dedup_capacity = 0;
+    dedup_used = 0;
+}
+
+static void dedup_insert(uint64_t fingerprint, int block) {
+    int mask = dedup_capacity - 1;
+    int slot = (int)(fingerprint & mask);
+    while (dedup_index[slot].block != 0) {
+        if (dedup_index[slot].block == block) {
+            dedup_index[slot].fingerprint = fingerprint;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    dedup_index[slot].fingerprint = fingerprint;
+    dedup_index[slot].block = block;
+    dedup_used++;
+}
+
+// L'indice non viene salvato nell'immagine: si ricostruisce dai blocchi con block_refs > 0.
+// Le voci obsolete (blocchi liberati o riscritti) restano finche' l'indice non si riempie,
+// tanto ogni corrispondenza viene verificata prima di essere condivisa.
+static int dedup_build_index() {
+    int capacity = 1;
+    while (capacity < fs->fat_entries * 2) {
+        capacity <<= 1;
+    }
+
+    dedup_reset_index();
+    dedup_index = (DedupSlot*)calloc(capacity, sizeof(DedupSlot));
+    if (!dedup_index) {
+        printf("dedup: Failed to allocate fingerprint index\n");
+        return FILE_WRITE_ERROR;
+    }
+    dedup_capacity = capacity;
+
+    int blocks = data_block_count();
+    for (int i = 1; i < blocks; i++) {
+        if (block_refs[i] > 0 && fat_table[i] != FAT_UNUSED && fat_table[i] != FAT_TAIL) {
+            dedup_insert(block_fingerprint(&data_blocks[(size_t)i * fs->bytes_per_block], fs->bytes_per_block), i);
+        }
+    }
+    return 0;
+}
+
+// Un blocco si puo' condividere solo se ha lo stesso contenuto e lo stesso successore
+// nella FAT: il collegamento fa parte dell'identita' del blocco.
+static int dedup_lookup(uint64_t fingerprint, int next_block, const char* data) {
+    int mask = dedup_capacity - 1;
+    int slot = (int)(fingerprint & mask);
+    while (dedup_index[slot].block != 0) {
+        int block = dedup_index[slot].block;
+        if (dedup_index[slot].fingerprint == fingerprint && block_refs[block] > 0 && block_refs[block] < UINT16_MAX &&
+            fat_table[block] == next_block &&
+            memcmp(&data_blocks[(size_t)block * fs->bytes_per_block], data, fs->bytes_per_block) == 0) {
+            return block;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return FILE_NOT_FOUND;
+}
+
+void fs_set_dedup(int enabled) {
+    dedup_enabled = enabled;
+    fs_log("dedup: %s\n", enabled ? "enabled" : "disabled");
+}
+
+// Scrive il contenuto di un file costruendo la catena dall'ultimo blocco al primo,
+// cosi' i file identici o con la stessa coda condividono i blocchi gia' presenti.
+// Restituisce il primo blocco della catena oppure un codice di errore.
+static int dedup_write_chain(const char* buffer, int size) {
+    int block_size = fs->bytes_per_block;
+    int blocks_needed = (size + block_size - 1) / block_size;
+
+    if (dedup_index == NULL || dedup_used * 4 > dedup_capacity * 3) {
+        if (dedup_build_index() != 0) {
+            return FILE_WRITE_ERROR;
+        }
+    }
+
+    char* chunk = (char*)malloc(block_size);
+    if (!chunk) {
+        return FILE_WRITE_ERROR;
+    }
+
+    int next_block = FAT_END;
+    int sharing = 1;
+    int shared_blocks = 0;
+    for (int i = blocks_needed - 1; i >= 0; i--) {
+        int len = size - i * block_size < block_size ? size - i * block_size : block_size;
+        memset(chunk, 0x00, block_size);
+        memcpy(chunk, &buffer[i * block_size], len);
+        uint64_t fingerprint = block_fingerprint(chunk, block_size);
+
+        int block = sharing ? dedup_lookup(fingerprint, next_block, chunk) : FILE_NOT_FOUND;
+        if (block > 0) {
+            shared_blocks++;
+            next_block = block;
+            continue;
+        }
+
+        // Un blocco nuovo non e' mai il successore di un blocco esistente.
+        sharing = 0;
+        block = get_free_block();
+        if (block == FAT_FULL) {
+            if (next_block != FAT_END) {
+                block_refs[next_block]++;
+                release_chain(next_block);
+            }
+            free(chunk);
+            return FAT_FULL;
+        }
+        memcpy(&data_blocks[(size_t)block * block_size], chunk, block_size);
+        fat_set(block, next_block);
+        block_crc_update(block);
+        block_refs[block] = 0;
+        if (next_block != FAT_END) {
+            block_refs[next_block]++;
+        }
+        dedup_insert(fingerprint, block);
+        next_block = block;
+    }
+    block_refs[next_block]++;
+
+    free(chunk);
+    fs_log("copy2fs: %d of %d blocks deduplicated\n", shared_blocks, blocks_needed);
+    return next_block;
+}
+
+// Prima di modificare un file sul posto, se anche un solo blocco della sua catena e'
+// condiviso lo si copia in una catena privata (copy-on-write a livello di file).
+static int unshare_file(DirectoryEntry* file) {
+    int block_size = fs->bytes_per_block;
+    int shared = 0;
+    for (int b = file->first_block; b != FAT_END && b > 0 && b < fs->fat_entries; b = fat_table[b]) {
+        if (block_refs[b] > 1) {
+            shared = 1;
+            break;
+        }
+    }
+    if (!shared) {
+        return 0;
+    }
+
+    int new_first = FAT_END;
+    int prev = FAT_END;
+    for (int b = file->first_block; b != FAT_END && b > 0 && b < fs->fat_entries; b = fat_table[b]) {
+        int copy = get_free_block();
+        if (copy == FAT_FULL) {
+            release_chain(new_first);
+            return FAT_FULL;
+        }
+        memcpy(&data_blocks[(size_t)copy * block_size], &data_blocks[(size_t)b * block_size], block_size);
+        fat_set(copy, FAT_END);
+        crc_table[copy] = crc_table[b];
+        if (prev == FAT_END) {
+            new_first = copy;
+        } else {
+            fat_set(prev, copy);
+        }
+        prev = copy;
+    }
+
+    release_chain(file->first_block);
+    file->first_block = new_first;
+    count_chain(file);
+    fs_log("unshare_file: Copied shared blocks of %.25s.%.3s into a private chain\n", file->name, file->extension);
+    return 0;
+}
+
+void fs_set_tail_packing(int enabled) {
+    tail_packing_enabled = enabled;
+    fs_log("tailpack: %s\n", enabled ? "enabled" : "disabled");
+}
+
+static int tail_free_space(int block) {
+    TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * fs->bytes_per_block];
+    return fs->bytes_per_block - header->used;
+}
+
+// Tiene a portata i cluster di code con piu' spazio libero; la prima volta
+// li cerca fra i cluster FAT_TAIL gia' presenti nell'immagine.
+static void tail_open_add(int block) {
+    int slot = 0;
+    for (int i = 0; i < TAIL_OPEN_CLUSTERS; i++) {
+        if (tail_open[i] == FAT_END) {
+            slot = i;
+            break;
+        }
+        if (tail_free_space(tail_open[i]) < tail_free_space(tail_open[slot])) {
+            slot = i;
+        }
+    }
+    if (tail_open[slot] == FAT_END || tail_free_space(tail_open[slot]) < tail_free_space(block)) {
+        tail_open[slot] = block;
+    }
+}
+
+static void tail_open_load() {
+    for (int i = 0; i < TAIL_OPEN_CLUSTERS; i++) {
+        tail_open[i] = FAT_END;
+    }
+    int blocks = data_block_count();
+    for (int i = 1; i < blocks; i++) {
+        if (fat_table[i] == FAT_TAIL) {
+            tail_open_add(i);
+        }
+    }
+    tail_open_loaded = 1;
+}
+
+// Trova un cluster di code con almeno len byte liberi, scegliendo quello che
+// resta piu' pieno; se nessuno basta ne prepara uno nuovo.
+static int tail_find_space(int len) {
+    if (!tail_open_loaded) {
+        tail_open_load();
+    }
+
+    int best = FAT_END;
+    for (int i = 0; i < TAIL_OPEN_CLUSTERS; i++) {
+        int block = tail_open[i];
+        if (block != FAT_END && tail_free_space(block) >= len &&
+            (best == FAT_END || tail_free_space(block) < tail_free_space(best))) {
+            best = block;
+        }
+    }
+    if (best != FAT_END) {
+        return best;
+    }
+
+    int block = get_free_block();
+    if (block == FAT_FULL) {
+        return FAT_FULL;
+    }
+    TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * fs->bytes_per_block];
+    header->used = sizeof(TailHeader);
+    header->fragments = 0;
+    fat_set(block, FAT_TAIL);
+    tail_open_add(block);
+    return block;
+}
+
+// Salva gli ultimi len byte di un file in un cluster di code condiviso.
+static int tail_store(DirectoryEntry* file, const char* data, int len) {
+    int block = tail_find_space(len);
+    if (block == FAT_FULL) {
+        return FAT_FULL;
+    }
+    TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * fs->bytes_per_block];
+    memcpy(&data_blocks[(size_t)block * fs->bytes_per_block + header->used], data, len);
+    file->tail_block = block;
+    file->tail_offset = header->used;
+    file->flags |= FILE_TAIL_PACKED;
+    header->used += len;
+    header->fragments++;
+    return 0;
+}
+
+// Lo spazio di un frammento non viene riusato: il cluster torna libero quando
+// l'ultimo frammento che contiene viene rilasciato.
+static void tail_release(DirectoryEntry* file) {
+    int block = file->tail_block;
+    TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * fs->bytes_per_block];
+    file->flags &= ~FILE_TAIL_PACKED;
+    if (--header->fragments > 0) {
+        return;
+    }
+    fat_set(block, FAT_UNUSED);
+    discard_blocks(block, 1);
+    for (int i = 0; tail_open_loaded && i < TAIL_OPEN_CLUSTERS; i++) {
+        if (tail_open[i] == block) {
+            tail_open[i] = FAT_END;
+        }
+    }
+}
+
+static char* tail_data(const DirectoryEntry* file) {
+    return &data_blocks[(size_t)file->tail_block * fs->bytes_per_block + file->tail_offset];
+}
+
+// Riporta la coda in un cluster proprio in fondo alla catena del file.
+static int unpack_tail(DirectoryEntry* file) {
+    int block_size = fs->bytes_per_block;
+    int block = get_free_block();
+    if (block == FAT_FULL) {
+        return FAT_FULL;
+    }
+    memset(&data_blocks[(size_t)block * block_size], 0x00, block_size);
+    memcpy(&data_blocks[(size_t)block * block_size], tail_data(file), file->size % block_size);
+    fat_set(block, FAT_END);
+    block_crc_update(block);
+
+    int full_blocks = file->size / block_size;
+    if (full_blocks == 0) {
+        file->first_block = block;
     } else {
-        buffer[size - 1] = '\0';
+        int last = chain_block_at(file->first_block, full_blocks - 1);
+        if (last < 0) {
+            fat_set(block, FAT_UNUSED);
+            return FILE_WRITE_ERROR;
+        }
+        fat_set(last, block);
     }
+    count_chain(file);
+    tail_release(file);
+    return 0;
+}
 
-    printf("File content:\n%s\n", buffer); 
+// Sposta l'ultimo cluster parziale di un file in un cluster di code.
+static int pack_tail(DirectoryEntry* file) {
+    int block_size = fs->bytes_per_block;
+    int tail_len = file->size % block_size;
+    if ((file->flags & (FILE_INLINE | FILE_COMPRESSED | FILE_TAIL_PACKED | FILE_SPARSE)) || tail_len == 0) {
+        return 0;
+    }
 
-    return bytes_read;
+    int full_blocks = file->size / block_size;
+    int last = chain_block_at(file->first_block, full_blocks);
+    if (last < 0 || fat_table[last] != FAT_END || block_refs[last] > 1) {
+        return 0;
+    }
+    if (tail_store(file, &data_blocks[(size_t)last * block_size], tail_len) != 0) {
+        return 0;
+    }
+
+    if (full_blocks == 0) {
+        file->first_block = FAT_END;
+    } else {
+        fat_set(chain_block_at(file->first_block, full_blocks - 1), FAT_END);
+    }
+    release_chain(last);
+    count_chain(file);
+    return 0;
 }
 
+// Scrive il contenuto di un file nuovo secondo le modalita' attive:
+// compressione, deduplicazione dei cluster pieni e impacchettamento della coda.
+static int store_file_data(DirectoryEntry* entry, const char* data, int size) {
+    entry->first_block = FAT_END;
+    entry->blocks = 0;
+    entry->extents = 0;
+
+    if (compression_enabled) {
+        int first = compress_write_chain(data, size);
+        if (first < 0) {
+            return first;
+        }
+        if (first != COMPRESS_NO_GAIN) {
+            entry->first_block = first;
+            count_chain(entry);
+            entry->flags |= FILE_COMPRESSED;
+            return 0;
+        }
+    }
 
-int write_file_content(const char* name, const char* ext, const char* data, int offset, int size) {
-    printf("write_file_content: Received %d bytes to write to file '%s.%s'\n", size, name, ext); 
+    int tail_len = tail_packing_enabled ? size % fs->bytes_per_block : 0;
+    int chain_size = size - tail_len;
+    if (chain_size > 0) {
+        int first = dedup_enabled ? dedup_write_chain(data, chain_size) : alloc_chain_from(data, chain_size);
+        if (first < 0) {
+            return first;
+        }
+        entry->first_block = first;
+        count_chain(entry);
+    }
 
-    DirectoryEntry* file = locate_file(name, ext, 0);
-    if (file == NULL) {
-        return FILE_NOT_FOUND;
+    if (tail_len > 0 && tail_store(entry, data + chain_size, tail_len) != 0) {
+        release_chain(entry->first_block);
+        entry->first_block = FAT_END;
+        entry->blocks = 0;
+        entry->extents = 0;
+        return FAT_FULL;
+    }
+    return 0;
+}
+
+int chain_length(int block) {
+    int count = 0;
+    for (; block != FAT_END && block > 0 && block < fs->fat_entries; block = fat_table[block]) {
+        PERF_HOP();
+        count++;
     }
+    return count;
+}
 
-    if (offset == -1) {
-        offset = file->size;
+// Numero di corse contigue in cui e' spezzata la catena.
+int chain_extents(int block) {
+    int extents = 0;
+    int prev = FAT_END;
+    for (; block != FAT_END && block > 0 && block < fs->fat_entries; block = fat_table[block]) {
+        if (block != prev + 1) {
+            extents++;
+        }
+        prev = block;
     }
+    return extents;
+}
 
-    int block_size = fs->bytes_per_block;
-    int total_blocks = fs->fat_entries;
-    int current_block = file->first_block;
-    int blocks_to_skip = offset / block_size;
-    int byte_offset = offset % block_size;
+// Blocchi logici coperti da una voce di un cluster mappa al livello level.
+static long long sparse_span(int level) {
+    long long span = 1;
+    for (int i = 1; i < level; i++) {
+        span *= SPARSE_MAP_ENTRIES;
+    }
+    return span;
+}
 
-    int* written_blocks = (int*)calloc(total_blocks, sizeof(int));
-    if (written_blocks == NULL) {
-        printf("write_file_content: Failed to allocate memory for tracking written blocks\n");
-        return FILE_WRITE_ERROR;
+static int sparse_new_node() {
+    int block = get_free_block();
+    if (block == FAT_FULL) {
+        return FAT_FULL;
     }
+    memset(&data_blocks[(size_t)block * fs->bytes_per_block], 0x00, fs->bytes_per_block);
+    fat_set(block, FAT_END);
+    return block;
+}
 
-    for (int i = 0; i < blocks_to_skip; i++) {
-        while (fat_table[current_block] == FAT_END || fat_table[current_block] == 0) {
-            int new_block = get_free_block();
-            if (new_block == FAT_FULL) {
-                free(written_blocks);
-                return FILE_WRITE_ERROR;
-            }
-            fat_table[current_block] = new_block;
-            fat_table[new_block] = FAT_END;
-            current_block = new_block;
+// Restituisce la voce della mappa per il blocco logico lblock, scendendo dalla
+// radice: entry_count passi, qualunque sia la posizione. Con create l'albero
+// cresce in altezza finche' non copre lblock e i cluster mappa mancanti lungo il
+// percorso vengono allocati; senza, un sottoalbero mancante da' NULL.
+static int* sparse_map_slot(DirectoryEntry* file, int lblock, int create) {
+    if (file->first_block == FAT_END || file->entry_count < 1) {
+        if (!create) {
+            return NULL;
         }
-        current_block = fat_table[current_block];
-        if (current_block == FAT_UNUSED || current_block >= fs->fat_entries || current_block == 0) {
-            free(written_blocks);
-            return FILE_WRITE_ERROR;
+        if (file->first_block == FAT_END) {
+            file->entry_count = 1;
         }
     }
-
-    int total_bytes_to_write = size;
-    int bytes_written = 0;
-
-    while (bytes_written < total_bytes_to_write) {
-        if (written_blocks[current_block] == 1) {
-            int next_block = fat_table[current_block];
-            if (next_block == FAT_END || next_block == 0) {
-                int new_block = get_free_block();
-                if (new_block == FAT_FULL) {
-                    free(written_blocks);
-                    return FILE_WRITE_ERROR;
-                }
-                fat_table[current_block] = new_block;
-                fat_table[new_block] = FAT_END;
-                current_block = new_block;
-            } else {
-                current_block = next_block;
+    while (lblock >= sparse_span(file->entry_count + 1)) {
+        if (!create || file->entry_count >= SPARSE_MAX_DEPTH) {
+            return NULL;
+        }
+        // La radice attuale diventa il primo figlio di una nuova radice.
+        if (file->first_block != FAT_END) {
+            int root = sparse_new_node();
+            if (root == FAT_FULL) {
+                return NULL;
             }
-            continue;
+            ((int*)&data_blocks[(size_t)root * fs->bytes_per_block])[0] = file->first_block;
+            file->first_block = root;
         }
+        file->entry_count++;
+    }
+    if (file->first_block == FAT_END) {
+        int root = sparse_new_node();
+        if (root == FAT_FULL) {
+            return NULL;
+        }
+        file->first_block = root;
+    }
 
-        written_blocks[current_block] = 1;
-
-        if (current_block == FAT_END || current_block == 0) {
-            int new_block = get_free_block();
-            if (new_block == FAT_FULL) {
-                free(written_blocks);
-                return FILE_WRITE_ERROR;
+    int node = file->first_block;
+    for (int level = file->entry_count; ; level--) {
+        int* slot = (int*)&data_blocks[(size_t)node * fs->bytes_per_block] + (int)(lblock / sparse_span(level) % SPARSE_MAP_ENTRIES);
+        if (level == 1) {
+            return slot;
+        }
+        if (*slot == 0) {
+            if (!create) {
+                return NULL;
             }
-            fat_table[current_block] = new_block;
-            fat_table[new_block] = FAT_END;
-            current_block = new_block;
+            int child = sparse_new_node();
+            if (child == FAT_FULL) {
+                return NULL;
+            }
+            *slot = child;
         }
+        PERF_HOP();
+        node = *slot;
+    }
+}
 
-        if (current_block == FAT_UNUSED || current_block >= fs->fat_entries || current_block == 0) {
-            printf("write_file_content: Error - current_block %d is out of bounds, unused, or invalid\n", current_block);
-            free(written_blocks);
-            return FILE_WRITE_ERROR;
+// Converte un file a catena nel formato sparso, spostando i suoi blocchi nella mappa.
+static int make_sparse(DirectoryEntry* file) {
+    DirectoryEntry sparse = *file;
+    sparse.first_block = FAT_END;
+    sparse.entry_count = 0;
+
+    int lblock = 0;
+    for (int b = file->first_block; b != FAT_END && b > 0 && b < fs->fat_entries; b = fat_table[b]) {
+        int* slot = sparse_map_slot(&sparse, lblock++, 1);
+        if (slot == NULL) {
+            if (sparse.first_block != FAT_END) {
+                release_sparse_maps(sparse.first_block, sparse.entry_count);
+            }
+            return FAT_FULL;
         }
+        *slot = b;
+    }
 
-        int bytes_to_write = (total_bytes_to_write - bytes_written > block_size - byte_offset) ? block_size - byte_offset : total_bytes_to_write - bytes_written; 
-        memcpy(&data_blocks[current_block * block_size + byte_offset], data + bytes_written, bytes_to_write);
+    int b = file->first_block;
+    while (b != FAT_END && b > 0 && b < fs->fat_entries) {
+        int next = fat_table[b];
+        fat_set(b, FAT_END);
+        b = next;
+    }
 
-        bytes_written += bytes_to_write;
-        byte_offset = 0;
+    file->first_block = sparse.first_block;
+    file->entry_count = sparse.entry_count;
+    file->blocks = 0;
+    file->extents = 0;
+    file->flags |= FILE_SPARSE;
+    fs_log("make_sparse: %.25s.%.3s converted to a sparse file\n", file->name, file->extension);
+    return 0;
+}
 
-        if (bytes_written < total_bytes_to_write) {
-            int next_block = fat_table[current_block];
-            if (next_block == FAT_END || next_block == 0) {
-                int new_block = get_free_block();
-                if (new_block == FAT_FULL) {
-                    free(written_blocks);
-                    return FILE_WRITE_ERROR;
-                }
-                fat_table[current_block] = new_block;
-                fat_table[new_block] = FAT_END;
-                current_block = new_block;
-            } else {
-                current_block = next_block;
+// Scrive size byte a partire da offset, allocando solo i blocchi toccati.
+// Con data NULL si limita a riempire i buchi, come fs_fallocate.
+static int write_sparse(DirectoryEntry* file, const char* data, int offset, int size) {
+    int block_size = fs->bytes_per_block;
+    int done = 0;
+    while (done < size) {
+        int pos = offset + done;
+        int byte_offset = pos % block_size;
+        int len = block_size - byte_offset < size - done ? block_size - byte_offset : size - done;
+
+        int* slot = sparse_map_slot(file, pos / block_size, 1);
+        if (slot == NULL) {
+            return FAT_FULL;
+        }
+        if (*slot == 0) {
+            int block = get_free_block();
+            if (block == FAT_FULL) {
+                return FAT_FULL;
+            }
+            if (data == NULL || len < block_size) {
+                memset(&data_blocks[(size_t)block * block_size], 0x00, block_size);
             }
+            fat_set(block, FAT_END);
+            *slot = block;
         }
+        if (data != NULL) {
+            memcpy(&data_blocks[(size_t)*slot * block_size + byte_offset], data + done, len);
+        }
+        block_crc_update(*slot);
+        done += len;
     }
+    return size;
+}
 
-    file->size = offset + bytes_written > file->size ? offset + bytes_written : file->size;
-
-    fs_save();
-
-    printf("write_file_content: Written %d bytes to file '%s.%s' starting at offset %d\n", bytes_written, name, ext, offset);
+static int read_sparse(FileHandle* handle, char* buffer, int size) {
+    DirectoryEntry* file = handle->file_entry;
+    int block_size = fs->bytes_per_block;
+    int bytes_read = 0;
+    while (bytes_read < size && handle->position < file->size) {
+        int byte_offset = handle->position % block_size;
+        int len = block_size - byte_offset;
+        if (len > size - bytes_read) {
+            len = size - bytes_read;
+        }
+        if (len > file->size - handle->position) {
+            len = file->size - handle->position;
+        }
 
-    free(written_blocks);
-    return bytes_written;
+        int* slot = sparse_map_slot(file, handle->position / block_size, 0);
+        if (slot == NULL || *slot == 0) {
+            memset(buffer + bytes_read, 0x00, len);
+        } else if (check_block(*slot) != 0) {
+            return CHECKSUM_ERROR;
+        } else {
+            memcpy(buffer + bytes_read, &data_blocks[(size_t)*slot * block_size + byte_offset], len);
+        }
+        bytes_read += len;
+        handle->position += len;
+    }
+    return bytes_read;
 }
 
+// Libera il sottoalbero che parte dal cluster mappa node, di livello level.
+static void release_sparse_node(int node, int level) {
+    int* map = (int*)&data_blocks[(size_t)node * fs->bytes_per_block];
+    for (int i = 0; i < SPARSE_MAP_ENTRIES; i++) {
+        if (map[i] == 0) {
+            continue;
+        }
+        if (level > 1) {
+            release_sparse_node(map[i], level - 1);
+        } else {
+            release_chain(map[i]);
+        }
+    }
+    release_chain(node);
+}
 
+// Libera solo i cluster mappa del sottoalbero: i blocchi dati appartengono
+// ancora alla catena del file, come quando make_sparse non riesce a finire.
+static void release_sparse_maps(int node, int level) {
+    int* map = (int*)&data_blocks[(size_t)node * fs->bytes_per_block];
+    for (int i = 0; level > 1 && i < SPARSE_MAP_ENTRIES; i++) {
+        if (map[i] != 0) {
+            release_sparse_maps(map[i], level - 1);
+        }
+    }
+    release_chain(node);
+}
 
-int seek_file(FileHandle *handle, int offset, int origin) {
-    int new_position = handle->position;
+static void release_sparse(DirectoryEntry* file) {
+    if (file->first_block != FAT_END && file->entry_count >= 1) {
+        release_sparse_node(file->first_block, file->entry_count);
+    }
+    file->first_block = FAT_END;
+    file->entry_count = 0;
+    file->flags &= ~FILE_SPARSE;
+}
 
-    if (origin == SEEK_SET) {
-        new_position = offset;
-    } else if (origin == SEEK_CUR) {
-        new_position += offset;
-    } else if (origin == SEEK_END) {
-        new_position = handle->file_entry->size + offset; 
+// Libera tutto lo spazio occupato dal file, qualunque sia il suo formato.
+static void release_file_storage(DirectoryEntry* file) {
+    if (file->flags & FILE_INLINE) {
+        free_inline_slots(file);
+    } else if (file->flags & FILE_SPARSE) {
+        release_sparse(file);
     } else {
+        release_chain(file->first_block);
+    }
+    if (file->flags & FILE_TAIL_PACKED) {
+        tail_release(file);
+    }
+    file->first_block = FAT_END;
+    file->blocks = 0;
+    file->extents = 0;
+    file->flags = 0;
+}
+
+// Posizione del prossimo dato (o buco) a partire da offset. Oltre la fine del
+// file non ci sono dati; la fine del file conta sempre come buco.
+static int seek_data_or_hole(DirectoryEntry* file, int offset, int want_data) {
+    if (offset < 0 || offset >= file->size) {
         return -1;
     }
+    if (!(file->flags & FILE_SPARSE)) {
+        return want_data ? offset : file->size;
+    }
 
-    if (new_position < 0 || new_position > handle->file_entry->size) {
-        return -1; 
+    int block_size = fs->bytes_per_block;
+    int blocks = (file->size + block_size - 1) / block_size;
+    for (int lblock = offset / block_size; lblock < blocks; lblock++) {
+        int* slot = sparse_map_slot(file, lblock, 0);
+        int is_data = slot != NULL && *slot != 0;
+        if (is_data == want_data) {
+            return lblock * block_size > offset ? lblock * block_size : offset;
+        }
     }
+    return want_data ? -1 : file->size;
+}
 
-    handle->position = new_position;
+// Riporta un file al formato a catena semplice, l'unico che si puo' estendere
+// riservando cluster: toglie condivisione, compressione, dati inline e coda impacchettata.
+static int make_plain_chain(DirectoryEntry* file) {
+    if (unshare_file(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if ((file->flags & FILE_COMPRESSED) && inflate_file(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if ((file->flags & FILE_INLINE) && promote_inline(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
+    if ((file->flags & FILE_TAIL_PACKED) && unpack_tail(file) != 0) {
+        return FILE_WRITE_ERROR;
+    }
     return 0;
 }
 
-int copy2fs(const char* host_path, const char* fs_name, const char* fs_ext) {
-    FILE* host_file = fopen(host_path, "rb");
-    if (!host_file) {
-        perror("Error opening host file");
-        return FILE_NOT_FOUND;
+int fs_fallocate(FileHandle* handle, int length) {
+    if (!handle || !handle->file_entry || length < 0) {
+        printf("fs_fallocate: Invalid parameters\n");
+        return FILE_WRITE_ERROR;
     }
 
-    fseek(host_file, 0, SEEK_END);
-    int size = ftell(host_file);
-    fseek(host_file, 0, SEEK_SET);
-
-    char* buffer = (char*)malloc(size);
-    if (!buffer) {
-        fclose(host_file);
+    DirectoryEntry* file = handle->file_entry;
+    if (file->flags & FILE_SPARSE) {
+        if (write_sparse(file, NULL, 0, length) < 0) {
+            printf("fs_fallocate: Not enough free blocks for %d bytes\n", length);
+            fs_save();
+            return FAT_FULL;
+        }
+        fs_save();
+        return 0;
+    }
+    if (make_plain_chain(file) != 0) {
         return FILE_WRITE_ERROR;
     }
+    if (reserve_chain(file, length) != 0) {
+        printf("fs_fallocate: Not enough free blocks for %d bytes\n", length);
+        fs_save();
+        return FAT_FULL;
+    }
 
-    fread(buffer, 1, size, host_file);
-    fclose(host_file);
+    fs_save();
+    fs_log("fs_fallocate: Reserved %d bytes for %.25s.%.3s\n", length, file->name, file->extension);
+    return 0;
+}
 
-    DirectoryEntry* entry = find_empty_dir_entry();
-    if (entry == NULL) {
-        free(buffer);
-        return FILE_CREATE_ERROR;
+// Rilascia i blocchi logici da keep in poi del sottoalbero node, di livello
+// level, che inizia al blocco logico base. I sottoalberi tutti oltre keep
+// vengono liberati interi.
+static void trim_sparse_node(int node, int level, long long base, int keep) {
+    int* map = (int*)&data_blocks[(size_t)node * fs->bytes_per_block];
+    long long span = sparse_span(level);
+    for (int i = 0; i < SPARSE_MAP_ENTRIES; i++) {
+        long long child_base = base + i * span;
+        if (map[i] == 0 || child_base + span <= keep) {
+            continue;
+        }
+        if (child_base < keep) {
+            trim_sparse_node(map[i], level - 1, child_base, keep);
+            continue;
+        }
+        if (level > 1) {
+            release_sparse_node(map[i], level - 1);
+        } else {
+            release_chain(map[i]);
+        }
+        map[i] = 0;
     }
+}
 
-    memset(entry->name, ' ', sizeof(entry->name));
-    memset(entry->extension, ' ', sizeof(entry->extension));
+// Accorcia un file sparso: i blocchi dati e i cluster mappa oltre la nuova fine
+// vengono rilasciati. Il resto dell'ultimo blocco va azzerato, perche'
+// write_sparse non azzera il tratto fra fine e offset.
+static void truncate_sparse(DirectoryEntry* file, int new_size) {
+    int block_size = fs->bytes_per_block;
+    int keep = (new_size + block_size - 1) / block_size;
+    if (file->first_block != FAT_END && file->entry_count >= 1) {
+        trim_sparse_node(file->first_block, file->entry_count, 0, keep);
+    }
 
-    strncpy(entry->name, fs_name, 24);
-    entry->name[24] = '\0';
-    strncpy(entry->extension, fs_ext, 3);
-    entry->extension[3] = '\0';
-    entry->size = size;
-    entry->is_dir = 0;
+    int* slot = new_size % block_size ? sparse_map_slot(file, keep - 1, 0) : NULL;
+    if (slot != NULL && *slot != 0) {
+        memset(&data_blocks[(size_t)*slot * block_size + new_size % block_size], 0x00, block_size - new_size % block_size);
+        block_crc_update(*slot);
+    }
+}
 
-    int block = get_free_block();
-    if (block == FAT_FULL) {
-        free(buffer);
-        return FILE_CREATE_ERROR;
+// Porta il file a new_size byte, come ftruncate. Accorciando, la catena viene
+// tagliata dopo l'ultimo cluster che serve e il resto torna all'allocatore con
+// release_chain, senza azzerarlo: chi estendera' il file azzera il tratto
+// oltre la fine. Troncato a zero, il file riparte vuoto e inline come appena
+// creato. Allungando, i byte aggiunti valgono zero.
+int fs_truncate(FileHandle* handle, int new_size) {
+    if (!handle || !handle->file_entry || handle->file_entry->is_dir || new_size < 0) {
+        printf("fs_truncate: Invalid parameters\n");
+        return FILE_WRITE_ERROR;
     }
 
-    entry->parent = current_dir;
-    entry->first_block = block;
+    DirectoryEntry* file = handle->file_entry;
     int block_size = fs->bytes_per_block;
-    int blocks_needed = (size + block_size - 1) / block_size;
-    int current_block = block;
+    ra_file = NULL;
+
+    if (new_size > file->size) {
+        if (file->flags & FILE_SPARSE) {
+            file->size = new_size;
+        } else if ((file->flags & FILE_INLINE) && inline_reserve(file, new_size) == 0) {
+            char zeros[INLINE_MAX_SIZE] = { 0 };
+            inline_copy(file, file->size, zeros, new_size - file->size, 1);
+            file->size = new_size;
+        } else {
+            if (make_plain_chain(file) != 0) {
+                return FILE_WRITE_ERROR;
+            }
+            if (reserve_chain(file, new_size) != 0) {
+                printf("fs_truncate: Not enough free blocks for %d bytes\n", new_size);
+                fs_save();
+                return FAT_FULL;
+            }
+            zero_chain_range(file->first_block, file->size, new_size);
+            file->size = new_size;
+        }
+        fs_save();
+        return 0;
+    }
 
-    int* written_blocks = (int*)calloc(fs->fat_entries, sizeof(int));
-    if (!written_blocks) {
-        free(buffer);
-        return FILE_WRITE_ERROR;
+    if (new_size == 0) {
+        release_file_storage(file);
+        file->flags = FILE_INLINE;
+        file->entry_count = 0;
+        file->size = 0;
+        fs_save();
+        fs_log("fs_truncate: %.25s.%.3s truncated to 0 bytes\n", file->name, file->extension);
+        return 0;
     }
 
-    int bytes_written = 0;
-    while (bytes_written < size) {
-        if (written_blocks[current_block] == 1) {
-            int next_block = fat_table[current_block];
-            if (next_block == FAT_END || next_block == 0) {
-                next_block = get_free_block();
-                if (next_block == FAT_FULL) {
-                    free(buffer);
-                    free(written_blocks);
-                    return FILE_CREATE_ERROR;
-                }
-                fat_table[current_block] = next_block;
-                fat_table[next_block] = FAT_END;
-            }
-            current_block = next_block;
-            continue;
+    if (file->flags & FILE_INLINE) {
+        int needed = (new_size + INLINE_SLOT_DATA - 1) / INLINE_SLOT_DATA;
+        for (int i = needed + 1; i <= file->entry_count; i++) {
+            file[i].name[0] = DELETED_ENTRY;
         }
+        if (needed < file->entry_count) {
+            file->entry_count = needed;
+        }
+        file->size = new_size;
+        fs_save();
+        return 0;
+    }
 
-        written_blocks[current_block] = 1;
+    if (file->flags & FILE_SPARSE) {
+        truncate_sparse(file, new_size);
+        file->size = new_size;
+        fs_save();
+        return 0;
+    }
 
-        if (current_block == FAT_END || current_block == 0) {
-            int new_block = get_free_block();
-            if (new_block == FAT_FULL) {
-                free(buffer);
-                free(written_blocks);
-                return FILE_CREATE_ERROR;
-            }
-            fat_table[current_block] = new_block;
-            fat_table[new_block] = FAT_END;
-            current_block = new_block;
+    // A parita' di dimensione si liberano solo i cluster riservati oltre la fine,
+    // che un file compresso non ha.
+    if (new_size == file->size && (file->flags & FILE_COMPRESSED)) {
+        return 0;
+    }
+    if (unshare_file(file) != 0 || ((file->flags & FILE_COMPRESSED) && inflate_file(file) != 0)) {
+        return FILE_WRITE_ERROR;
+    }
+
+    // Se la nuova fine cade nella coda impacchettata basta ridurre la dimensione.
+    if (file->flags & FILE_TAIL_PACKED) {
+        if (new_size / block_size == file->size / block_size && new_size % block_size != 0) {
+            file->size = new_size;
+            fs_save();
+            return 0;
         }
+        tail_release(file);
+    }
 
-        if (current_block == FAT_UNUSED || current_block >= fs->fat_entries || current_block == 0) {
-            printf("copy2fs: Error - current_block %d is out of bounds, unused, or invalid\n", current_block);
-            free(buffer);
-            free(written_blocks);
-            return FILE_WRITE_ERROR;
+    int last = chain_block_at(file->first_block, (new_size + block_size - 1) / block_size - 1);
+    if (last < 0) {
+        printf("fs_truncate: Chain of %.25s.%.3s is shorter than its size\n", file->name, file->extension);
+        return FILE_WRITE_ERROR;
+    }
+    if (fat_table[last] != FAT_END) {
+        int rest = fat_table[last];
+        fat_set(last, FAT_END);
+        release_chain(rest);
+        count_chain(file);
+    }
+    file->size = new_size;
+
+    if (tail_packing_enabled) {
+        pack_tail(file);
+    }
+    fs_save();
+    fs_log("fs_truncate: %.25s.%.3s truncated to %d bytes\n", file->name, file->extension, new_size);
+    return 0;
+}
+
+int fs_statfs(FsStat* st) {
+    if (!fs || !st) {
+        return FILE_READ_ERROR;
+    }
+    int largest_start;
+    st->largest_free_run = largest_free_run(&largest_start);
+    st->block_size = fs->bytes_per_block;
+    st->total_blocks = data_block_count();
+    st->free_blocks = free_block_count;
+    return 0;
+}
+
+// Conta i cluster sotto il cluster mappa node: i cluster mappa in ordine di
+// visita, i blocchi dati in ordine logico, con i buchi che spezzano le corse.
+static void stat_sparse_node(int node, int level, FileStat* st, int* prev_map, int* prev_data) {
+    int* map = (int*)&data_blocks[(size_t)node * fs->bytes_per_block];
+    for (int i = 0; i < SPARSE_MAP_ENTRIES; i++) {
+        if (map[i] == 0) {
+            *prev_data = FAT_END;
+            continue;
+        }
+        int* prev = level > 1 ? prev_map : prev_data;
+        st->blocks++;
+        if (map[i] != *prev + 1) {
+            st->extents++;
+        }
+        *prev = map[i];
+        if (level > 1) {
+            stat_sparse_node(map[i], level - 1, st, prev_map, prev_data);
         }
+    }
+}
 
-        int bytes_to_write = (size - bytes_written > block_size) ? block_size : size - bytes_written;
-        printf("copy2fs: Writing %d bytes to block %d\n", bytes_to_write, current_block);
-        memcpy(&data_blocks[current_block * block_size], &buffer[bytes_written], bytes_to_write);
-        bytes_written += bytes_to_write;
+// Cluster del file e corse contigue in cui sono divisi. Per i file a catena
+// sono tenuti nella voce; le directory percorrono la loro catena, i file
+// sparsi contano i cluster dell'albero della mappa e i blocchi dati.
+int fs_stat_file(const DirectoryEntry* entry, FileStat* st) {
+    if (!entry || !st) {
+        return FILE_NOT_FOUND;
+    }
+    st->size = entry->size;
+    st->flags = entry->flags;
+    st->blocks = 0;
+    st->extents = 0;
+    if (!entry->is_dir && (entry->flags & FILE_INLINE)) {
+        return 0;
+    }
+    if (entry->first_block == FAT_END) {
+        return 0;
+    }
+    if (!entry->is_dir && !(entry->flags & FILE_SPARSE)) {
+        st->blocks = entry->blocks;
+        st->extents = entry->extents;
+        return 0;
+    }
 
-        if (bytes_written < size) {
-            int next_block = fat_table[current_block];
-            if (next_block == FAT_END || next_block == 0) {
-                int new_block = get_free_block();
-                if (new_block == FAT_FULL) {
-                    free(buffer);
-                    free(written_blocks);
-                    return FILE_WRITE_ERROR;
-                }
-                fat_table[current_block] = new_block;
-                fat_table[new_block] = FAT_END;
-                current_block = new_block;
-            } else {
-                current_block = next_block;
-            }
+    // La catena della radice parte dal blocco 0, che chain_length non segue.
+    int first = entry->first_block;
+    int blocks = data_block_count();
+    int prev = FAT_END;
+    for (int b = first; b >= 0 && b < blocks && st->blocks < blocks; b = fat_table[b]) {
+        st->blocks++;
+        if (b != prev + 1) {
+            st->extents++;
         }
+        prev = b;
+    }
+    if (entry->is_dir || !(entry->flags & FILE_SPARSE)) {
+        return 0;
+    }
+
+    if (entry->entry_count >= 1) {
+        int prev_map = first;
+        int prev_data = FAT_END;
+        stat_sparse_node(first, entry->entry_count, st, &prev_map, &prev_data);
+    }
+    return 0;
+}
+
+static int import_host_file(const char* host_path, const char* fs_name, const char* fs_ext, int* size_out) {
+    char* buffer;
+    int size;
+    int res = host_read_file(host_path, &buffer, &size);
+    if (res == FILE_NOT_FOUND) {
+        perror("Error opening host file");
+        return FILE_NOT_FOUND;
+    } else if (res != 0) {
+        printf("Error reading host file: %s\n", host_path);
+        return res;
     }
+    *size_out = size;
 
+    res = create_file(fs_name, fs_ext, size, buffer);
     free(buffer);
-    free(written_blocks);
-    fs_save();
+    if (res != 0) {
+        return res;
+    }
 
-    printf("File copied to FAT file system.\n");
+    fs_log("File copied to FAT file system.\n");
     return 0;
 }
 
+int copy2fs(const char* host_path, const char* fs_name, const char* fs_ext) {
+    uint64_t start = perf_begin();
+    uint64_t hops = perf_hops;
+    int size = 0;
+    int res = import_host_file(host_path, fs_name, fs_ext, &size);
+    perf_end(PERF_COPY2FS, start, hops, res == 0 ? size : 0);
+    return res;
+}
+
 
 int copy2host(const char* fs_name, const char* fs_ext, const char* host_path) {
     DirectoryEntry* file = locate_file(fs_name, fs_ext, 0);
@@ -817,8 +3307,8 @@ int copy2host(const char* fs_name, const char* fs_ext, const char* host_path) {
         return FILE_NOT_FOUND;
     }
 
-    FILE* host_file = fopen(host_path, "wb");
-    if (host_file == NULL) {
+    HostWriter writer;
+    if (host_writer_open(&writer, host_path) != 0) {
         perror("Error opening host file");
         return FILE_WRITE_ERROR;
     }
@@ -827,13 +3317,28 @@ int copy2host(const char* fs_name, const char* fs_ext, const char* host_path) {
     handle.file_entry = file;
     handle.position = 0;
 
-    char buffer[BLOCK_SIZE];
-    int bytes_read;
-    while ((bytes_read = read_file_content(&handle, buffer, BLOCK_SIZE)) > 0) {
-        fwrite(buffer, 1, bytes_read, host_file);
+    // Mentre un buffer si riempie dalla catena, i precedenti vengono scritti sull'host.
+    // Una lettura fallita (cluster corrotto) non deve lasciare sull'host una
+    // copia troncata che sembri riuscita.
+    int bytes_read = 0;
+    char* buffer;
+    while ((buffer = host_writer_buffer(&writer)) && (bytes_read = read_file_data(&handle, buffer, HOSTIO_CHUNK)) > 0) {
+        if (host_writer_submit(&writer, bytes_read) != 0) {
+            break;
+        }
     }
 
-    fclose(host_file);
-    printf("File copied to host file system.\n");
+    if (bytes_read < 0) {
+        host_writer_close(&writer);
+        unlink(host_path);
+        printf("Error reading %s.%s at offset %d (%s), nothing copied to %s\n", fs_name, fs_ext, handle.position,
+               bytes_read == CHECKSUM_ERROR ? "checksum mismatch" : "read error", host_path);
+        return bytes_read;
+    }
+    if (host_writer_close(&writer) != 0) {
+        printf("Error writing host file: %s\n", host_path);
+        return FILE_WRITE_ERROR;
+    }
+    fs_log("File copied to host file system.\n");
     return 0;
 }
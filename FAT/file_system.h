@@ -9,13 +9,45 @@
 #define TOTAL_BLOCKS 65536
 #define FILE_SYSTEM_SIZE (TOTAL_BLOCKS * BLOCK_SIZE)
 
+// Limiti per mkfs con dimensione esplicita. Gli scostamenti nell'immagine sono
+// a 64 bit; il limite viene dalle dimensioni di FAT e tabelle, int
+// nell'intestazione (256 GiB con blocchi da 512 byte).
+#define FS_MIN_BLOCKS 1024
+#define FS_MAX_BLOCKS (0x7FFFFFFF / (int)sizeof(uint32_t))
+
 #define FAT_UNUSED 0x00000000
 #define FAT_END 0x0FFFFFF8
+#define FAT_TAIL 0x0FFFFFF7
 #define FAT_OCCUPIED 0xFFFFFFFF
 
 #define DIR_ENTRY_SIZE 32
 #define DELETED_ENTRY 0xE5
 
+#define FILE_COMPRESSED 0x01
+#define FILE_INLINE 0x02
+#define FILE_TAIL_PACKED 0x04
+#define FILE_SPARSE 0x08
+
+// Caratteristiche dell'immagine, nel campo features dell'intestazione.
+// FS_FEATURE_CHECKSUMS: la tabella dei CRC32C dei cluster e' mantenuta e verificata.
+#define FS_FEATURE_CHECKSUMS 0x01
+
+// entry_size nell'intestazione e' sizeof(DirectoryEntry) al momento di mkfs:
+// le voci determinano la disposizione di ogni blocco di directory, e fs_load
+// rifiuta le immagini scritte con voci di dimensione diversa.
+
+// Origini aggiuntive per seek_file, con gli stessi valori di SEEK_DATA e SEEK_HOLE.
+#define FS_SEEK_DATA 3
+#define FS_SEEK_HOLE 4
+
+// I file piccoli tengono i dati nelle voci che seguono la loro DirectoryEntry
+// nello stesso blocco; name[0] di queste voci vale INLINE_DATA_ENTRY e
+// entry_count del file ne conta il numero.
+#define INLINE_DATA_ENTRY 0x01
+#define INLINE_MAX_SLOTS 4
+
+#define COMPRESS_CHUNK_SIZE 4096
+
 #define DIR_CREATE_ERROR -1
 #define FILE_CREATE_ERROR -2
 #define INIT_ERROR -3
@@ -25,6 +57,7 @@
 #define FAT_FULL -7
 #define FILE_WRITE_ERROR -8
 #define INVALID_DIRECTORY -9
+#define CHECKSUM_ERROR -10
 
 typedef struct {
     int bytes_per_block;
@@ -32,7 +65,11 @@ typedef struct {
     int cluster_size;
     int fat_size;
     int data_size;
+    int refs_size;
+    int crc_size;
     int total_blocks;
+    int features;
+    int entry_size;
     char current_directory[25];
 } FileSystem;
 
@@ -40,12 +77,52 @@ typedef struct DirectoryEntry {
     char name[25];
     char extension[3];
     char is_dir;
+    unsigned char flags;
     struct DirectoryEntry* parent;
     int first_block;
     int size;
     int entry_count;
+    int tail_block;
+    uint16_t tail_offset;
+    int blocks;
+    int extents;
 } __attribute__((packed)) DirectoryEntry;
 
+#define INLINE_SLOT_DATA ((int)sizeof(DirectoryEntry) - 1)
+#define INLINE_MAX_SIZE (INLINE_MAX_SLOTS * INLINE_SLOT_DATA)
+
+// Esito di fs_fsck: conteggi del primo passaggio, remaining dopo le riparazioni.
+typedef struct {
+    int files;
+    int directories;
+    int used_blocks;
+    int leaked_blocks;
+    int cross_links;
+    int cycles;
+    int bad_links;
+    int bad_sizes;
+    int bad_tails;
+    int bad_maps;
+    int bad_refs;
+    int bad_checksums;
+    int problems;
+    int remaining;
+} FsckReport;
+
+typedef struct {
+    int block_size;
+    int total_blocks;
+    int free_blocks;
+    int largest_free_run;
+} FsStat;
+
+typedef struct {
+    int size;
+    int blocks;
+    int extents;
+    unsigned char flags;
+} FileStat;
+
 typedef struct FileHandle {
     DirectoryEntry* file_entry;
     int position;
@@ -54,27 +131,63 @@ typedef struct FileHandle {
 extern FileSystem *fs;
 
 int fs_initialize(const char* file_path);
+int fs_initialize_size(const char* file_path, int total_blocks);
 int fs_load(const char* file_path);
 int fs_save();
+int fs_sync();
+int fs_txn_begin();
+int fs_txn_commit();
+int fs_txn_abort();
+void fs_set_deferred_save(int enabled);
+void fs_log(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void fs_set_verbose(int enabled);
+void fs_lock();
+int fs_trylock();
+void fs_unlock();
 
 DirectoryEntry* get_current_dir();
 FileSystem* get_fs();
 int get_free_block();
 DirectoryEntry* find_empty_dir_entry();
+DirectoryEntry* find_empty_dir_run(int extra_slots);
 int cd(const char* dir_name);
 void ls();
 int create_dir(const char* name);
 int create_file(const char* name, const char* ext, int size, const char* data);
+int create_file_with_hint(const char* name, const char* ext, int size, const char* data, int size_hint);
 DirectoryEntry* locate_file(const char* name, const char* ext, char is_dir);
 int remove_file(const char* name, const char* ext);
 int remove_empty_dir(DirectoryEntry* dir);
 bool is_dir_empty(DirectoryEntry* dir);
 int remove_dir(const char* name, int recursive);
+int fs_rename(const char* src_path, const char* dst_path);
 void display_fs_image(unsigned int max_bytes);
 int read_file_content(FileHandle *handle, char *buffer, int size);
+int fs_read(FileHandle *handle, char *buffer, int size);
 int write_file_content(const char* name, const char* ext, const char* data, int offset, int size);
 int seek_file(FileHandle *handle, int offset, int origin);
+int fs_fallocate(FileHandle* handle, int length);
+int fs_truncate(FileHandle* handle, int new_size);
 int copy2fs(const char* host_path, const char* fs_name, const char* fs_ext);
 int copy2host(const char* fs_name, const char* fs_ext, const char* host_path);
+void fs_set_dedup(int enabled);
+void fs_set_compression(int enabled);
+int fs_compress_file(const char* name, const char* ext);
+void fs_set_tail_packing(int enabled);
+void fs_set_discard(int enabled);
+void fs_set_io_uring(int enabled);
+int fs_set_checksums(int enabled);
+int fs_statfs(FsStat* st);
+int fs_stat_file(const DirectoryEntry* entry, FileStat* st);
+int fs_fsck(int repair, FsckReport* report);
+int fs_defrag(int compact_dirs);
+int fs_defrag_step(int budget);
+int fs_defrag_start(int compact_dirs);
+void fs_defrag_stop();
+int fs_scrub();
+int fs_scrub_step(int budget);
+int fs_scrub_start(int kib_per_sec);
+void fs_scrub_stop();
+void fs_scrub_status();
 
 #endif
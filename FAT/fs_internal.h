@@ -0,0 +1,61 @@
+#ifndef FS_INTERNAL_H
+#define FS_INTERNAL_H
+
+#include "file_system.h"
+#include <stdio.h>
+
+// Stato e formati interni dell'immagine, condivisi dai moduli del file system
+// (file_system.c, fsck.c). Non fa parte dell'interfaccia pubblica.
+
+extern DirectoryEntry *current_dir;
+extern int *fat_table;
+extern uint16_t *block_refs;
+extern uint32_t *crc_table;
+extern char *data_blocks;
+extern FILE *file_system_file;
+
+// Formato dei file compressi: la catena inizia con i blocchi dell'indice
+// (CompressedHeader seguito da un ChunkEntry per chunk), poi i dati dei chunk,
+// ognuno a partire dall'inizio di un blocco.
+typedef struct {
+    uint32_t chunk_count;
+    uint32_t index_blocks;
+} CompressedHeader;
+
+typedef struct {
+    uint32_t first_block;
+    uint16_t stored_len;
+    uint16_t raw_len;
+} ChunkEntry;
+
+// Code dei file impacchettate: piu' frammenti finali condividono un cluster,
+// marcato FAT_TAIL, che inizia con un TailHeader.
+typedef struct {
+    uint16_t used;
+    uint16_t fragments;
+} TailHeader;
+
+// File sparsi: first_block e' la radice di un albero di cluster mappa alto
+// entry_count livelli, ognuno con SPARSE_MAP_ENTRIES voci. Al livello 1 le voci
+// sono i blocchi dati dei blocchi logici del file, sopra i cluster mappa del
+// livello inferiore; 0 indica un buco, o un sottoalbero di soli buchi, che non
+// occupa cluster. L'albero cresce in altezza quando si scrive oltre la sua
+// capacita'. Cluster mappa e dati sono isolati, con FAT_END nella FAT.
+#define SPARSE_MAP_ENTRIES (fs->bytes_per_block / (int)sizeof(int))
+#define SPARSE_MAX_DEPTH 4
+
+int data_block_count();
+int slots_per_block();
+int is_free_slot(const DirectoryEntry* entry);
+void reset_caches();
+void dir_tags_invalidate(int block);
+void block_crc_update(int block);
+int block_crc_verify(int block);
+void fat_set(int block, int value);
+int alloc_extent(int want, int near, int* got);
+void release_chain(int block);
+int chain_length(int block);
+int chain_extents(int block);
+void count_chain(DirectoryEntry* file);
+
+#endif
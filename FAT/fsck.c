@@ -0,0 +1,659 @@
+#include "fs_internal.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Controllo di consistenza dell'immagine. Prima si raccolgono tutte le voci
+// dell'albero (file e directory), poi piu' thread percorrono in parallelo le
+// loro catene costruendo la mappa dei proprietari dei cluster; infine la FAT
+// viene divisa a fette e confrontata con quella mappa.
+
+#define FSCK_MAX_THREADS 16
+#define FSCK_MAX_PASSES 4
+#define FSCK_MAX_PRINTED 20
+#define FSCK_NO_OWNER -1
+
+enum { CLAIM_NEW, CLAIM_SELF, CLAIM_OTHER };
+
+typedef enum {
+    PROBLEM_BAD_LINK,
+    PROBLEM_CYCLE,
+    PROBLEM_CROSS_LINK,
+    PROBLEM_BAD_SIZE,
+    PROBLEM_BAD_TAIL,
+    PROBLEM_BAD_MAP
+} ProblemKind;
+
+static const char* problem_names[] = {
+    "dangling link", "cycle", "cross-linked chain", "size or counts not matching chain", "bad tail fragment", "bad sparse map entry"
+};
+
+// kept_blocks sono i blocchi validi della catena prima del punto in cui va
+// troncata; prev_block e' l'ultimo di questi, FAT_END se tocca alla voce stessa.
+typedef struct {
+    ProblemKind kind;
+    int owner;
+    int block;
+    int prev_block;
+    int kept_blocks;
+    int map_block;
+    int map_index;
+} FsckProblem;
+
+typedef struct {
+    int lo;
+    int hi;
+    int repair;
+    int used;
+    int leaked;
+    int stray;
+    int bad_refs;
+    int bad_tails;
+    int bad_checksums;
+} FatSlice;
+
+static DirectoryEntry** owners;
+static int owner_count;
+static int owner_capacity;
+static int next_owner;
+
+static int blocks;
+static int* block_owner;
+static uint32_t* block_seen;
+static uint16_t* tail_seen;
+static unsigned char* dir_visited;
+
+static FsckProblem* problems;
+static int problem_count;
+static int problem_capacity;
+static pthread_mutex_t problems_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int add_owner(DirectoryEntry* entry) {
+    if (owner_count == owner_capacity) {
+        int capacity = owner_capacity ? owner_capacity * 2 : 256;
+        DirectoryEntry** grown = (DirectoryEntry**)realloc(owners, capacity * sizeof(DirectoryEntry*));
+        if (!grown) {
+            return -1;
+        }
+        owners = grown;
+        owner_capacity = capacity;
+    }
+    owners[owner_count++] = entry;
+    return 0;
+}
+
+static void add_map_problem(ProblemKind kind, int owner, int block, int prev_block, int kept_blocks, int map_block, int map_index) {
+    pthread_mutex_lock(&problems_lock);
+    if (problem_count == problem_capacity) {
+        int capacity = problem_capacity ? problem_capacity * 2 : 64;
+        FsckProblem* grown = (FsckProblem*)realloc(problems, capacity * sizeof(FsckProblem));
+        if (!grown) {
+            pthread_mutex_unlock(&problems_lock);
+            return;
+        }
+        problems = grown;
+        problem_capacity = capacity;
+    }
+    FsckProblem* p = &problems[problem_count++];
+    p->kind = kind;
+    p->owner = owner;
+    p->block = block;
+    p->prev_block = prev_block;
+    p->kept_blocks = kept_blocks;
+    p->map_block = map_block;
+    p->map_index = map_index;
+    pthread_mutex_unlock(&problems_lock);
+}
+
+static void add_problem(ProblemKind kind, int owner, int block, int prev_block, int kept_blocks) {
+    add_map_problem(kind, owner, block, prev_block, kept_blocks, FAT_END, -1);
+}
+
+static int is_chain_block(int block) {
+    return block >= 0 && block < blocks && fat_table[block] != FAT_UNUSED && fat_table[block] != FAT_TAIL;
+}
+
+// Raccoglie ricorsivamente le voci di una directory. I blocchi di directory gia'
+// visti non vengono riaperti, cosi' cicli e directory condivise non fanno
+// raccogliere due volte le stesse voci: le loro catene risulteranno incrociate.
+static int collect_dir(DirectoryEntry* dir, DirectoryEntry* root) {
+    if (add_owner(dir) != 0) {
+        return -1;
+    }
+    int per_block = slots_per_block();
+    for (int block = dir == root ? 0 : dir->first_block; is_chain_block(block) && !dir_visited[block]; block = fat_table[block]) {
+        dir_visited[block] = 1;
+        DirectoryEntry* slots = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        for (int i = 0; i < per_block; i++) {
+            DirectoryEntry* entry = &slots[i];
+            if (entry == root || is_free_slot(entry) || (unsigned char)entry->name[0] == INLINE_DATA_ENTRY ||
+                strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+                continue;
+            }
+            if (entry->is_dir && is_chain_block(entry->first_block) && !dir_visited[entry->first_block]) {
+                if (collect_dir(entry, root) != 0) {
+                    return -1;
+                }
+            } else if (add_owner(entry) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Il primo che raggiunge un blocco ne diventa il proprietario; block_seen conta
+// comunque tutti i riferimenti entranti, da confrontare con block_refs.
+static int claim(int block, int owner) {
+    __atomic_add_fetch(&block_seen[block], 1, __ATOMIC_RELAXED);
+    int expected = FSCK_NO_OWNER;
+    if (__atomic_compare_exchange_n(&block_owner[block], &expected, owner, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return CLAIM_NEW;
+    }
+    return expected == owner ? CLAIM_SELF : CLAIM_OTHER;
+}
+
+// Lunghezza di un suffisso condiviso, visitato da un altro proprietario: i suoi
+// problemi li segnala quello, qui basta non contare oltre un blocco non valido.
+static int shared_length(int block) {
+    int count = 0;
+    for (; count < blocks && block != FAT_END && is_chain_block(block); block = fat_table[block]) {
+        count++;
+    }
+    return count;
+}
+
+// Percorre una catena e restituisce il numero di blocchi validi; broken indica
+// che e' gia' stato segnalato un problema che la tronca. Un blocco gia'
+// di un altro proprietario e' lecito solo se la deduplicazione lo condivide:
+// in quel caso il resto della catena e' gia' stato visitato da chi l'ha raggiunto prima.
+static int walk_chain(int owner, int first, int* broken) {
+    int prev = FAT_END;
+    *broken = 1;
+    int kept = 0;
+    for (int block = first; block != FAT_END; block = fat_table[block]) {
+        if (!is_chain_block(block) || (block == 0 && owner != 0)) {
+            add_problem(PROBLEM_BAD_LINK, owner, block, prev, kept);
+            return kept;
+        }
+        int claimed = claim(block, owner);
+        if (claimed == CLAIM_SELF) {
+            add_problem(PROBLEM_CYCLE, owner, block, prev, kept);
+            return kept;
+        }
+        if (claimed == CLAIM_OTHER) {
+            if (block_refs[block] < 2) {
+                add_problem(PROBLEM_CROSS_LINK, owner, block, prev, kept);
+                return kept;
+            }
+            *broken = 0;
+            return kept + shared_length(block);
+        }
+        kept++;
+        prev = block;
+    }
+    *broken = 0;
+    return kept;
+}
+
+// Scende nell'albero della mappa di un file sparso: ogni voce deve indicare un
+// cluster isolato non ancora reclamato, cluster mappa ai livelli sopra il primo.
+static void check_sparse_node(int owner, int node, int level, int kept) {
+    int* map = (int*)&data_blocks[(size_t)node * fs->bytes_per_block];
+    for (int j = 0; j < SPARSE_MAP_ENTRIES; j++) {
+        int child = map[j];
+        if (child == 0) {
+            continue;
+        }
+        if (child < 1 || child >= blocks || fat_table[child] != FAT_END || claim(child, owner) != CLAIM_NEW) {
+            add_map_problem(PROBLEM_BAD_MAP, owner, child, FAT_END, kept, node, j);
+        } else if (level > 1) {
+            check_sparse_node(owner, child, level - 1, kept);
+        }
+    }
+}
+
+// La radice e' l'unico cluster della catena del file; con un'altezza fuori
+// misura i cluster sotto di essa restano non reclamati e risultano persi.
+static void check_sparse_map(int owner, const DirectoryEntry* entry, int kept) {
+    if (kept == 1 && entry->entry_count >= 1 && entry->entry_count <= SPARSE_MAX_DEPTH) {
+        check_sparse_node(owner, entry->first_block, entry->entry_count, kept);
+    }
+}
+
+// Copia l'indice di un file compresso dai primi blocchi della sua catena.
+static char* read_compressed_index(int first, int kept, int* index_len) {
+    int block_size = fs->bytes_per_block;
+    CompressedHeader* header = (CompressedHeader*)&data_blocks[(size_t)first * block_size];
+    if (header->index_blocks == 0 || (int)header->index_blocks > kept) {
+        return NULL;
+    }
+    size_t len = sizeof(CompressedHeader) + (size_t)header->chunk_count * sizeof(ChunkEntry);
+    if (len > (size_t)header->index_blocks * block_size) {
+        return NULL;
+    }
+    char* index = (char*)malloc(header->index_blocks * block_size);
+    if (!index) {
+        return NULL;
+    }
+    int block = first;
+    for (uint32_t i = 0; i < header->index_blocks; i++, block = fat_table[block]) {
+        memcpy(index + i * block_size, &data_blocks[(size_t)block * block_size], block_size);
+    }
+    *index_len = (int)len;
+    return index;
+}
+
+static int compressed_consistent(const DirectoryEntry* entry, int kept) {
+    if (entry->first_block == FAT_END || kept == 0) {
+        return entry->size == 0;
+    }
+    int block_size = fs->bytes_per_block;
+    int len;
+    char* index = read_compressed_index(entry->first_block, kept, &len);
+    if (!index) {
+        return 0;
+    }
+    CompressedHeader* header = (CompressedHeader*)index;
+    ChunkEntry* chunks = (ChunkEntry*)(index + sizeof(CompressedHeader));
+    int ok = (int)header->chunk_count == (entry->size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    for (uint32_t i = 0; ok && i < header->chunk_count; i++) {
+        ok = chunks[i].raw_len <= COMPRESS_CHUNK_SIZE && chunks[i].stored_len <= chunks[i].raw_len &&
+             (int)chunks[i].first_block + (chunks[i].stored_len + block_size - 1) / block_size <= kept;
+    }
+    free(index);
+    return ok;
+}
+
+// Corse contigue dei primi kept blocchi della catena, tutti validi.
+static int kept_extents(int first, int kept) {
+    int extents = 0;
+    int prev = FAT_END;
+    for (int i = 0, block = first; i < kept; i++, block = fat_table[block]) {
+        if (block != prev + 1) {
+            extents++;
+        }
+        prev = block;
+    }
+    return extents;
+}
+
+// Controlla che la dimensione del file sia coperta dai kept blocchi rimasti nella
+// sua catena e che blocchi e corse salvati nella voce corrispondano; con repair
+// riduce la dimensione (o svuota il file) e ricalcola i conteggi.
+static int fix_size(DirectoryEntry* entry, int kept, int repair) {
+    int block_size = fs->bytes_per_block;
+    if (entry->is_dir || (entry->flags & FILE_SPARSE)) {
+        return 0;
+    }
+    if (entry->flags & FILE_INLINE) {
+        int slots = entry->entry_count < 0 ? 0 : entry->entry_count > INLINE_MAX_SLOTS ? INLINE_MAX_SLOTS : entry->entry_count;
+        if (entry->size >= 0 && entry->size <= slots * INLINE_SLOT_DATA && slots == entry->entry_count) {
+            return 0;
+        }
+        if (repair) {
+            entry->entry_count = slots;
+            entry->size = entry->size < 0 ? 0 : entry->size > slots * INLINE_SLOT_DATA ? slots * INLINE_SLOT_DATA : entry->size;
+        }
+        return 1;
+    }
+    int miscounted = entry->blocks != kept || entry->extents != kept_extents(entry->first_block, kept);
+    if (repair && miscounted) {
+        entry->blocks = kept;
+        entry->extents = kept_extents(entry->first_block, kept);
+    }
+    if (entry->flags & FILE_COMPRESSED) {
+        if (compressed_consistent(entry, kept)) {
+            return miscounted;
+        }
+        // Un indice rotto non si aggiusta: il file viene svuotato e la catena,
+        // rimasta senza proprietario, liberata al passaggio successivo.
+        if (repair) {
+            entry->first_block = FAT_END;
+            entry->size = 0;
+            entry->flags = 0;
+            entry->blocks = 0;
+            entry->extents = 0;
+        }
+        return 1;
+    }
+
+    int chain_bytes = (entry->flags & FILE_TAIL_PACKED) ? entry->size / block_size * block_size : entry->size;
+    if (entry->size >= 0 && chain_bytes <= kept * block_size) {
+        return miscounted;
+    }
+    if (repair) {
+        entry->flags &= ~FILE_TAIL_PACKED;
+        entry->size = entry->size < 0 ? 0 : kept * block_size;
+    }
+    return 1;
+}
+
+static void check_tail(int owner, DirectoryEntry* entry, int kept) {
+    int block_size = fs->bytes_per_block;
+    int block = entry->tail_block;
+    int len = entry->size % block_size;
+    if (block > 0 && block < blocks && fat_table[block] == FAT_TAIL) {
+        TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * block_size];
+        if (entry->tail_offset >= sizeof(TailHeader) && header->used <= block_size && entry->tail_offset + len <= header->used) {
+            __atomic_add_fetch(&tail_seen[block], 1, __ATOMIC_RELAXED);
+            int expected = FSCK_NO_OWNER;
+            __atomic_compare_exchange_n(&block_owner[block], &expected, owner, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            return;
+        }
+    }
+    add_problem(PROBLEM_BAD_TAIL, owner, block, FAT_END, kept);
+}
+
+static void check_owner(int owner) {
+    DirectoryEntry* entry = owners[owner];
+    int broken = 0;
+    if (entry->is_dir) {
+        walk_chain(owner, owner == 0 ? 0 : entry->first_block, &broken);
+        return;
+    }
+    if (entry->flags & FILE_INLINE) {
+        if (fix_size(entry, 0, 0)) {
+            add_problem(PROBLEM_BAD_SIZE, owner, FAT_END, FAT_END, 0);
+        }
+        return;
+    }
+
+    int kept = entry->first_block == FAT_END ? 0 : walk_chain(owner, entry->first_block, &broken);
+    if (entry->flags & FILE_SPARSE) {
+        check_sparse_map(owner, entry, kept);
+        return;
+    }
+    if ((entry->flags & FILE_TAIL_PACKED) && !(entry->flags & FILE_COMPRESSED)) {
+        check_tail(owner, entry, kept);
+    }
+    if (!broken && fix_size(entry, kept, 0)) {
+        add_problem(PROBLEM_BAD_SIZE, owner, FAT_END, FAT_END, kept);
+    }
+}
+
+static void* walk_worker(void* arg) {
+    (void)arg;
+    for (;;) {
+        int owner = __atomic_fetch_add(&next_owner, 1, __ATOMIC_RELAXED);
+        if (owner >= owner_count) {
+            return NULL;
+        }
+        check_owner(owner);
+    }
+}
+
+// Confronta una fetta della FAT con la mappa dei proprietari. Ogni thread
+// ripara solo i blocchi della propria fetta, quindi senza lock.
+static void* fat_worker(void* arg) {
+    FatSlice* slice = (FatSlice*)arg;
+    for (int block = slice->lo; block < slice->hi; block++) {
+        int next = fat_table[block];
+        if (block >= blocks) {
+            if (next != FAT_UNUSED || block_refs[block] != 0) {
+                slice->stray++;
+                if (slice->repair) {
+                    fat_table[block] = FAT_UNUSED;
+                    block_refs[block] = 0;
+                }
+            }
+            continue;
+        }
+        if (next == FAT_UNUSED) {
+            if (block_refs[block] != 0) {
+                slice->bad_refs++;
+                if (slice->repair) {
+                    block_refs[block] = 0;
+                }
+            }
+            continue;
+        }
+        slice->used++;
+        if (block_owner[block] == FSCK_NO_OWNER) {
+            slice->leaked++;
+            if (slice->repair) {
+                fat_table[block] = FAT_UNUSED;
+                block_refs[block] = 0;
+            }
+            continue;
+        }
+        if (next == FAT_TAIL) {
+            TailHeader* header = (TailHeader*)&data_blocks[(size_t)block * fs->bytes_per_block];
+            if (header->fragments != tail_seen[block]) {
+                slice->bad_tails++;
+                if (slice->repair) {
+                    header->fragments = tail_seen[block];
+                }
+            }
+            continue;
+        }
+        // Un CRC sbagliato non si ripara: il contenuto del cluster e' perso.
+        if (block_crc_verify(block) != 0) {
+            slice->bad_checksums++;
+        }
+        if (block_refs[block] != 0 && block_refs[block] != block_seen[block]) {
+            slice->bad_refs++;
+            if (slice->repair) {
+                block_refs[block] = block_seen[block] > UINT16_MAX ? UINT16_MAX : block_seen[block];
+            }
+        }
+    }
+    return NULL;
+}
+
+static int thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : (int)cpus;
+}
+
+// Avvia count thread su start; se la creazione fallisce il lavoro viene svolto
+// dal thread chiamante, che comunque partecipa.
+static void run_parallel(int count, void* (*start)(void*), void* args, size_t arg_size) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int started[FSCK_MAX_THREADS];
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, start, (char*)args + i * arg_size) == 0;
+        if (!started[i]) {
+            start((char*)args + i * arg_size);
+        }
+    }
+    start(args);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+static void print_problem(const FsckProblem* p) {
+    DirectoryEntry* entry = owners[p->owner];
+    printf("fsck: %.*s%s%.*s: %s", (int)sizeof(entry->name), p->owner == 0 ? "ROOT" : entry->name,
+           entry->extension[0] ? "." : "", (int)sizeof(entry->extension), entry->extension, problem_names[p->kind]);
+    if (p->block != FAT_END) {
+        printf(" at block %d", p->block);
+    }
+    printf("\n");
+}
+
+// Tronca la catena nel punto indicato dal problema e rimette in regola la voce.
+static void repair_problem(const FsckProblem* p) {
+    DirectoryEntry* entry = owners[p->owner];
+    switch (p->kind) {
+    case PROBLEM_BAD_LINK:
+    case PROBLEM_CYCLE:
+    case PROBLEM_CROSS_LINK:
+        if (p->prev_block != FAT_END) {
+            fat_table[p->prev_block] = FAT_END;
+        } else if (entry->is_dir) {
+            // Una directory senza blocchi non e' utilizzabile: la voce viene cancellata.
+            entry->name[0] = (char)DELETED_ENTRY;
+            return;
+        } else {
+            entry->first_block = FAT_END;
+        }
+        fix_size(entry, p->kept_blocks, 1);
+        break;
+    case PROBLEM_BAD_SIZE:
+        fix_size(entry, p->kept_blocks, 1);
+        break;
+    case PROBLEM_BAD_TAIL:
+        entry->flags &= ~FILE_TAIL_PACKED;
+        entry->size = entry->size / fs->bytes_per_block * fs->bytes_per_block;
+        fix_size(entry, p->kept_blocks, 1);
+        break;
+    case PROBLEM_BAD_MAP:
+        ((int*)&data_blocks[(size_t)p->map_block * fs->bytes_per_block])[p->map_index] = 0;
+        break;
+    }
+}
+
+static void release_state() {
+    free(owners);
+    free(block_owner);
+    free(block_seen);
+    free(tail_seen);
+    free(dir_visited);
+    free(problems);
+    owners = NULL;
+    block_owner = NULL;
+    block_seen = NULL;
+    tail_seen = NULL;
+    dir_visited = NULL;
+    problems = NULL;
+    owner_count = owner_capacity = 0;
+    problem_count = problem_capacity = 0;
+}
+
+// Un passaggio completo: raccolta dell'albero, visita parallela delle catene,
+// riparazioni dei singoli file e scansione parallela della FAT.
+static int fsck_pass(int repair, FsckReport* report, int verbose) {
+    int entries = fs->fat_entries;
+    blocks = data_block_count();
+    next_owner = 0;
+    block_owner = (int*)malloc(entries * sizeof(int));
+    block_seen = (uint32_t*)calloc(entries, sizeof(uint32_t));
+    tail_seen = (uint16_t*)calloc(entries, sizeof(uint16_t));
+    dir_visited = (unsigned char*)calloc(entries, 1);
+    if (!block_owner || !block_seen || !tail_seen || !dir_visited) {
+        release_state();
+        return FILE_READ_ERROR;
+    }
+    for (int i = 0; i < entries; i++) {
+        block_owner[i] = FSCK_NO_OWNER;
+    }
+
+    DirectoryEntry* root = (DirectoryEntry*)data_blocks;
+    if (collect_dir(root, root) != 0) {
+        release_state();
+        return FILE_READ_ERROR;
+    }
+
+    int threads = thread_count();
+    run_parallel(threads, walk_worker, NULL, 0);
+
+    memset(report, 0, sizeof(*report));
+    for (int i = 0; i < owner_count; i++) {
+        if (owners[i]->is_dir) {
+            report->directories++;
+        } else {
+            report->files++;
+        }
+    }
+    for (int i = 0; i < problem_count; i++) {
+        switch (problems[i].kind) {
+        case PROBLEM_BAD_LINK: report->bad_links++; break;
+        case PROBLEM_CYCLE: report->cycles++; break;
+        case PROBLEM_CROSS_LINK: report->cross_links++; break;
+        case PROBLEM_BAD_SIZE: report->bad_sizes++; break;
+        case PROBLEM_BAD_TAIL: report->bad_tails++; break;
+        case PROBLEM_BAD_MAP: report->bad_maps++; break;
+        }
+        if (verbose && i < FSCK_MAX_PRINTED) {
+            print_problem(&problems[i]);
+        }
+        if (repair) {
+            repair_problem(&problems[i]);
+        }
+    }
+    if (verbose && problem_count > FSCK_MAX_PRINTED) {
+        printf("fsck: ... and %d more\n", problem_count - FSCK_MAX_PRINTED);
+    }
+
+    FatSlice slices[FSCK_MAX_THREADS];
+    int per_thread = (entries + threads - 1) / threads;
+    for (int i = 0; i < threads; i++) {
+        memset(&slices[i], 0, sizeof(FatSlice));
+        slices[i].lo = i * per_thread < entries ? i * per_thread : entries;
+        slices[i].hi = slices[i].lo + per_thread < entries ? slices[i].lo + per_thread : entries;
+        slices[i].repair = repair;
+    }
+    run_parallel(threads, fat_worker, slices, sizeof(FatSlice));
+    for (int i = 0; i < threads; i++) {
+        report->used_blocks += slices[i].used;
+        report->leaked_blocks += slices[i].leaked + slices[i].stray;
+        report->bad_refs += slices[i].bad_refs;
+        report->bad_tails += slices[i].bad_tails;
+        report->bad_checksums += slices[i].bad_checksums;
+    }
+
+    report->problems = report->bad_links + report->cycles + report->cross_links + report->bad_sizes +
+                       report->bad_tails + report->bad_maps + report->leaked_blocks + report->bad_refs +
+                       report->bad_checksums;
+    release_state();
+    return report->problems;
+}
+
+int fs_fsck(int repair, FsckReport* report) {
+    if (!fs) {
+        printf("fsck: No file system loaded\n");
+        return FILE_READ_ERROR;
+    }
+
+    int problems_found = fsck_pass(repair, report, 1);
+    if (problems_found < 0) {
+        printf("fsck: Out of memory\n");
+        return problems_found;
+    }
+    printf("fsck: %d files, %d directories, %d/%d blocks used\n",
+           report->files, report->directories, report->used_blocks, data_block_count());
+    printf("fsck: %d leaked blocks, %d cross-links, %d cycles, %d dangling links\n",
+           report->leaked_blocks, report->cross_links, report->cycles, report->bad_links);
+    printf("fsck: %d bad sizes, %d bad tails, %d bad sparse maps, %d bad refcounts, %d bad checksums\n",
+           report->bad_sizes, report->bad_tails, report->bad_maps, report->bad_refs, report->bad_checksums);
+
+    // I CRC sbagliati non si riparano: restano fra i problemi rimasti, ma non
+    // tengono in piedi il ciclo delle riparazioni.
+    int bad_checksums = report->bad_checksums;
+    int left = problems_found - bad_checksums;
+    if (repair && left > 0) {
+        // Una riparazione puo' lasciare blocchi senza proprietario (code tagliate,
+        // file svuotati): si ripete finche' l'immagine non risulta pulita.
+        FsckReport pass;
+        for (int i = 1; i < FSCK_MAX_PASSES && left > 0; i++) {
+            left = fsck_pass(1, &pass, 0);
+            bad_checksums = pass.bad_checksums;
+            left -= bad_checksums;
+        }
+        if (left > 0) {
+            left = fsck_pass(0, &pass, 0);
+            bad_checksums = pass.bad_checksums;
+            left -= bad_checksums;
+        }
+        reset_caches();
+        fs_save();
+        printf("fsck: Repaired, %d problems remaining\n", left + bad_checksums);
+    }
+    report->remaining = left + bad_checksums;
+    if (repair && bad_checksums > 0) {
+        printf("fsck: %d clusters with bad checksums cannot be repaired, their content is lost\n", bad_checksums);
+    }
+    if (problems_found == 0) {
+        printf("fsck: Clean\n");
+    }
+    return problems_found;
+}
@@ -0,0 +1,40 @@
+#include "file_system.h"
+#include <stdio.h>
+#include <string.h>
+
+#define DATATICUS_FILE "DATATICUS.dat"
+
+// Codici d'uscita come quelli di e2fsck.
+#define FSCK_EXIT_CLEAN 0
+#define FSCK_EXIT_REPAIRED 1
+#define FSCK_EXIT_UNREPAIRED 4
+#define FSCK_EXIT_ERROR 8
+
+int main(int argc, char** argv) {
+    int repair = 0;
+    const char* path = DATATICUS_FILE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            repair = 1;
+        } else if (argv[i][0] == '-') {
+            printf("Usage: %s [-r] [image]\n", argv[0]);
+            return FSCK_EXIT_ERROR;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (fs_load(path) != 0) {
+        return FSCK_EXIT_ERROR;
+    }
+
+    FsckReport report;
+    int problems = fs_fsck(repair, &report);
+    if (problems < 0) {
+        return FSCK_EXIT_ERROR;
+    }
+    if (problems == 0) {
+        return FSCK_EXIT_CLEAN;
+    }
+    return repair && report.remaining == 0 ? FSCK_EXIT_REPAIRED : FSCK_EXIT_UNREPAIRED;
+}
@@ -0,0 +1,398 @@
+#include "file_system.h"
+#include "hostio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// io_uring viene usato direttamente tramite le chiamate di sistema, senza
+// liburing. Le code hanno il doppio delle voci delle richieste in volo, cosi'
+// la coda di sottomissione non si riempie mai.
+
+static int uring_enabled = 1;
+static int uring_unavailable;
+
+void fs_set_io_uring(int enabled) {
+    uring_enabled = enabled;
+    fs_log("io_uring: %s\n", enabled ? "enabled" : "disabled");
+}
+
+static int ring_setup(HostRing* r) {
+    if (!uring_enabled || uring_unavailable) {
+        return -1;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, HOSTIO_DEPTH * 2, &p);
+    if (fd < 0) {
+        // Kernel senza io_uring o chiamata vietata: inutile riprovare.
+        if (errno == ENOSYS || errno == EPERM) {
+            uring_unavailable = 1;
+        }
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    r->cq_ptr = r->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_size);
+        }
+        munmap(r->sq_ptr, r->sq_size);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = (char*)r->sq_ptr;
+    char* cq = (char*)r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_teardown(HostRing* r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+// Accoda una richiesta e la consegna subito al kernel.
+static int ring_submit(HostRing* r, int opcode, int fd, const void* addr, unsigned len, off_t offset, int buf_index, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+// Attende il prossimo completamento.
+static int ring_wait(HostRing* r, uint64_t* user_data, int* res) {
+    while (1) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            *user_data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+static int read_sync(int fd, char* buffer, int size) {
+    int done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FILE_READ_ERROR;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Legge size byte con fino a HOSTIO_DEPTH letture in volo. Restituisce 1 se
+// io_uring non e' disponibile.
+static int read_ring(int fd, char* buffer, int size) {
+    HostRing ring;
+    if (ring_setup(&ring) != 0) {
+        return 1;
+    }
+
+    struct iovec iov[HOSTIO_DEPTH];
+    off_t offsets[HOSTIO_DEPTH];
+    memset(iov, 0, sizeof(iov));
+    int next = 0;
+    int inflight = 0;
+    int error = 0;
+
+    while (1) {
+        for (int i = 0; i < HOSTIO_DEPTH && !error && next < size; i++) {
+            if (iov[i].iov_len != 0) {
+                continue;
+            }
+            int len = size - next < HOSTIO_CHUNK ? size - next : HOSTIO_CHUNK;
+            iov[i].iov_base = buffer + next;
+            iov[i].iov_len = len;
+            offsets[i] = next;
+            if (ring_submit(&ring, IORING_OP_READV, fd, &iov[i], 1, offsets[i], 0, i) != 0) {
+                iov[i].iov_len = 0;
+                error = 1;
+                break;
+            }
+            inflight++;
+            next += len;
+        }
+        if (inflight == 0) {
+            break;
+        }
+
+        uint64_t i;
+        int res;
+        if (ring_wait(&ring, &i, &res) != 0) {
+            error = 1;
+            break;
+        }
+        inflight--;
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        } else if (res <= 0) {
+            // Errore, o file accorciato mentre veniva letto.
+            iov[i].iov_len = 0;
+            error = 1;
+            continue;
+        }
+        if ((size_t)res < iov[i].iov_len) {
+            iov[i].iov_base = (char*)iov[i].iov_base + res;
+            iov[i].iov_len -= res;
+            offsets[i] += res;
+            if (ring_submit(&ring, IORING_OP_READV, fd, &iov[i], 1, offsets[i], 0, i) != 0) {
+                iov[i].iov_len = 0;
+                error = 1;
+                continue;
+            }
+            inflight++;
+        } else {
+            iov[i].iov_len = 0;
+        }
+    }
+
+    // Dopo un errore di attesa le richieste ancora in volo muoiono con l'anello.
+    ring_teardown(&ring);
+    return error ? FILE_READ_ERROR : 0;
+}
+
+// Legge tutto il file dell'host in un buffer allocato, da liberare con free.
+int host_read_file(const char* path, char** data, int* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return FILE_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size > INT_MAX) {
+        close(fd);
+        return FILE_READ_ERROR;
+    }
+
+    char* buffer = (char*)malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!buffer) {
+        close(fd);
+        return FILE_READ_ERROR;
+    }
+
+    int res = read_ring(fd, buffer, (int)st.st_size);
+    if (res == 1) {
+        res = read_sync(fd, buffer, (int)st.st_size);
+    }
+    close(fd);
+    if (res != 0) {
+        free(buffer);
+        return res;
+    }
+
+    *data = buffer;
+    *size = (int)st.st_size;
+    return 0;
+}
+
+static void writer_issue(HostWriter* w, int i) {
+    int res;
+    if (w->registered) {
+        res = ring_submit(&w->ring, IORING_OP_WRITE_FIXED, w->fd, w->iov[i].iov_base, w->iov[i].iov_len, w->offsets[i], i, i);
+    } else {
+        res = ring_submit(&w->ring, IORING_OP_WRITEV, w->fd, &w->iov[i], 1, w->offsets[i], 0, i);
+    }
+    if (res != 0) {
+        w->busy[i] = 0;
+        w->error = 1;
+        return;
+    }
+    w->inflight++;
+}
+
+// Raccoglie una scrittura completata, ripresentando il resto se e' stata parziale.
+static void writer_reap(HostWriter* w) {
+    uint64_t i;
+    int res;
+    if (ring_wait(&w->ring, &i, &res) != 0) {
+        w->error = 1;
+        w->inflight = 0;
+        return;
+    }
+    w->inflight--;
+    if (res == -EINTR || res == -EAGAIN) {
+        writer_issue(w, i);
+    } else if (res <= 0) {
+        w->busy[i] = 0;
+        w->error = 1;
+    } else if ((size_t)res < w->iov[i].iov_len) {
+        w->iov[i].iov_base = (char*)w->iov[i].iov_base + res;
+        w->iov[i].iov_len -= res;
+        w->offsets[i] += res;
+        writer_issue(w, i);
+    } else {
+        w->busy[i] = 0;
+    }
+}
+
+int host_writer_open(HostWriter* w, const char* path) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd == -1) {
+        return FILE_WRITE_ERROR;
+    }
+
+    w->use_ring = ring_setup(&w->ring) == 0;
+    int count = w->use_ring ? HOSTIO_DEPTH : 1;
+    for (int i = 0; i < count; i++) {
+        if (posix_memalign((void**)&w->buffers[i], 4096, HOSTIO_CHUNK) != 0) {
+            w->buffers[i] = NULL;
+            host_writer_close(w);
+            return FILE_WRITE_ERROR;
+        }
+        w->iov[i].iov_base = w->buffers[i];
+        w->iov[i].iov_len = HOSTIO_CHUNK;
+    }
+
+    // Con i buffer registrati il kernel non deve mappare le pagine a ogni
+    // scrittura; il limite di memoria bloccabile puo' impedirlo, e allora si
+    // usano scritture normali.
+    if (w->use_ring && syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS, w->iov, HOSTIO_DEPTH) == 0) {
+        w->registered = 1;
+    }
+    return 0;
+}
+
+// Restituisce un buffer libero da HOSTIO_CHUNK byte, attendendo se sono tutti in volo.
+char* host_writer_buffer(HostWriter* w) {
+    if (!w->use_ring) {
+        w->current = 0;
+        return w->buffers[0];
+    }
+    while (1) {
+        for (int i = 0; i < HOSTIO_DEPTH; i++) {
+            if (!w->busy[i]) {
+                w->current = i;
+                return w->buffers[i];
+            }
+        }
+        writer_reap(w);
+    }
+}
+
+// Scrive in coda al file i primi len byte dell'ultimo buffer ottenuto.
+int host_writer_submit(HostWriter* w, int len) {
+    if (w->error) {
+        return FILE_WRITE_ERROR;
+    }
+    if (len <= 0) {
+        return 0;
+    }
+
+    if (!w->use_ring) {
+        int done = 0;
+        while (done < len) {
+            ssize_t n = pwrite(w->fd, w->buffers[0] + done, len - done, w->next_offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                w->error = 1;
+                return FILE_WRITE_ERROR;
+            }
+            done += n;
+        }
+        w->next_offset += len;
+        return 0;
+    }
+
+    int i = w->current;
+    w->busy[i] = 1;
+    w->iov[i].iov_base = w->buffers[i];
+    w->iov[i].iov_len = len;
+    w->offsets[i] = w->next_offset;
+    w->next_offset += len;
+    writer_issue(w, i);
+    return w->error ? FILE_WRITE_ERROR : 0;
+}
+
+int host_writer_close(HostWriter* w) {
+    if (w->use_ring) {
+        while (w->inflight > 0) {
+            writer_reap(w);
+        }
+        ring_teardown(&w->ring);
+    }
+    for (int i = 0; i < HOSTIO_DEPTH; i++) {
+        free(w->buffers[i]);
+    }
+    if (w->fd != -1 && close(w->fd) != 0) {
+        w->error = 1;
+    }
+    return w->error ? FILE_WRITE_ERROR : 0;
+}
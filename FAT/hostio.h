@@ -0,0 +1,56 @@
+#ifndef HOSTIO_H
+#define HOSTIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// I/O sui file dell'host per copy2fs e copy2host. Con io_uring tiene
+// HOSTIO_DEPTH richieste da HOSTIO_CHUNK byte in volo; se il kernel non lo
+// offre, o e' disattivato, ripiega su pread/pwrite.
+
+#define HOSTIO_CHUNK (256 * 1024)
+#define HOSTIO_DEPTH 8
+
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} HostRing;
+
+// Scrittore a buffer rotanti: il chiamante riempie un buffer mentre i
+// precedenti vengono scritti sul file dell'host.
+typedef struct {
+    int fd;
+    int use_ring;
+    int registered;
+    HostRing ring;
+    char* buffers[HOSTIO_DEPTH];
+    struct iovec iov[HOSTIO_DEPTH];
+    int busy[HOSTIO_DEPTH];
+    off_t offsets[HOSTIO_DEPTH];
+    int current;
+    int inflight;
+    off_t next_offset;
+    int error;
+} HostWriter;
+
+int host_read_file(const char* path, char** data, int* size);
+
+int host_writer_open(HostWriter* w, const char* path);
+char* host_writer_buffer(HostWriter* w);
+int host_writer_submit(HostWriter* w, int len);
+int host_writer_close(HostWriter* w);
+
+#endif
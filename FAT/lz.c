@@ -0,0 +1,176 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+static inline uint32_t lz_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int lz_hash(uint32_t v) {
+    return (int)((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+static int lz_write_length(unsigned char* dst, int op, int dst_cap, int len) {
+    while (len >= 255) {
+        if (op >= dst_cap) {
+            return LZ_ERROR;
+        }
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= dst_cap) {
+        return LZ_ERROR;
+    }
+    dst[op++] = (unsigned char)len;
+    return op;
+}
+
+// Scrive una sequenza: i letterali [literals, literals + literal_len) seguiti,
+// se match_len > 0, da un riferimento all'indietro di match_len byte.
+static int lz_emit(unsigned char* dst, int op, int dst_cap, const unsigned char* literals, int literal_len, int offset, int match_len) {
+    if (op >= dst_cap) {
+        return LZ_ERROR;
+    }
+    int token = op++;
+    int lit_code = literal_len < 15 ? literal_len : 15;
+    int match_code = 0;
+    if (match_len > 0) {
+        match_code = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+    }
+    dst[token] = (unsigned char)((lit_code << 4) | match_code);
+
+    if (lit_code == 15) {
+        op = lz_write_length(dst, op, dst_cap, literal_len - 15);
+        if (op < 0) {
+            return LZ_ERROR;
+        }
+    }
+    if (op + literal_len > dst_cap) {
+        return LZ_ERROR;
+    }
+    memcpy(dst + op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len > 0) {
+        if (op + 2 > dst_cap) {
+            return LZ_ERROR;
+        }
+        dst[op++] = (unsigned char)(offset & 0xFF);
+        dst[op++] = (unsigned char)(offset >> 8);
+        if (match_code == 15) {
+            op = lz_write_length(dst, op, dst_cap, match_len - LZ_MIN_MATCH - 15);
+        }
+    }
+    return op;
+}
+
+int lz_compress(const char* src, int src_len, char* dst, int dst_cap) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    int table[LZ_HASH_SIZE];
+    for (int i = 0; i < LZ_HASH_SIZE; i++) {
+        table[i] = -1;
+    }
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        uint32_t seq = lz_read32(in + ip);
+        int h = lz_hash(seq);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < src_len && in[ref + len] == in[ip + len]) {
+            len++;
+        }
+
+        op = lz_emit(out, op, dst_cap, in + anchor, ip - anchor, ip - ref, len);
+        if (op < 0) {
+            return LZ_ERROR;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    // L'ultima sequenza contiene solo letterali: e' cosi' che il decompressore riconosce la fine.
+    return lz_emit(out, op, dst_cap, in + anchor, src_len - anchor, 0, 0);
+}
+
+static int lz_read_length(const unsigned char* in, int* ip, int src_len, int len) {
+    int b;
+    do {
+        if (*ip >= src_len) {
+            return LZ_ERROR;
+        }
+        b = in[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz_decompress(const char* src, int src_len, char* dst, int dst_cap) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    int ip = 0;
+    int op = 0;
+
+    while (ip < src_len) {
+        int token = in[ip++];
+
+        int literal_len = token >> 4;
+        if (literal_len == 15) {
+            literal_len = lz_read_length(in, &ip, src_len, literal_len);
+            if (literal_len < 0) {
+                return LZ_ERROR;
+            }
+        }
+        if (ip + literal_len > src_len || op + literal_len > dst_cap) {
+            return LZ_ERROR;
+        }
+        memcpy(out + op, in + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == src_len) {
+            break;
+        }
+
+        if (ip + 2 > src_len) {
+            return LZ_ERROR;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int match_len = token & 0x0F;
+        if (match_len == 15) {
+            match_len = lz_read_length(in, &ip, src_len, match_len);
+            if (match_len < 0) {
+                return LZ_ERROR;
+            }
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + match_len > dst_cap) {
+            return LZ_ERROR;
+        }
+        // Copia byte per byte: la sorgente puo' sovrapporsi alla destinazione.
+        for (int i = 0; i < match_len; i++) {
+            out[op + i] = out[op - offset + i];
+        }
+        op += match_len;
+    }
+    return op;
+}
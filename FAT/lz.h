@@ -0,0 +1,15 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Compressore LZ77 minimale, formato a sequenze in stile LZ4:
+// token (4 bit letterali | 4 bit match), letterali, offset a 16 bit.
+
+#define LZ_ERROR -1
+
+// Restituisce la lunghezza compressa, oppure LZ_ERROR se non entra in dst_cap.
+int lz_compress(const char* src, int src_len, char* dst, int dst_cap);
+
+// Restituisce la lunghezza decompressa, oppure LZ_ERROR se l'input e' corrotto.
+int lz_decompress(const char* src, int src_len, char* dst, int dst_cap);
+
+#endif
@@ -1,7 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include "file_system.h"
+#include "perf.h"
+#include "server.h"
+#include "storage.h"
+#include "dirscan.h"
 
 #define MAX_INPUT_SIZE 256000
 #define MAX_ARGS 10
@@ -11,22 +18,43 @@
 
 void print_help() {
     printf("Commands:\n");
-    printf("  mkfs                                     Initialize file system\n");
+    printf("  mkfs [blocks]                            Initialize file system\n");
     printf("  loadfs                                   Load file system\n");
     printf("  savefs                                   Save file system\n");
+    printf("  txn <begin|commit|abort>                 Group changes into one atomic, durable commit\n");
     printf("  mkdir <name>                             Create directory\n");
     printf("  rmdir <name>                             Remove directory\n");
-    printf("  mkfile <name>.<ext>                      Create file\n");
+    printf("  mkfile <name>.<ext> [size_hint]          Create file\n");
     printf("  rmfile <name>.<ext>                      Remove file\n");
+    printf("  mv <src> <dst>                           Move or rename a file or directory (paths with '/')\n");
     printf("  cd <name>                                Change directory\n");
     printf("  ls                                       List directory contents\n");
     printf("  write <name>.<ext> <offset> <data>       Write to file\n");
     printf("  read <name>.<ext>                        Read from file\n");
-    printf("  seek <name>.<ext> <offset>               Seek within file\n");
+    printf("  seek <name>.<ext> <offset> [data|hole]   Seek within file\n");
+    printf("  fallocate <name>.<ext> <length>          Reserve blocks for a file without writing\n");
+    printf("  truncate <name>.<ext> <size>             Shrink or extend a file to size bytes\n");
     printf("  copy2fs <host> <fs>                      Copia un file dal sistema host al file system FAT.");
     printf("  copy2host  <fs> host>                    Copia un file dal file system FAT al sistema host.");
+    printf("  compress <name>.<ext>                    Store an existing file compressed\n");
+    printf("  compression <on|off>                     Compress files imported with copy2fs\n");
+    printf("  discard <on|off>                         Punch holes in the image for freed blocks\n");
+    printf("  iouring <on|off>                         Use io_uring for host files in copy2fs/copy2host\n");
+    printf("  checksum <on|off>                        Keep and verify per-cluster CRC32C checksums\n");
+    printf("  dedup <on|off>                           Deduplicate blocks imported with copy2fs\n");
+    printf("  tailpack <on|off>                        Share clusters between the last partial blocks of files\n");
+    printf("  storage [mmap|cache [MiB]]               Choose how the next mkfs/loadfs keeps the image in memory\n");
+    printf("  mountopts <populate|hugepage|lockfat>    Mapping options for the next mkfs/loadfs, comma separated\n");
+    printf("  stats [reset]                            Show call counts, FAT hops and latency histograms\n");
+    printf("  df                                       Show free space and the largest free run\n");
+    printf("  stat <name>[.<ext>]                      Show size, blocks and extents of a file or directory\n");
+    printf("  defrag [start|stop] [dirs]               Make file chains contiguous, optionally compacting directories\n");
+    printf("  scrub [start [KiB/s]|stop|status]        Verify checksums and links of every allocated block\n");
+    printf("  fsck [repair]                            Check the image for leaks, cycles and cross-links\n");
     printf("  exit                                     Exit the shell\n");
     printf("  help                                     Display this help message\n");
+    printf("Run './myfs -b <script|->' to execute commands from a script without progress messages.\n");
+    printf("Run './myfs -s <socket>' to serve the image to local clients over a Unix socket.\n");
 }
 
 void parse_command(char* input, char** args) {
@@ -43,32 +71,45 @@ void parse_command(char* input, char** args) {
     args[i] = NULL;
 }
 
-void execute_command(char** args) {
-    if (strcmp(args[0], "mkfs") == 0) {
-        printf("Initializing file system...\n");
-        fs_initialize(DATATICUS_FILE);
-        printf("File system initialized.\n");
+// Restituisce 1 quando il comando chiede di chiudere la shell.
+int execute_command(char** args) {
+    if (args[0] == NULL) {
+        return 0;
+    } else if (strcmp(args[0], "mkfs") == 0) {
+        fs_log("Initializing file system...\n");
+        fs_initialize_size(DATATICUS_FILE, args[1] ? atoi(args[1]) : TOTAL_BLOCKS);
+        fs_log("File system initialized.\n");
     } else if (strcmp(args[0], "loadfs") == 0) {
-        printf("Loading file system...\n");
+        fs_log("Loading file system...\n");
         fs_load(DATATICUS_FILE);
-        printf("File system loaded.\n");
+        fs_log("File system loaded.\n");
     } else if (strcmp(args[0], "savefs") == 0) {
-        printf("Saving file system...\n");
-        fs_save();
-        printf("File system saved.\n");
+        fs_log("Saving file system...\n");
+        fs_sync();
+        fs_log("File system saved.\n");
+    } else if (strcmp(args[0], "txn") == 0) {
+        if (args[1] && strcmp(args[1], "begin") == 0) {
+            fs_txn_begin();
+        } else if (args[1] && strcmp(args[1], "commit") == 0) {
+            fs_txn_commit();
+        } else if (args[1] && strcmp(args[1], "abort") == 0) {
+            fs_txn_abort();
+        } else {
+            printf("Usage: txn <begin|commit|abort>\n");
+        }
     } else if (strcmp(args[0], "mkdir") == 0) {
         if (args[1]) {
-            printf("Creating directory: %s\n", args[1]);
+            fs_log("Creating directory: %s\n", args[1]);
             create_dir(args[1]);
-            printf("Directory created.\n");
+            fs_log("Directory created.\n");
         } else {
             printf("Usage: mkdir <name>\n");
         }
     } else if (strcmp(args[0], "rmdir") == 0) {
         if (args[1]) {
-            printf("Removing directory: %s\n", args[1]);
+            fs_log("Removing directory: %s\n", args[1]);
             remove_dir(args[1], 1);
-            printf("Directory removed.\n");
+            fs_log("Directory removed.\n");
         } else {
             printf("Usage: rmdir <name>\n");
         }
@@ -77,39 +118,49 @@ void execute_command(char** args) {
             char* name = strsep(&args[1], ".");
             char* ext = args[1];
             if (ext) {
-                printf("Creating file: %s.%s\n", name, ext);
-                create_file(name, ext, 0, "");
-                printf("File created.\n");
+                int size_hint = args[2] ? atoi(args[2]) : 0;
+                fs_log("Creating file: %s.%s\n", name, ext);
+                create_file_with_hint(name, ext, 0, "", size_hint);
+                fs_log("File created.\n");
             } else {
-                printf("Usage: mkfile <name>.<ext>\n");
+                printf("Usage: mkfile <name>.<ext> [size_hint]\n");
             }
         } else {
-            printf("Usage: mkfile <name>.<ext>\n");
+            printf("Usage: mkfile <name>.<ext> [size_hint]\n");
         }
     } else if (strcmp(args[0], "rmfile") == 0) {
         if (args[1]) {
             char* name = strsep(&args[1], ".");
             char* ext = args[1];
             if (ext) {
-                printf("Removing file: %s.%s\n", name, ext);
+                fs_log("Removing file: %s.%s\n", name, ext);
                 remove_file(name, ext);
-                printf("File removed.\n");
+                fs_log("File removed.\n");
             } else {
                 printf("Usage: rmfile <name>.<ext>\n");
             }
         } else {
             printf("Usage: rmfile <name>.<ext>\n");
         }
+    } else if (strcmp(args[0], "mv") == 0) {
+        if (args[1] && args[2]) {
+            fs_log("Moving %s to %s\n", args[1], args[2]);
+            if (fs_rename(args[1], args[2]) == 0) {
+                fs_log("Moved.\n");
+            }
+        } else {
+            printf("Usage: mv <src> <dst>\n");
+        }
     } else if (strcmp(args[0], "cd") == 0) {
         if (args[1]) {
-            printf("Changing directory to: %s\n", args[1]);
+            fs_log("Changing directory to: %s\n", args[1]);
             int res = cd(args[1]);
             if (res == FILE_NOT_FOUND) {
                 printf("Error: Directory '%s' not found.\n", args[1]);
             } else if (res == INVALID_DIRECTORY) {
                 printf("Error: Invalid directory '%s'.\n", args[1]);
             } else {
-                printf("Changed directory to: %s\n", args[1]);
+                fs_log("Changed directory to: %s\n", args[1]);
             }
         } else {
             printf("Usage: cd <name>\n");
@@ -123,7 +174,7 @@ void execute_command(char** args) {
             int offset = atoi(args[2]);
             char* data = args[3];
             int data_length = strlen(data);
-            printf("execute_command: Writing %d bytes to file '%s.%s'\n", data_length, name, ext);
+            fs_log("execute_command: Writing %d bytes to file '%s.%s'\n", data_length, name, ext);
             if (ext) {
                 write_file_content(name, ext, data, offset, strlen(data));
             } else {
@@ -141,8 +192,8 @@ void execute_command(char** args) {
                 FileHandle handle;
                 handle.file_entry = locate_file(name, ext, 0);
                 handle.position = 0;
-                int bytes_read = read_file_content(&handle, buffer, sizeof(buffer));
-                buffer[bytes_read] = '\0';
+                int bytes_read = read_file_content(&handle, buffer, sizeof(buffer) - 1);
+                buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
             } else {
                 printf("Usage: read <name>.<ext>\n");
             }
@@ -159,11 +210,20 @@ void execute_command(char** args) {
                 handle.file_entry = locate_file(name, ext, 0);
                 if (handle.file_entry) {
                     handle.position = 0;
-                    int result = seek_file(&handle, offset, SEEK_SET);
+                    int origin = SEEK_SET;
+                    if (args[3] && strcmp(args[3], "data") == 0) {
+                        origin = FS_SEEK_DATA;
+                    } else if (args[3] && strcmp(args[3], "hole") == 0) {
+                        origin = FS_SEEK_HOLE;
+                    }
+                    int result = seek_file(&handle, offset, origin);
+                    if (result == 0 && origin != SEEK_SET) {
+                        printf("Position: %d\n", handle.position);
+                    }
                     if (result == 0) {
                         char buffer[1024];
-                        int bytes_read = read_file_content(&handle, buffer, sizeof(buffer));
-                        buffer[bytes_read] = '\0';
+                        int bytes_read = read_file_content(&handle, buffer, sizeof(buffer) - 1);
+                        buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
                         printf("Read from %s.%s: \"%s\"\n", name, ext, buffer);
                     } else {
                         printf("Seek failed in file: %s.%s\n", name, ext);
@@ -172,10 +232,48 @@ void execute_command(char** args) {
                     printf("File not found: %s.%s\n", name, ext);
                 }
             } else {
-                printf("Usage: seek <name>.<ext> <offset>\n");
+                printf("Usage: seek <name>.<ext> <offset> [data|hole]\n");
             }
         } else {
-            printf("Usage: seek <name>.<ext> <offset>\n");
+            printf("Usage: seek <name>.<ext> <offset> [data|hole]\n");
+        }
+    } else if (strcmp(args[0], "fallocate") == 0) {
+        if (args[1] && args[2]) {
+            char* name = strsep(&args[1], ".");
+            char* ext = args[1];
+            if (ext) {
+                FileHandle handle;
+                handle.file_entry = locate_file(name, ext, 0);
+                handle.position = 0;
+                if (handle.file_entry == NULL) {
+                    printf("File not found: %s.%s\n", name, ext);
+                } else if (fs_fallocate(&handle, atoi(args[2])) != 0) {
+                    printf("Failed to reserve space for %s.%s\n", name, ext);
+                }
+            } else {
+                printf("Usage: fallocate <name>.<ext> <length>\n");
+            }
+        } else {
+            printf("Usage: fallocate <name>.<ext> <length>\n");
+        }
+    } else if (strcmp(args[0], "truncate") == 0) {
+        if (args[1] && args[2]) {
+            char* name = strsep(&args[1], ".");
+            char* ext = args[1];
+            if (ext) {
+                FileHandle handle;
+                handle.file_entry = locate_file(name, ext, 0);
+                handle.position = 0;
+                if (handle.file_entry == NULL) {
+                    printf("File not found: %s.%s\n", name, ext);
+                } else if (fs_truncate(&handle, atoi(args[2])) != 0) {
+                    printf("Failed to truncate %s.%s\n", name, ext);
+                }
+            } else {
+                printf("Usage: truncate <name>.<ext> <size>\n");
+            }
+        } else {
+            printf("Usage: truncate <name>.<ext> <size>\n");
         }
     } else if (strcmp(args[0], "copy2fs") == 0) {
         if (args[1] && args[2]) {
@@ -184,7 +282,7 @@ void execute_command(char** args) {
             char* name = strsep(&fs_path, ".");
             char* ext = fs_path;
             if (copy2fs(host_path, name, ext) == 0) {
-                printf("File copied to FAT file system.\n");
+                fs_log("File copied to FAT file system.\n");
             } else {
                 printf("Failed to copy file to FAT file system.\n");
             }
@@ -198,28 +296,282 @@ void execute_command(char** args) {
             char* name = strsep(&fs_path, ".");
             char* ext = fs_path;
             if (copy2host(name, ext, host_path) == 0) {
-                printf("File copied to host file system.\n");
+                fs_log("File copied to host file system.\n");
             } else {
                 printf("Failed to copy file to host file system.\n");
             }
         } else {
             printf("Usage: copy2host <fs> <host>\n");
         }
+    } else if (strcmp(args[0], "compress") == 0) {
+        if (args[1]) {
+            char* name = strsep(&args[1], ".");
+            char* ext = args[1];
+            if (ext && fs_compress_file(name, ext) == 0) {
+                fs_log("File compressed.\n");
+            } else {
+                printf("Usage: compress <name>.<ext>\n");
+            }
+        } else {
+            printf("Usage: compress <name>.<ext>\n");
+        }
+    } else if (strcmp(args[0], "compression") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_compression(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_compression(0);
+        } else {
+            printf("Usage: compression <on|off>\n");
+        }
+    } else if (strcmp(args[0], "discard") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_discard(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_discard(0);
+        } else {
+            printf("Usage: discard <on|off>\n");
+        }
+    } else if (strcmp(args[0], "iouring") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_io_uring(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_io_uring(0);
+        } else {
+            printf("Usage: iouring <on|off>\n");
+        }
+    } else if (strcmp(args[0], "checksum") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_checksums(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_checksums(0);
+        } else {
+            printf("Usage: checksum <on|off>\n");
+        }
+    } else if (strcmp(args[0], "dedup") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_dedup(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_dedup(0);
+        } else {
+            printf("Usage: dedup <on|off>\n");
+        }
+    } else if (strcmp(args[0], "tailpack") == 0) {
+        if (args[1] && strcmp(args[1], "on") == 0) {
+            fs_set_tail_packing(1);
+        } else if (args[1] && strcmp(args[1], "off") == 0) {
+            fs_set_tail_packing(0);
+        } else {
+            printf("Usage: tailpack <on|off>\n");
+        }
+    } else if (strcmp(args[0], "fsck") == 0) {
+        FsckReport report;
+        if (args[1] && strcmp(args[1], "repair") != 0) {
+            printf("Usage: fsck [repair]\n");
+        } else {
+            fs_fsck(args[1] != NULL, &report);
+        }
+    } else if (strcmp(args[0], "stats") == 0) {
+        if (args[1] && strcmp(args[1], "reset") == 0) {
+            perf_reset();
+            fs_log("Statistics reset.\n");
+        } else {
+            perf_print();
+            printf("Directory scan: %s\n", dir_scan_isa());
+        }
+    } else if (strcmp(args[0], "storage") == 0) {
+        if (args[1] && strcmp(args[1], "mmap") == 0) {
+            storage_set_backend(STORAGE_MMAP, 0);
+        } else if (args[1] && strcmp(args[1], "cache") == 0) {
+            storage_set_backend(STORAGE_CACHE, args[2] ? (size_t)atoi(args[2]) << 20 : 0);
+        } else if (args[1]) {
+            printf("Usage: storage [mmap|cache [MiB]]\n");
+        } else {
+            StorageStat st;
+            char options[64];
+            storage_stat(&st);
+            storage_format_options(st.options, options, sizeof(options));
+            printf("Mount options: %s\n", options);
+            if (st.backend == STORAGE_CACHE) {
+                printf("Storage: cache, %zu of %zu KiB resident\n", st.resident_bytes >> 10, st.cache_bytes >> 10);
+                printf("Loads: %llu, evictions: %llu, writebacks: %llu\n", (unsigned long long)st.loads,
+                       (unsigned long long)st.evictions, (unsigned long long)st.writebacks);
+            } else {
+                printf("Storage: mmap\n");
+            }
+        }
+    } else if (strcmp(args[0], "mountopts") == 0) {
+        int options = args[1] ? storage_parse_options(args[1]) : -1;
+        if (options >= 0) {
+            storage_set_options(options);
+        } else {
+            printf("Usage: mountopts <populate|hugepage|lockfat|defaults>[,...]\n");
+        }
+    } else if (strcmp(args[0], "df") == 0) {
+        FsStat st;
+        if (fs_statfs(&st) == 0) {
+            int used = st.total_blocks - st.free_blocks;
+            printf("Blocks: %d total, %d used, %d free (%d bytes each)\n", st.total_blocks, used, st.free_blocks, st.block_size);
+            printf("Free space: %lld bytes, largest free run: %d blocks\n", (long long)st.free_blocks * st.block_size, st.largest_free_run);
+            printf("Free space fragmentation: %d%%\n", st.free_blocks ? 100 - (int)(100LL * st.largest_free_run / st.free_blocks) : 0);
+        } else {
+            printf("No file system loaded\n");
+        }
+    } else if (strcmp(args[0], "stat") == 0) {
+        if (args[1]) {
+            char* name = strsep(&args[1], ".");
+            char* ext = args[1];
+            DirectoryEntry* entry = ext ? locate_file(name, ext, 0) : locate_file(name, "", 1);
+            FileStat st;
+            if (fs_stat_file(entry, &st) == 0) {
+                printf("Size: %d bytes, blocks: %d, extents: %d%s%s%s%s%s\n", st.size, st.blocks, st.extents,
+                       entry->is_dir ? ", directory" : "",
+                       st.flags & FILE_INLINE ? ", inline" : "",
+                       st.flags & FILE_COMPRESSED ? ", compressed" : "",
+                       st.flags & FILE_TAIL_PACKED ? ", tail packed" : "",
+                       st.flags & FILE_SPARSE ? ", sparse" : "");
+            } else {
+                printf("Not found: %s\n", name);
+            }
+        } else {
+            printf("Usage: stat <name>[.<ext>]\n");
+        }
+    } else if (strcmp(args[0], "defrag") == 0) {
+        int compact = (args[1] && strcmp(args[1], "dirs") == 0) || (args[1] && args[2] && strcmp(args[2], "dirs") == 0);
+        if (args[1] && strcmp(args[1], "start") == 0) {
+            fs_defrag_start(compact);
+        } else if (args[1] && strcmp(args[1], "stop") == 0) {
+            fs_defrag_stop();
+            fs_log("defrag: Stopped\n");
+        } else if (!args[1] || compact) {
+            fs_defrag(compact);
+        } else {
+            printf("Usage: defrag [start|stop] [dirs]\n");
+        }
+    } else if (strcmp(args[0], "scrub") == 0) {
+        if (args[1] && strcmp(args[1], "start") == 0) {
+            fs_scrub_start(args[2] ? atoi(args[2]) : 0);
+        } else if (args[1] && strcmp(args[1], "stop") == 0) {
+            fs_scrub_stop();
+            fs_log("scrub: Stopped\n");
+        } else if (args[1] && strcmp(args[1], "status") == 0) {
+            fs_scrub_status();
+        } else if (!args[1]) {
+            fs_scrub();
+        } else {
+            printf("Usage: scrub [start [KiB/s]|stop|status]\n");
+        }
     } else if (strcmp(args[0], "help") == 0) {
         print_help();
     } else if (strcmp(args[0], "exit") == 0) {
-        printf("Exiting shell...\n");
-        exit(0);
+        fs_log("Exiting shell...\n");
+        return 1;
     } else {
         printf("Unknown command: %s\n", args[0]);
         print_help();
     }
+    return 0;
 }
 
 
-int main() {
+// Esegue i comandi di uno script, uno per riga, senza i messaggi di
+// avanzamento. I salvataggi richiesti dai comandi vengono raggruppati e
+// l'immagine e' sincronizzata ogni commit_every comandi (0 = solo alla fine).
+int run_batch(const char* script_path, int commit_every) {
+    FILE* script = strcmp(script_path, "-") == 0 ? stdin : fopen(script_path, "r");
+    if (!script) {
+        fprintf(stderr, "Failed to open script: %s\n", script_path);
+        return 1;
+    }
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    char* args[MAX_ARGS];
+    long commands = 0;
+    int lineno = 0;
+
+    fs_set_verbose(0);
+    fs_set_deferred_save(1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((length = getline(&line, &capacity, script)) != -1) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* command = line + strspn(line, " \t");
+        if (command[0] == '\0' || command[0] == '#') {
+            continue;
+        }
+        parse_command(command, args);
+        fs_lock();
+        int done = execute_command(args);
+        commands++;
+        if (commit_every > 0 && commands % commit_every == 0) {
+            fs_set_deferred_save(0);
+            fs_set_deferred_save(1);
+        }
+        fs_unlock();
+        if (done) {
+            break;
+        }
+    }
+
+    fs_lock();
+    fs_set_deferred_save(0);
+    fs_unlock();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fs_set_verbose(1);
+
+    fprintf(stderr, "%ld commands (%d lines) in %.3f s, %.0f commands/s\n",
+            commands, lineno, elapsed, elapsed > 0 ? commands / elapsed : 0.0);
+
+    free(line);
+    if (script != stdin) {
+        fclose(script);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
     char input[MAX_INPUT_SIZE];
     char* args[MAX_ARGS];
+    const char* script_path = NULL;
+    const char* socket_path = NULL;
+    int commit_every = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            commit_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && storage_parse_options(argv[i + 1]) >= 0) {
+            storage_set_options(storage_parse_options(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [-b <script|->] [-c <commands per commit>] [-s <socket>] [-o <mount options>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (script_path) {
+        return run_batch(script_path, commit_every);
+    }
+
+    if (socket_path) {
+        // Si crea un'immagine nuova solo se non ne esiste una: un'immagine che
+        // fs_load rifiuta va lasciata intatta, non riformattata.
+        if (access(DATATICUS_FILE, F_OK) == -1 && errno == ENOENT) {
+            if (fs_initialize(DATATICUS_FILE) != 0) {
+                return 1;
+            }
+        } else if (fs_load(DATATICUS_FILE) != 0) {
+            fprintf(stderr, "Error: Could not load %s, not serving it\n", DATATICUS_FILE);
+            return 1;
+        }
+        return fs_serve(socket_path) == 0 ? 0 : 1;
+    }
 
     printf("Welcome to the FAT File System Shell\n");
     print_help();
@@ -229,7 +581,12 @@ int main() {
         if (fgets(input, sizeof(input), stdin) != NULL) {
             input[strcspn(input, "\n")] = '\0';
             parse_command(input, args);
-            execute_command(args);
+            fs_lock();
+            int done = execute_command(args);
+            fs_unlock();
+            if (done) {
+                break;
+            }
         }
     }
 
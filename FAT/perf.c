@@ -0,0 +1,133 @@
+#include "perf.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PERF_CACHE_LINE 64
+
+typedef struct PerfThread {
+    PerfCounters ops[PERF_OP_COUNT];
+    struct PerfThread* next;
+} __attribute__((aligned(PERF_CACHE_LINE))) PerfThread;
+
+static const char* perf_op_names[PERF_OP_COUNT] = {
+    "get_free_block", "locate_file", "read_file_content", "write_file_content", "fs_save", "copy2fs"
+};
+
+__thread uint64_t perf_hops;
+static __thread PerfThread* perf_local;
+
+// I blocchi dei thread restano registrati anche dopo la loro fine, cosi' le
+// somme non perdono il lavoro dei thread di sottofondo gia' terminati.
+static PerfThread* perf_threads;
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PerfThread* perf_thread() {
+    if (perf_local) {
+        return perf_local;
+    }
+    PerfThread* t = (PerfThread*)aligned_alloc(PERF_CACHE_LINE, sizeof(PerfThread));
+    if (!t) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(PerfThread));
+    pthread_mutex_lock(&perf_lock);
+    t->next = perf_threads;
+    perf_threads = t;
+    pthread_mutex_unlock(&perf_lock);
+    perf_local = t;
+    return t;
+}
+
+static uint64_t perf_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t perf_begin() {
+    return perf_now();
+}
+
+void perf_end(PerfOp op, uint64_t start, uint64_t start_hops, uint64_t bytes) {
+    uint64_t elapsed = perf_now() - start;
+    PerfThread* t = perf_thread();
+    if (!t) {
+        return;
+    }
+    PerfCounters* c = &t->ops[op];
+    c->calls++;
+    c->bytes += bytes;
+    c->fat_hops += perf_hops - start_hops;
+    c->total_ns += elapsed;
+    int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+    c->latency[bucket < PERF_BUCKETS ? bucket : PERF_BUCKETS - 1]++;
+}
+
+// Somma i contatori di tutti i thread. Le letture non sono sincronizzate con chi
+// scrive: il risultato e' una fotografia approssimata, sufficiente per le statistiche.
+void perf_collect(PerfOp op, PerfCounters* out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&perf_lock);
+    for (PerfThread* t = perf_threads; t; t = t->next) {
+        PerfCounters* c = &t->ops[op];
+        out->calls += c->calls;
+        out->bytes += c->bytes;
+        out->fat_hops += c->fat_hops;
+        out->total_ns += c->total_ns;
+        for (int i = 0; i < PERF_BUCKETS; i++) {
+            out->latency[i] += c->latency[i];
+        }
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+// Stima il percentile dall'istogramma: restituisce il limite superiore del bucket.
+static uint64_t perf_percentile(const PerfCounters* c, int percent) {
+    uint64_t target = (c->calls * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+        seen += c->latency[i];
+        if (seen >= target && seen > 0) {
+            return (2ULL << i) - 1;
+        }
+    }
+    return 0;
+}
+
+void perf_print() {
+    printf("%-20s %10s %12s %12s %10s %10s %10s\n", "operation", "calls", "bytes", "fat_hops", "avg_ns", "p50_ns", "p99_ns");
+    for (int op = 0; op < PERF_OP_COUNT; op++) {
+        PerfCounters c;
+        perf_collect((PerfOp)op, &c);
+        printf("%-20s %10llu %12llu %12llu %10llu %10llu %10llu\n", perf_op_names[op],
+               (unsigned long long)c.calls, (unsigned long long)c.bytes, (unsigned long long)c.fat_hops,
+               (unsigned long long)(c.calls ? c.total_ns / c.calls : 0),
+               (unsigned long long)perf_percentile(&c, 50), (unsigned long long)perf_percentile(&c, 99));
+    }
+
+    for (int op = 0; op < PERF_OP_COUNT; op++) {
+        PerfCounters c;
+        perf_collect((PerfOp)op, &c);
+        if (c.calls == 0) {
+            continue;
+        }
+        printf("%s latency:\n", perf_op_names[op]);
+        for (int i = 0; i < PERF_BUCKETS; i++) {
+            if (c.latency[i]) {
+                printf("  %12llu - %-12llu ns %10llu\n", (unsigned long long)(i ? 1ULL << i : 0),
+                       (unsigned long long)((2ULL << i) - 1), (unsigned long long)c.latency[i]);
+            }
+        }
+    }
+}
+
+void perf_reset() {
+    pthread_mutex_lock(&perf_lock);
+    for (PerfThread* t = perf_threads; t; t = t->next) {
+        memset(t->ops, 0, sizeof(t->ops));
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
@@ -0,0 +1,41 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+// Contatori di prestazioni delle operazioni principali. Ogni thread scrive solo
+// nel proprio blocco di contatori, allineato alla linea di cache; stats li somma.
+
+typedef enum {
+    PERF_GET_FREE_BLOCK,
+    PERF_LOCATE_FILE,
+    PERF_READ,
+    PERF_WRITE,
+    PERF_SAVE,
+    PERF_COPY2FS,
+    PERF_OP_COUNT
+} PerfOp;
+
+// Il bucket i dell'istogramma conta le chiamate durate fra 2^i e 2^(i+1) - 1 ns.
+#define PERF_BUCKETS 40
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t fat_hops;
+    uint64_t total_ns;
+    uint64_t latency[PERF_BUCKETS];
+} PerfCounters;
+
+// Passi lungo la FAT del thread corrente, attribuiti all'operazione in corso da perf_end.
+extern __thread uint64_t perf_hops;
+
+#define PERF_HOP() (perf_hops++)
+
+uint64_t perf_begin();
+void perf_end(PerfOp op, uint64_t start, uint64_t start_hops, uint64_t bytes);
+void perf_collect(PerfOp op, PerfCounters* out);
+void perf_print();
+void perf_reset();
+
+#endif
@@ -0,0 +1,171 @@
+#include "fs_internal.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Verifica dell'immagine a blocchi. Un passaggio scorre la FAT dal primo
+// all'ultimo blocco di dati: per ogni blocco occupato controlla che il
+// successore sia un blocco occupato o una fine catena e, se i checksum sono
+// attivi e il blocco e' coperto, che il contenuto corrisponda al suo CRC32C.
+// I controlli sono locali al blocco: cicli e catene incrociate restano a fsck.
+// In sottofondo il passaggio avanza a piccoli passi, distanziati in modo da non
+// leggere piu' di scrub_rate KiB al secondo.
+
+#define SCRUB_STEP_BLOCKS 128
+#define SCRUB_DEFAULT_RATE (8 * 1024)
+#define SCRUB_PAUSE_US 10000
+#define SCRUB_MAX_SLEEP_US 100000
+#define SCRUB_MAX_PRINTED 20
+
+static FileSystem* scrub_image;
+static int scrub_cursor;
+static int scrub_running;
+
+static int scrub_checked;
+static int scrub_bad_checksums;
+static int scrub_bad_links;
+
+static pthread_t scrub_thread;
+static int scrub_thread_started;
+static volatile int scrub_stop_requested;
+static int scrub_rate = SCRUB_DEFAULT_RATE;
+
+static void scrub_begin() {
+    scrub_image = fs;
+    scrub_cursor = 0;
+    scrub_checked = 0;
+    scrub_bad_checksums = 0;
+    scrub_bad_links = 0;
+    scrub_running = 1;
+}
+
+static void report_bad(int block, const char* problem) {
+    if (scrub_bad_checksums + scrub_bad_links <= SCRUB_MAX_PRINTED) {
+        printf("scrub: block %d: %s\n", block, problem);
+    }
+}
+
+// Controlla fino a budget blocchi occupati. Restituisce 1 se resta del lavoro,
+// 0 quando il passaggio e' finito.
+int fs_scrub_step(int budget) {
+    if (!fs) {
+        return FILE_READ_ERROR;
+    }
+    if (!scrub_running || scrub_image != fs) {
+        scrub_begin();
+    }
+
+    int blocks = data_block_count();
+    while (budget > 0 && scrub_cursor < blocks) {
+        int block = scrub_cursor++;
+        int next = fat_table[block];
+        if (next == FAT_UNUSED) {
+            continue;
+        }
+        budget--;
+        scrub_checked++;
+        if (next != FAT_END && next != FAT_TAIL && (next <= 0 || next >= blocks || fat_table[next] == FAT_UNUSED)) {
+            scrub_bad_links++;
+            report_bad(block, "dangling link");
+        }
+        if (block_crc_verify(block) != 0) {
+            scrub_bad_checksums++;
+            report_bad(block, "checksum mismatch");
+        }
+    }
+    if (scrub_cursor < blocks) {
+        return 1;
+    }
+
+    scrub_running = 0;
+    printf("scrub: %d blocks checked, %d checksum mismatches, %d dangling links%s\n", scrub_checked,
+           scrub_bad_checksums, scrub_bad_links, (fs->features & FS_FEATURE_CHECKSUMS) ? "" : " (checksums off)");
+    return 0;
+}
+
+int fs_scrub() {
+    fs_scrub_stop();
+    if (!fs) {
+        printf("scrub: No file system loaded\n");
+        return FILE_READ_ERROR;
+    }
+    scrub_begin();
+    int res;
+    while ((res = fs_scrub_step(SCRUB_STEP_BLOCKS)) > 0) {
+    }
+    return res < 0 ? res : scrub_bad_checksums + scrub_bad_links;
+}
+
+static double elapsed_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Come il defrag in sottofondo lavora sotto il lock a piccoli passi e non si
+// blocca mai sul lock. Dopo ogni passo dorme quanto basta a riportare i byte
+// letti entro scrub_rate, a fette brevi per rispondere presto a fs_scrub_stop.
+static void* scrub_worker(void* arg) {
+    (void)arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double bytes = 0;
+    while (!scrub_stop_requested) {
+        if (!fs_trylock()) {
+            usleep(SCRUB_PAUSE_US);
+            continue;
+        }
+        int before = scrub_checked;
+        int res = fs_scrub_step(SCRUB_STEP_BLOCKS);
+        if (fs) {
+            bytes += (double)(scrub_checked - before) * fs->bytes_per_block;
+        }
+        fs_unlock();
+        if (res <= 0) {
+            break;
+        }
+        double ahead;
+        while (!scrub_stop_requested && (ahead = bytes / (scrub_rate * 1024.0) - elapsed_since(&start)) > 0) {
+            usleep(ahead * 1e6 < SCRUB_MAX_SLEEP_US ? (useconds_t)(ahead * 1e6) + 1 : SCRUB_MAX_SLEEP_US);
+        }
+    }
+    return NULL;
+}
+
+int fs_scrub_start(int kib_per_sec) {
+    if (!fs) {
+        printf("scrub: No file system loaded\n");
+        return FILE_READ_ERROR;
+    }
+    fs_scrub_stop();
+    scrub_rate = kib_per_sec > 0 ? kib_per_sec : SCRUB_DEFAULT_RATE;
+    scrub_begin();
+    scrub_stop_requested = 0;
+    if (pthread_create(&scrub_thread, NULL, scrub_worker, NULL) != 0) {
+        printf("scrub: Could not start background thread\n");
+        return FILE_READ_ERROR;
+    }
+    scrub_thread_started = 1;
+    printf("scrub: Running in background at %d KiB/s\n", scrub_rate);
+    return 0;
+}
+
+void fs_scrub_stop() {
+    if (!scrub_thread_started) {
+        return;
+    }
+    scrub_stop_requested = 1;
+    pthread_join(scrub_thread, NULL);
+    scrub_thread_started = 0;
+}
+
+void fs_scrub_status() {
+    if (!scrub_running) {
+        printf("scrub: Idle, last pass checked %d blocks, %d checksum mismatches, %d dangling links\n",
+               scrub_checked, scrub_bad_checksums, scrub_bad_links);
+        return;
+    }
+    printf("scrub: At block %d of %d, %d blocks checked, %d checksum mismatches, %d dangling links\n",
+           scrub_cursor, fs ? data_block_count() : 0, scrub_checked, scrub_bad_checksums, scrub_bad_links);
+}
@@ -0,0 +1,485 @@
+#include "fs_internal.h"
+#include "perf.h"
+#include "server.h"
+#include "dirscan.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Server su socket Unix: un solo thread con poll serve tutti i client tenendo
+// l'immagine mappata. Le richieste arrivate insieme da un client vengono
+// eseguite in blocco sotto fs_lock e le loro risposte partono con una sola
+// send; le modifiche del blocco vengono rese durevoli con un unico fs_sync
+// prima di rispondere.
+
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_RECV_SIZE 65536
+// Oltre questa quantita' di risposte non ancora inviate il client non viene
+// piu' letto finche' non le ha consumate.
+#define SERVER_MAX_PENDING (4 * SERVER_MAX_IO)
+
+typedef struct {
+    int fd;
+    char* in;
+    size_t in_len;
+    size_t in_capacity;
+    char* out;
+    size_t out_len;
+    size_t out_capacity;
+    size_t out_sent;
+} Client;
+
+static Client clients[SERVER_MAX_CLIENTS];
+static int client_count;
+static volatile sig_atomic_t server_stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+static int reserve(char** buf, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t grown = *capacity ? *capacity : SERVER_RECV_SIZE;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    char* p = (char*)realloc(*buf, grown);
+    if (!p) {
+        return -1;
+    }
+    *buf = p;
+    *capacity = grown;
+    return 0;
+}
+
+// Accoda l'intestazione di una risposta e restituisce dove scriverne i dati.
+static char* begin_response(Client* c, uint32_t id, size_t max_payload) {
+    if (reserve(&c->out, &c->out_capacity, c->out_len + sizeof(ServerResponse) + max_payload) != 0) {
+        return NULL;
+    }
+    ServerResponse* res = (ServerResponse*)&c->out[c->out_len];
+    res->id = id;
+    res->length = 0;
+    res->status = 0;
+    return (char*)(res + 1);
+}
+
+static void end_response(Client* c, int status, size_t payload) {
+    ServerResponse* res = (ServerResponse*)&c->out[c->out_len];
+    res->status = status;
+    res->length = (uint32_t)payload;
+    c->out_len += sizeof(ServerResponse) + payload;
+}
+
+// Le operazioni del file system lavorano sulla directory corrente: il server la
+// sposta sul percorso richiesto e la ripristina dopo ogni richiesta.
+static DirectoryEntry* saved_dir;
+static char saved_dir_name[sizeof(fs->current_directory)];
+
+static void save_cwd() {
+    saved_dir = current_dir;
+    memcpy(saved_dir_name, fs->current_directory, sizeof(saved_dir_name));
+}
+
+static void restore_cwd() {
+    current_dir = saved_dir;
+    memcpy(fs->current_directory, saved_dir_name, sizeof(saved_dir_name));
+}
+
+// Entra nella directory che contiene l'ultimo componente del percorso, che
+// viene restituito in leaf (vuoto per la radice).
+static int enter_parent(char* path, char** leaf) {
+    current_dir = (DirectoryEntry*)data_blocks;
+    strcpy(fs->current_directory, current_dir->name);
+
+    char* component = path;
+    *leaf = path + strlen(path);
+    while (*component == '/') {
+        component++;
+    }
+    while (*component) {
+        char* slash = strchr(component, '/');
+        if (!slash) {
+            *leaf = component;
+            return 0;
+        }
+        *slash = '\0';
+        if (cd(component) != 0) {
+            return FILE_NOT_FOUND;
+        }
+        component = slash + 1;
+        while (*component == '/') {
+            component++;
+        }
+    }
+    return 0;
+}
+
+static void split_name(char* leaf, char** name, char** ext) {
+    char* dot = strrchr(leaf, '.');
+    *name = leaf;
+    if (dot && dot != leaf) {
+        *dot = '\0';
+        *ext = dot + 1;
+    } else {
+        *ext = "";
+    }
+}
+
+// Cerca prima un file con l'estensione indicata, poi una directory con il nome intero.
+static DirectoryEntry* locate_any(const char* leaf) {
+    if (*leaf == '\0') {
+        return current_dir;
+    }
+    char buf[SERVER_MAX_PATH];
+    char* name;
+    char* ext;
+    strcpy(buf, leaf);
+    split_name(buf, &name, &ext);
+    DirectoryEntry* entry = locate_file(name, ext, 0);
+    return entry ? entry : locate_file(leaf, "", 1);
+}
+
+static void fill_stat(DirectoryEntry* entry, ServerStat* out) {
+    FileStat st;
+    fs_stat_file(entry, &st);
+    out->size = st.size;
+    out->blocks = st.blocks;
+    out->extents = st.extents;
+    out->flags = st.flags;
+    out->is_dir = entry->is_dir;
+}
+
+static int list_dir(Client* c, uint32_t id) {
+    int per_block = slots_per_block();
+    int count = 0;
+    size_t payload = 0;
+    for (int block = current_dir->first_block; block >= 0 && block < fs->fat_entries; block = fat_table[block]) {
+        DirectoryEntry* dir = (DirectoryEntry*)&data_blocks[(size_t)block * fs->bytes_per_block];
+        SlotMasks masks;
+        dir_scan_block(dir, per_block, &masks);
+        for (unsigned live = slot_live_mask(&masks, per_block); live; live &= live - 1) {
+            DirectoryEntry* entry = &dir[__builtin_ctz(live)];
+            if (entry->name[0] == '.' || entry == current_dir) {
+                continue;
+            }
+            // Nome (24) + '.' + estensione (3) + '\n' al massimo.
+            char* p = begin_response(c, id, payload + 32);
+            if (!p) {
+                return -1;
+            }
+            if (entry->is_dir) {
+                payload += sprintf(p + payload, "%.24s/\n", entry->name);
+            } else if (entry->extension[0] && entry->extension[0] != ' ') {
+                payload += sprintf(p + payload, "%.24s.%.3s\n", entry->name, entry->extension);
+            } else {
+                payload += sprintf(p + payload, "%.24s\n", entry->name);
+            }
+            count++;
+        }
+        PERF_HOP();
+    }
+    if (!begin_response(c, id, payload)) {
+        return -1;
+    }
+    end_response(c, count, payload);
+    return 0;
+}
+
+// Esegue una richiesta e ne accoda la risposta. Restituisce 1 se ha modificato
+// l'immagine, -1 se il client va chiuso per mancanza di memoria.
+static int handle_request(Client* c, const ServerRequest* req, const char* body) {
+    char path[SERVER_MAX_PATH];
+    const char* data = body + req->path_len;
+    int data_len = req->length - req->path_len;
+    char* leaf;
+    char* name;
+    char* ext;
+    int status = SRV_BAD_REQUEST;
+    int modified = 0;
+
+    if (!begin_response(c, req->id, 0)) {
+        return -1;
+    }
+    if (req->path_len >= SERVER_MAX_PATH || req->path_len > req->length) {
+        end_response(c, SRV_BAD_REQUEST, 0);
+        return 0;
+    }
+    memcpy(path, body, req->path_len);
+    path[req->path_len] = '\0';
+
+    save_cwd();
+    if (enter_parent(path, &leaf) != 0) {
+        restore_cwd();
+        end_response(c, FILE_NOT_FOUND, 0);
+        return 0;
+    }
+
+    switch (req->op) {
+    case SRV_OPEN:
+    case SRV_STAT: {
+        DirectoryEntry* entry = locate_any(leaf);
+        if (!entry && req->op == SRV_OPEN && (req->flags & SRV_CREATE) && *leaf) {
+            split_name(leaf, &name, &ext);
+            if (create_file(name, ext, 0, "") == 0) {
+                entry = locate_file(name, ext, 0);
+                modified = 1;
+            }
+        }
+        if (!entry) {
+            status = FILE_NOT_FOUND;
+            break;
+        }
+        char* p = begin_response(c, req->id, sizeof(ServerStat));
+        if (!p) {
+            restore_cwd();
+            return -1;
+        }
+        fill_stat(entry, (ServerStat*)p);
+        end_response(c, 0, sizeof(ServerStat));
+        restore_cwd();
+        return modified;
+    }
+    case SRV_READ: {
+        split_name(leaf, &name, &ext);
+        FileHandle handle;
+        handle.file_entry = locate_file(name, ext, 0);
+        handle.position = req->offset;
+        if (!handle.file_entry) {
+            status = FILE_NOT_FOUND;
+            break;
+        }
+        int count = req->count < SERVER_MAX_IO ? req->count : SERVER_MAX_IO;
+        if (count <= 0 || req->offset < 0 || req->offset >= handle.file_entry->size) {
+            status = 0;
+            break;
+        }
+        char* p = begin_response(c, req->id, count);
+        if (!p) {
+            restore_cwd();
+            return -1;
+        }
+        int n = fs_read(&handle, p, count);
+        end_response(c, n, n > 0 ? n : 0);
+        restore_cwd();
+        return 0;
+    }
+    case SRV_WRITE:
+        split_name(leaf, &name, &ext);
+        status = write_file_content(name, ext, data, req->offset, data_len);
+        modified = 1;
+        break;
+    case SRV_LIST:
+        if (*leaf && cd(leaf) != 0) {
+            status = FILE_NOT_FOUND;
+            break;
+        }
+        status = list_dir(c, req->id);
+        restore_cwd();
+        return status;
+    case SRV_MKDIR:
+        if (*leaf == '\0' || locate_file(leaf, "", 1)) {
+            status = DIR_CREATE_ERROR;
+            break;
+        }
+        status = create_dir(leaf);
+        modified = 1;
+        break;
+    case SRV_REMOVE: {
+        DirectoryEntry* entry = *leaf ? locate_any(leaf) : NULL;
+        if (!entry) {
+            status = FILE_NOT_FOUND;
+        } else if (entry->is_dir) {
+            status = remove_dir(leaf, (req->flags & SRV_RECURSIVE) != 0);
+            modified = 1;
+        } else {
+            split_name(leaf, &name, &ext);
+            status = remove_file(name, ext);
+            modified = 1;
+        }
+        break;
+    }
+    case SRV_SYNC:
+        status = fs_sync();
+        break;
+    }
+
+    restore_cwd();
+    end_response(c, status, 0);
+    return modified;
+}
+
+// Esegue tutte le richieste complete ricevute dal client.
+static int process_input(Client* c) {
+    size_t pos = 0;
+    int modified = 0;
+
+    fs_lock();
+    while (c->in_len - pos >= sizeof(ServerRequest)) {
+        ServerRequest req;
+        memcpy(&req, &c->in[pos], sizeof(req));
+        if (req.length > SERVER_MAX_IO + SERVER_MAX_PATH) {
+            modified = -1;
+            break;
+        }
+        if (c->in_len - pos < sizeof(req) + req.length) {
+            break;
+        }
+        int res = handle_request(c, &req, &c->in[pos + sizeof(req)]);
+        if (res < 0) {
+            modified = -1;
+            break;
+        }
+        modified |= res;
+        pos += sizeof(req) + req.length;
+    }
+    if (modified > 0) {
+        fs_sync();
+    }
+    fs_unlock();
+
+    memmove(c->in, &c->in[pos], c->in_len - pos);
+    c->in_len -= pos;
+    return modified < 0 ? -1 : 0;
+}
+
+static int flush_output(Client* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, &c->out[c->out_sent], c->out_len - c->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    return 0;
+}
+
+static int read_input(Client* c) {
+    while (1) {
+        if (reserve(&c->in, &c->in_capacity, c->in_len + SERVER_RECV_SIZE) != 0) {
+            return -1;
+        }
+        ssize_t n = recv(c->fd, &c->in[c->in_len], SERVER_RECV_SIZE, MSG_DONTWAIT);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->in_len += n;
+    }
+}
+
+static void close_client(int i) {
+    close(clients[i].fd);
+    free(clients[i].in);
+    free(clients[i].out);
+    clients[i] = clients[--client_count];
+}
+
+int fs_serve(const char* socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("fs_serve: Socket path too long: %s\n", socket_path);
+        return INIT_ERROR;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        printf("fs_serve: Failed to create socket\n");
+        return INIT_ERROR;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, SERVER_MAX_CLIENTS) == -1) {
+        printf("fs_serve: Failed to listen on %s\n", socket_path);
+        close(listen_fd);
+        return INIT_ERROR;
+    }
+
+    // Senza SA_RESTART il segnale interrompe poll e il ciclo termina.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fs_set_verbose(0);
+    fs_set_deferred_save(1);
+    printf("fs_serve: Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+    server_stop = 0;
+    while (!server_stop) {
+        fds[0].fd = listen_fd;
+        fds[0].events = client_count < SERVER_MAX_CLIENTS ? POLLIN : 0;
+        for (int i = 0; i < client_count; i++) {
+            Client* c = &clients[i];
+            fds[i + 1].fd = c->fd;
+            fds[i + 1].events = c->out_len - c->out_sent < SERVER_MAX_PENDING ? POLLIN : 0;
+            if (c->out_sent < c->out_len) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+
+        int nfds = client_count + 1;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("fs_serve: poll failed\n");
+            break;
+        }
+
+        // Dal fondo, cosi' close_client puo' spostare l'ultimo client al posto del chiuso.
+        for (int i = nfds - 2; i >= 0; i--) {
+            Client* c = &clients[i];
+            short revents = fds[i + 1].revents;
+            int failed = 0;
+            if (revents & POLLIN) {
+                failed = read_input(c) != 0;
+                if (process_input(c) != 0) {
+                    failed = 1;
+                }
+            } else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                failed = 1;
+            }
+            if (flush_output(c) != 0 || failed) {
+                close_client(i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                memset(&clients[client_count], 0, sizeof(Client));
+                clients[client_count++].fd = fd;
+            }
+        }
+    }
+
+    while (client_count > 0) {
+        close_client(client_count - 1);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    fs_set_deferred_save(0);
+    fs_set_verbose(1);
+    printf("fs_serve: Stopped\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// Protocollo binario del server su socket Unix (myfs -s <socket>).
+// Ogni richiesta e' un ServerRequest seguito da path_len byte di percorso e,
+// per SRV_WRITE, dai dati da scrivere: length conta entrambi. I percorsi sono
+// assoluti, con '/' come separatore ("dir/sub/nome.ext"), e l'ultimo '.'
+// separa l'estensione. Il client puo' inviare molte richieste senza attendere
+// le risposte: il server le esegue in ordine e risponde a ciascuna con un
+// ServerResponse con lo stesso id, seguito da length byte di dati.
+// I campi sono little-endian, come sulla macchina che esegue il server.
+
+#define SRV_OPEN 1      // flags SRV_CREATE crea il file se manca; risposta: ServerStat
+#define SRV_READ 2      // count byte da offset; risposta: i dati letti
+#define SRV_WRITE 3     // dati a offset (-1 accoda); status: byte scritti
+#define SRV_STAT 4      // file o directory; risposta: ServerStat
+#define SRV_LIST 5      // una voce per riga, le directory terminano con '/'
+#define SRV_MKDIR 6
+#define SRV_REMOVE 7    // flags SRV_RECURSIVE per le directory non vuote
+#define SRV_SYNC 8
+
+#define SRV_CREATE 0x01
+#define SRV_RECURSIVE 0x02
+
+// Esiti negativi oltre ai codici d'errore di file_system.h.
+#define SRV_BAD_REQUEST -20
+
+#define SERVER_MAX_PATH 256
+#define SERVER_MAX_IO (1 << 20)
+
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_len;
+    int32_t offset;
+    int32_t count;
+} __attribute__((packed)) ServerRequest;
+
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    int32_t status;
+} __attribute__((packed)) ServerResponse;
+
+typedef struct {
+    int32_t size;
+    int32_t blocks;
+    int32_t extents;
+    uint8_t flags;
+    uint8_t is_dir;
+} __attribute__((packed)) ServerStat;
+
+int fs_serve(const char* socket_path);
+
+#endif
@@ -0,0 +1,902 @@
+#define _GNU_SOURCE
+#include "file_system.h"
+#include "storage.h"
+#include "crc32c.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+// Cache dell'immagine in spazio utente. Il resto del file system usa puntatori
+// diretti nell'immagine, per cui la cache si presenta come una mappatura
+// anonima registrata con userfaultfd: il primo accesso a un gruppo non
+// residente lo fa leggere con pread da un thread dedicato, che lo installa con
+// UFFDIO_COPY protetto da scrittura. La prima scrittura segna il gruppo come
+// sporco; storage_sync e le espulsioni lo riscrivono con pwrite e lo
+// riproteggono. Le espulsioni seguono un orologio (CLOCK): il bit d'uso viene
+// messo dai fault, perche' le letture dei gruppi residenti non sono visibili.
+//
+// Le espulsioni avvengono mentre il thread che ha causato il fault e' fermo,
+// e le scritture sull'immagine avvengono sotto fs_lock da un thread alla
+// volta: un gruppo non puo' essere modificato fra la riscrittura e l'espulsione.
+
+// Transazioni: fra storage_txn_begin e storage_txn_commit il file immagine non
+// riceve alcuna scrittura. Con mmap l'immagine viene rimappata MAP_PRIVATE e le
+// pagine modificate si riconoscono da /proc/self/pagemap perche' diventano
+// anonime; con la cache i gruppi sporchi non vengono riscritti ne' espulsi,
+// e se non resta altro da espellere la transazione va chiusa o annullata
+// (txn_overflow).
+// Il commit copia gli intervalli modificati in un giornale protetto da CRC32C,
+// lo rende durevole, li scrive al loro posto e solo allora svuota il giornale:
+// dopo un crash storage_recover riapplica un giornale completo e ignora uno
+// troncato, quindi l'immagine contiene la transazione tutta o per niente.
+
+#define JOURNAL_MAGIC 0x4C4E524Au
+
+typedef struct {
+    uint32_t magic;
+    uint32_t records;
+    uint64_t data_bytes;
+    uint32_t crc;
+    uint32_t reserved;
+} JournalHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+} JournalRecord;
+
+#define GROUP_RESIDENT 0x01
+#define GROUP_DIRTY 0x02
+#define GROUP_REFERENCED 0x04
+#define GROUP_PINNED 0x08
+
+static int selected_backend = STORAGE_MMAP;
+static size_t selected_cache_bytes = STORAGE_DEFAULT_CACHE;
+static int active_backend = STORAGE_MMAP;
+static int selected_options = 0;
+static int active_options = 0;
+
+static int map_fd = -1;
+static size_t map_pinned;
+static int txn_active;
+static int txn_overflow;
+
+static char* cache_base;
+static size_t cache_size;
+static size_t cache_mapped;
+static int cache_fd = -1;
+static int uffd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t fault_thread;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char* group_state;
+static size_t group_count;
+static size_t resident_groups;
+static size_t max_groups;
+static size_t clock_hand;
+static char* bounce;
+
+static uint64_t cache_loads;
+static uint64_t cache_evictions;
+static uint64_t cache_writebacks;
+
+void storage_set_backend(int backend, size_t cache_bytes) {
+    selected_backend = backend;
+    if (cache_bytes > 0) {
+        selected_cache_bytes = cache_bytes;
+    }
+    if (backend == STORAGE_CACHE) {
+        fs_log("storage: pread/pwrite with a %zu MiB cache\n", selected_cache_bytes >> 20);
+    } else {
+        fs_log("storage: mmap\n");
+    }
+}
+
+static const struct {
+    const char* name;
+    int flag;
+} option_names[] = {
+    { "populate", STORAGE_POPULATE },
+    { "hugepage", STORAGE_HUGEPAGE },
+    { "lockfat", STORAGE_LOCK_FAT },
+};
+
+#define OPTION_COUNT ((int)(sizeof(option_names) / sizeof(option_names[0])))
+
+// Legge un elenco separato da virgole come "populate,lockfat"; "defaults" non ne attiva nessuna.
+int storage_parse_options(const char* list) {
+    int options = 0;
+    const char* p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int found = len == strlen("defaults") && strncmp(p, "defaults", len) == 0;
+        for (int i = 0; i < OPTION_COUNT && !found; i++) {
+            if (len == strlen(option_names[i].name) && strncmp(p, option_names[i].name, len) == 0) {
+                options |= option_names[i].flag;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return options;
+}
+
+void storage_format_options(int options, char* out, size_t size) {
+    out[0] = '\0';
+    for (int i = 0; i < OPTION_COUNT; i++) {
+        if (options & option_names[i].flag) {
+            snprintf(out + strlen(out), size - strlen(out), "%s%s", out[0] ? "," : "", option_names[i].name);
+        }
+    }
+    if (!out[0]) {
+        snprintf(out, size, "defaults");
+    }
+}
+
+void storage_set_options(int options) {
+    char list[64];
+    selected_options = options;
+    storage_format_options(options, list, sizeof(list));
+    fs_log("storage: Mount options %s\n", list);
+}
+
+void storage_stat(StorageStat* st) {
+    pthread_mutex_lock(&cache_lock);
+    st->backend = active_backend;
+    st->options = active_options;
+    st->cache_bytes = active_backend == STORAGE_CACHE ? max_groups * STORAGE_GROUP : 0;
+    st->resident_bytes = resident_groups * STORAGE_GROUP;
+    st->loads = cache_loads;
+    st->evictions = cache_evictions;
+    st->writebacks = cache_writebacks;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static size_t group_len(size_t g) {
+    size_t off = g * STORAGE_GROUP;
+    return cache_mapped - off < STORAGE_GROUP ? cache_mapped - off : STORAGE_GROUP;
+}
+
+static int write_protect(size_t g, int protect) {
+    struct uffdio_writeprotect wp;
+    wp.range.start = (uintptr_t)(cache_base + g * STORAGE_GROUP);
+    wp.range.len = group_len(g);
+    wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+static void wake_group(size_t g) {
+    struct uffdio_range range;
+    range.start = (uintptr_t)(cache_base + g * STORAGE_GROUP);
+    range.len = group_len(g);
+    ioctl(uffd, UFFDIO_WAKE, &range);
+}
+
+// Riscrive un gruppo sporco; la parte oltre la fine dell'immagine non esiste nel file.
+static int write_group(size_t g) {
+    size_t off = g * STORAGE_GROUP;
+    size_t len = cache_size - off < STORAGE_GROUP ? cache_size - off : STORAGE_GROUP;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(cache_fd, cache_base + off + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    write_protect(g, 1);
+    group_state[g] &= ~GROUP_DIRTY;
+    cache_writebacks++;
+    return 0;
+}
+
+static int evict_one() {
+    for (size_t scanned = 0; scanned < 2 * group_count; scanned++) {
+        size_t g = clock_hand;
+        clock_hand = (clock_hand + 1) % group_count;
+        unsigned char state = group_state[g];
+        if (!(state & GROUP_RESIDENT) || (state & GROUP_PINNED)) {
+            continue;
+        }
+        if (state & GROUP_REFERENCED) {
+            group_state[g] &= ~GROUP_REFERENCED;
+            continue;
+        }
+        if ((state & GROUP_DIRTY) && (txn_active || write_group(g) != 0)) {
+            continue;
+        }
+        madvise(cache_base + g * STORAGE_GROUP, group_len(g), MADV_DONTNEED);
+        group_state[g] = 0;
+        resident_groups--;
+        cache_evictions++;
+        return 0;
+    }
+    return -1;
+}
+
+static int load_group(size_t g, int writing) {
+    if (!(group_state[g] & GROUP_PINNED) && resident_groups >= max_groups && evict_one() != 0 && txn_active) {
+        txn_overflow = 1;
+    }
+
+    size_t off = g * STORAGE_GROUP;
+    size_t len = group_len(g);
+    size_t done = 0;
+    while (off + done < cache_size && done < len) {
+        ssize_t n = pread(cache_fd, bounce + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    memset(bounce + done, 0, len - done);
+
+    // Una scrittura renderebbe subito sporco il gruppo: lo si installa gia' scrivibile.
+    struct uffdio_copy copy;
+    copy.dst = (uintptr_t)(cache_base + off);
+    copy.src = (uintptr_t)bounce;
+    copy.len = len;
+    copy.mode = writing ? 0 : UFFDIO_COPY_MODE_WP;
+    if (ioctl(uffd, UFFDIO_COPY, &copy) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    group_state[g] |= GROUP_RESIDENT | GROUP_REFERENCED | (writing ? GROUP_DIRTY : 0);
+    if (!(group_state[g] & GROUP_PINNED)) {
+        resident_groups++;
+    }
+    cache_loads++;
+    return 0;
+}
+
+static void* fault_loop(void* arg) {
+    (void)arg;
+    struct pollfd fds[2];
+    fds[0].fd = uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        struct uffd_msg msg;
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        size_t g = (msg.arg.pagefault.address - (uintptr_t)cache_base) / STORAGE_GROUP;
+        pthread_mutex_lock(&cache_lock);
+        if (!(group_state[g] & GROUP_RESIDENT)) {
+            if (load_group(g, (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0) != 0) {
+                printf("storage: Failed to load block group %zu\n", g);
+            }
+        } else if (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+            group_state[g] |= GROUP_DIRTY | GROUP_REFERENCED;
+            write_protect(g, 0);
+        } else {
+            // Fault gia' risolto da un messaggio precedente per lo stesso gruppo.
+            wake_group(g);
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return NULL;
+}
+
+static void cache_release() {
+    if (stop_pipe[1] != -1) {
+        write(stop_pipe[1], "x", 1);
+        pthread_join(fault_thread, NULL);
+    }
+    if (uffd != -1) {
+        close(uffd);
+    }
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+    if (cache_base) {
+        munmap(cache_base, cache_mapped);
+    }
+    free(group_state);
+    free(bounce);
+    uffd = -1;
+    stop_pipe[0] = stop_pipe[1] = -1;
+    cache_base = NULL;
+    group_state = NULL;
+    bounce = NULL;
+    resident_groups = 0;
+    max_groups = 0;
+}
+
+static void* cache_map(int fd, size_t size, size_t pinned) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    cache_fd = fd;
+    cache_size = size;
+    cache_mapped = (size + page - 1) / page * page;
+    group_count = (cache_mapped + STORAGE_GROUP - 1) / STORAGE_GROUP;
+    max_groups = selected_cache_bytes / STORAGE_GROUP;
+    if (max_groups < 4) {
+        max_groups = 4;
+    }
+    clock_hand = 0;
+
+    group_state = (unsigned char*)calloc(group_count, 1);
+    bounce = (char*)malloc(STORAGE_GROUP);
+    cache_base = (char*)mmap(NULL, cache_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!group_state || !bounce || cache_base == MAP_FAILED) {
+        cache_base = NULL;
+        cache_release();
+        return NULL;
+    }
+    for (size_t g = 0; g < group_count && g * STORAGE_GROUP < pinned; g++) {
+        group_state[g] = GROUP_PINNED;
+    }
+
+    // Le pagine della cache vengono toccate solo dallo spazio utente (le pwrite
+    // partono da gruppi residenti), quindi basta un userfaultfd limitato a quei
+    // fault, che vm.unprivileged_userfaultfd=0 concede anche a chi non e' root.
+    // I kernel precedenti al flag rifiutano con EINVAL.
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (uffd == -1 && errno == EINVAL) {
+        uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    }
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)cache_base;
+    reg.range.len = cache_mapped;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+    if (uffd == -1 || ioctl(uffd, UFFDIO_API, &api) == -1 || ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+        cache_release();
+        return NULL;
+    }
+
+    if (pipe(stop_pipe) == -1 || pthread_create(&fault_thread, NULL, fault_loop, NULL) != 0) {
+        if (stop_pipe[0] != -1) {
+            close(stop_pipe[0]);
+            close(stop_pipe[1]);
+            stop_pipe[0] = stop_pipe[1] = -1;
+        }
+        cache_release();
+        return NULL;
+    }
+    return cache_base;
+}
+
+static int cache_sync() {
+    if (txn_active) {
+        return 0;
+    }
+    int res = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t g = 0; g < group_count; g++) {
+        if ((group_state[g] & GROUP_DIRTY) && write_group(g) != 0) {
+            res = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (fdatasync(cache_fd) == -1) {
+        res = -1;
+    }
+    return res;
+}
+
+// Come storage_sync, limitata ai byte [addr, addr + len) dell'immagine.
+int storage_sync_range(void* addr, size_t len) {
+    if (active_backend == STORAGE_CACHE) {
+        if (txn_active) {
+            return 0;
+        }
+        int res = 0;
+        size_t first = ((char*)addr - cache_base) / STORAGE_GROUP;
+        size_t last = ((char*)addr + len - 1 - cache_base) / STORAGE_GROUP;
+        pthread_mutex_lock(&cache_lock);
+        for (size_t g = first; g <= last && g < group_count; g++) {
+            if ((group_state[g] & GROUP_DIRTY) && write_group(g) != 0) {
+                res = -1;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return fdatasync(cache_fd) == -1 ? -1 : res;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    char* start = (char*)((uintptr_t)addr & ~(uintptr_t)(page - 1));
+    return msync(start, (char*)addr + len - start, MS_SYNC);
+}
+
+static void cache_advise(char* addr, size_t len, int advice) {
+    size_t first = (addr - cache_base) / STORAGE_GROUP;
+    size_t end = (addr + len - cache_base + STORAGE_GROUP - 1) / STORAGE_GROUP;
+    if (end > group_count) {
+        end = group_count;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (advice == STORAGE_WILLNEED) {
+        // Non oltre meta' della cache, per non espellere cio' che si sta leggendo.
+        size_t budget = max_groups / 2;
+        for (size_t g = first; g < end && budget > 0; g++) {
+            if (!(group_state[g] & GROUP_RESIDENT)) {
+                load_group(g, 0);
+                budget--;
+            }
+        }
+    } else {
+        // Solo i gruppi interamente liberati; il contenuto non va riscritto.
+        if ((size_t)(addr - cache_base) % STORAGE_GROUP != 0) {
+            first++;
+        }
+        if ((size_t)(addr + len - cache_base) % STORAGE_GROUP != 0 && end > 0) {
+            end--;
+        }
+        for (size_t g = first; g < end; g++) {
+            if ((group_state[g] & GROUP_RESIDENT) && !(group_state[g] & GROUP_PINNED)) {
+                madvise(cache_base + g * STORAGE_GROUP, group_len(g), MADV_DONTNEED);
+                group_state[g] = 0;
+                resident_groups--;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void storage_advise(void* addr, size_t len, int advice) {
+    if (len == 0) {
+        return;
+    }
+    if (active_backend == STORAGE_CACHE) {
+        cache_advise((char*)addr, len, advice);
+        return;
+    }
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + len;
+    if (advice == STORAGE_WILLNEED) {
+        start &= ~(page - 1);
+        madvise((void*)start, end - start, MADV_WILLNEED);
+    } else {
+        start = (start + page - 1) & ~(page - 1);
+        end &= ~(page - 1);
+        if (end > start) {
+            madvise((void*)start, end - start, MADV_DONTNEED);
+        }
+    }
+}
+
+// Opzioni di montaggio: si applicano dopo aver creato la mappatura, e un
+// errore (limite di memoria bloccabile, huge page non disponibili) non
+// impedisce di usare l'immagine. options sono quelle con cui l'immagine e'
+// stata montata, non quelle scelte nel frattempo per il prossimo montaggio.
+// Durante una transazione la mappatura e' privata: popolarla o bloccarla con
+// mlock ne copierebbe ogni pagina, che il commit scriverebbe nel giornale;
+// si usano quindi la lettura anticipata e MLOCK_ONFAULT.
+static void apply_options(char* base, size_t size, size_t pinned, int options) {
+    // mlock non puo' caricare i gruppi mancanti, perche' i suoi fault avvengono nel
+    // kernel: per bloccarli vanno prima resi residenti.
+    if ((options & (STORAGE_POPULATE | STORAGE_LOCK_FAT)) && active_backend == STORAGE_CACHE) {
+        pthread_mutex_lock(&cache_lock);
+        for (size_t g = 0; g < group_count && (group_state[g] & GROUP_PINNED); g++) {
+            if (!(group_state[g] & GROUP_RESIDENT)) {
+                load_group(g, 0);
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    if ((options & STORAGE_POPULATE) && active_backend == STORAGE_MMAP && txn_active) {
+        madvise(base, size, MADV_WILLNEED);
+    }
+    if ((options & STORAGE_HUGEPAGE) && madvise(base, size, MADV_HUGEPAGE) == -1) {
+        printf("storage: Huge pages not available (%s)\n", strerror(errno));
+    }
+    // Con la cache i gruppi puliti sono protetti in scrittura, e mlock li
+    // popolerebbe per scrittura: anche li' si bloccano solo le pagine residenti.
+    int onfault = active_backend == STORAGE_CACHE || txn_active;
+    if ((options & STORAGE_LOCK_FAT) && (onfault ? mlock2(base, pinned, MLOCK_ONFAULT) : mlock(base, pinned)) == -1) {
+        printf("storage: Failed to lock the FAT in memory (%s)\n", strerror(errno));
+    }
+}
+
+static int shared_map_flags(int options) {
+    return MAP_SHARED | ((options & STORAGE_POPULATE) ? MAP_POPULATE : 0);
+}
+
+void* storage_map(int fd, size_t size, size_t pinned) {
+    void* base = NULL;
+    if (selected_backend == STORAGE_CACHE) {
+        base = cache_map(fd, size, pinned);
+        if (base) {
+            active_backend = STORAGE_CACHE;
+            cache_loads = cache_evictions = cache_writebacks = 0;
+        } else {
+            // Ripiegare su mmap perderebbe il tetto di memoria chiesto con la cache.
+            printf("storage: userfaultfd unavailable (%s), cannot use the cache backend\n", strerror(errno));
+            return NULL;
+        }
+    }
+
+    if (!base) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, shared_map_flags(selected_options), fd, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        active_backend = STORAGE_MMAP;
+    }
+
+    map_fd = fd;
+    map_pinned = pinned;
+    txn_active = 0;
+    active_options = selected_options;
+    apply_options((char*)base, size, pinned, active_options);
+    return base;
+}
+
+int storage_sync(void* base, size_t size) {
+    if (active_backend == STORAGE_CACHE) {
+        return cache_sync();
+    }
+    return msync(base, size, MS_SYNC);
+}
+
+void storage_unmap(void* base, size_t size) {
+    txn_active = 0;
+    if (active_backend == STORAGE_CACHE) {
+        cache_sync();
+        cache_release();
+        active_backend = STORAGE_MMAP;
+        return;
+    }
+    munmap(base, size);
+}
+
+int storage_txn_begin(void* base, size_t size) {
+    if (txn_active) {
+        return 0;
+    }
+    if (active_backend == STORAGE_MMAP &&
+        mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, map_fd, 0) == MAP_FAILED) {
+        return -1;
+    }
+    txn_active = 1;
+    txn_overflow = 0;
+    // La nuova mappatura non ha piu' le pagine bloccate o popolate della precedente.
+    if (active_backend == STORAGE_MMAP) {
+        apply_options((char*)base, size, map_pinned, active_options);
+    }
+    return 0;
+}
+
+static int add_record(JournalRecord** records, size_t* count, size_t* capacity, uint64_t offset, uint64_t len) {
+    if (*count > 0 && (*records)[*count - 1].offset + (*records)[*count - 1].len == offset) {
+        (*records)[*count - 1].len += len;
+        return 0;
+    }
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        JournalRecord* grown = (JournalRecord*)realloc(*records, grown_capacity * sizeof(JournalRecord));
+        if (!grown) {
+            return -1;
+        }
+        *records = grown;
+        *capacity = grown_capacity;
+    }
+    (*records)[*count].offset = offset;
+    (*records)[*count].len = len;
+    (*count)++;
+    return 0;
+}
+
+// Pagine della mappatura privata copiate in scrittura: presenti o in swap, ma
+// non piu' pagine del file (bit 63, 62 e 61 di /proc/self/pagemap).
+static int collect_mmap(char* base, size_t size, JournalRecord** records, size_t* count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    size_t capacity = 0;
+    int pm = open("/proc/self/pagemap", O_RDONLY);
+    if (pm == -1) {
+        return -1;
+    }
+    uint64_t entries[4096];
+    for (size_t first = 0; first < pages; first += 4096) {
+        size_t n = pages - first < 4096 ? pages - first : 4096;
+        off_t at = (off_t)(((uintptr_t)base / page + first) * sizeof(uint64_t));
+        if (pread(pm, entries, n * sizeof(uint64_t), at) != (ssize_t)(n * sizeof(uint64_t))) {
+            close(pm);
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            int present = (entries[i] >> 63) & 1;
+            int swapped = (entries[i] >> 62) & 1;
+            int file = (entries[i] >> 61) & 1;
+            if (!((present && !file) || swapped)) {
+                continue;
+            }
+            uint64_t offset = (uint64_t)(first + i) * page;
+            uint64_t len = size - offset < page ? size - offset : page;
+            if (add_record(records, count, &capacity, offset, len) != 0) {
+                close(pm);
+                return -1;
+            }
+        }
+    }
+    close(pm);
+    return 0;
+}
+
+static int collect_cache(JournalRecord** records, size_t* count) {
+    size_t capacity = 0;
+    for (size_t g = 0; g < group_count; g++) {
+        if (!(group_state[g] & GROUP_DIRTY)) {
+            continue;
+        }
+        uint64_t offset = (uint64_t)g * STORAGE_GROUP;
+        uint64_t len = cache_size - offset < STORAGE_GROUP ? cache_size - offset : STORAGE_GROUP;
+        if (add_record(records, count, &capacity, offset, len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_all(int fd, const char* buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Rende durevole la voce di path nella sua directory, dopo averlo creato.
+static int sync_parent_dir(const char* path) {
+    char dir[PATH_MAX];
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        size_t len = (size_t)(slash - path) < sizeof(dir) - 1 ? (size_t)(slash - path) : sizeof(dir) - 1;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) {
+        return -1;
+    }
+    int res = fsync(dfd);
+    close(dfd);
+    return res;
+}
+
+// Giornale: JournalHeader, i record, poi i dati dei record uno dopo l'altro.
+// L'intestazione e' scritta per ultima e il CRC copre record e dati, cosi' un
+// giornale scritto a meta' non viene mai scambiato per uno completo.
+static int write_journal(const char* journal, const char* base, const JournalRecord* records, size_t count) {
+    // Un giornale appena creato va reso durevole anche nella directory, o un
+    // crash potrebbe perderlo insieme alla transazione che protegge.
+    int created = 0;
+    int fd = open(journal, O_RDWR | O_TRUNC);
+    if (fd == -1 && errno == ENOENT) {
+        fd = open(journal, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        created = 1;
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.records = (uint32_t)count;
+    size_t records_len = count * sizeof(JournalRecord);
+    header.crc = crc32c(0, records, records_len);
+    off_t at = sizeof(header) + records_len;
+    for (size_t i = 0; i < count; i++) {
+        if (write_all(fd, base + records[i].offset, records[i].len, at) != 0) {
+            close(fd);
+            return -1;
+        }
+        header.crc = crc32c(header.crc, base + records[i].offset, records[i].len);
+        header.data_bytes += records[i].len;
+        at += records[i].len;
+    }
+    header.magic = JOURNAL_MAGIC;
+    if (write_all(fd, (const char*)records, records_len, sizeof(header)) != 0 ||
+        write_all(fd, (const char*)&header, sizeof(header), 0) != 0 || fdatasync(fd) == -1 ||
+        (created && sync_parent_dir(journal) != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int storage_txn_commit(void* base, size_t size, const char* journal) {
+    if (!txn_active) {
+        return 0;
+    }
+    JournalRecord* records = NULL;
+    size_t count = 0;
+    int collected;
+    if (active_backend == STORAGE_CACHE) {
+        pthread_mutex_lock(&cache_lock);
+        collected = collect_cache(&records, &count);
+        pthread_mutex_unlock(&cache_lock);
+    } else {
+        collected = collect_mmap((char*)base, size, &records, &count);
+    }
+    if (collected != 0) {
+        free(records);
+        return -1;
+    }
+
+    if (count > 0) {
+        int jfd = write_journal(journal, (const char*)base, records, count);
+        if (jfd == -1) {
+            free(records);
+            return -1;
+        }
+        int res = 0;
+        if (active_backend == STORAGE_CACHE) {
+            pthread_mutex_lock(&cache_lock);
+            for (size_t g = 0; g < group_count; g++) {
+                if ((group_state[g] & GROUP_DIRTY) && write_group(g) != 0) {
+                    res = -1;
+                }
+            }
+            pthread_mutex_unlock(&cache_lock);
+        } else {
+            for (size_t i = 0; i < count && res == 0; i++) {
+                res = write_all(map_fd, (const char*)base + records[i].offset, records[i].len, records[i].offset);
+            }
+        }
+        // Se la scrittura al suo posto fallisce il giornale resta: lo riapplichera'
+        // il prossimo caricamento.
+        if (res != 0 || fdatasync(map_fd) == -1) {
+            close(jfd);
+            free(records);
+            return -1;
+        }
+        ftruncate(jfd, 0);
+        close(jfd);
+    }
+    free(records);
+
+    if (active_backend == STORAGE_MMAP &&
+        mmap(base, size, PROT_READ | PROT_WRITE, shared_map_flags(active_options) | MAP_FIXED, map_fd, 0) == MAP_FAILED) {
+        return -1;
+    }
+    txn_active = 0;
+    if (active_backend == STORAGE_MMAP) {
+        apply_options((char*)base, size, map_pinned, active_options);
+    }
+    return 0;
+}
+
+int storage_txn_overflowed() {
+    return txn_active && txn_overflow;
+}
+
+// Scarta le modifiche della transazione: l'immagine torna a essere letta dal file.
+int storage_txn_abort(void* base, size_t size) {
+    if (!txn_active) {
+        return 0;
+    }
+    txn_active = 0;
+    if (active_backend == STORAGE_CACHE) {
+        pthread_mutex_lock(&cache_lock);
+        for (size_t g = 0; g < group_count; g++) {
+            if (!(group_state[g] & GROUP_DIRTY)) {
+                continue;
+            }
+            madvise(cache_base + g * STORAGE_GROUP, group_len(g), MADV_DONTNEED);
+            if (group_state[g] & GROUP_PINNED) {
+                group_state[g] = GROUP_PINNED;
+            } else {
+                group_state[g] = 0;
+                resident_groups--;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, shared_map_flags(active_options) | MAP_FIXED, map_fd, 0) == MAP_FAILED) {
+        return -1;
+    }
+    apply_options((char*)base, size, map_pinned, active_options);
+    return 0;
+}
+
+int storage_recover(int fd, const char* journal) {
+    int jfd = open(journal, O_RDWR);
+    if (jfd == -1) {
+        return 0;
+    }
+    struct stat st;
+    JournalHeader header;
+    char* data = NULL;
+    int res = 0;
+    if (fstat(jfd, &st) == 0 && st.st_size >= (off_t)sizeof(header) &&
+        pread(jfd, &header, sizeof(header), 0) == sizeof(header) && header.magic == JOURNAL_MAGIC &&
+        (off_t)(sizeof(header) + header.records * sizeof(JournalRecord) + header.data_bytes) == st.st_size &&
+        (data = (char*)malloc(st.st_size - sizeof(header))) != NULL &&
+        pread(jfd, data, st.st_size - sizeof(header), sizeof(header)) == st.st_size - (off_t)sizeof(header) &&
+        crc32c(0, data, st.st_size - sizeof(header)) == header.crc) {
+        const JournalRecord* records = (const JournalRecord*)data;
+        const char* payload = data + header.records * sizeof(JournalRecord);
+        // Prima di scrivere qualunque record si controlla che tutti cadano
+        // nell'immagine e coprano esattamente i dati del giornale.
+        struct stat image;
+        uint64_t total = 0;
+        res = fstat(fd, &image) == 0 ? 1 : -1;
+        for (uint32_t i = 0; i < header.records && res == 1; i++) {
+            if (records[i].offset > (uint64_t)image.st_size || records[i].len > (uint64_t)image.st_size - records[i].offset) {
+                res = -1;
+            }
+            total += records[i].len;
+        }
+        if (res == 1 && total != header.data_bytes) {
+            res = -1;
+        }
+        for (uint32_t i = 0; i < header.records && res == 1; i++) {
+            if (write_all(fd, payload, records[i].len, records[i].offset) != 0) {
+                res = -1;
+            }
+            payload += records[i].len;
+        }
+        if (res == 1 && fdatasync(fd) == -1) {
+            res = -1;
+        }
+    }
+    free(data);
+    if (res >= 0) {
+        ftruncate(jfd, 0);
+    }
+    close(jfd);
+    return res;
+}
@@ -0,0 +1,67 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Modi di tenere in memoria l'immagine. STORAGE_MMAP la mappa per intero dal
+// file; STORAGE_CACHE la legge e scrive con pread/pwrite a gruppi di
+// STORAGE_GROUP byte, tenendone residenti al piu' quanti ne stanno nel budget
+// della cache. La scelta vale per la prossima mkfs o loadfs.
+
+#define STORAGE_MMAP 0
+#define STORAGE_CACHE 1
+
+#define STORAGE_GROUP (64 * 1024)
+#define STORAGE_DEFAULT_CACHE (64 * 1024 * 1024)
+
+// Opzioni di montaggio. STORAGE_POPULATE carica subito l'immagine (con la cache,
+// solo intestazione e FAT); STORAGE_HUGEPAGE chiede huge page trasparenti;
+// STORAGE_LOCK_FAT blocca in memoria intestazione, FAT e riferimenti.
+#define STORAGE_POPULATE 0x01
+#define STORAGE_HUGEPAGE 0x02
+#define STORAGE_LOCK_FAT 0x04
+
+#define STORAGE_WILLNEED 0
+#define STORAGE_DONTNEED 1
+
+typedef struct {
+    int backend;
+    int options;
+    size_t cache_bytes;
+    size_t resident_bytes;
+    uint64_t loads;
+    uint64_t evictions;
+    uint64_t writebacks;
+} StorageStat;
+
+void storage_set_backend(int backend, size_t cache_bytes);
+void storage_stat(StorageStat* st);
+int storage_parse_options(const char* list);
+void storage_format_options(int options, char* out, size_t size);
+void storage_set_options(int options);
+
+// pinned: byte iniziali dell'immagine (intestazione e FAT) da non espellere mai.
+void* storage_map(int fd, size_t size, size_t pinned);
+int storage_sync(void* base, size_t size);
+int storage_sync_range(void* addr, size_t len);
+// STORAGE_WILLNEED anticipa il caricamento di un intervallo che sara' letto
+// presto; STORAGE_DONTNEED rilascia la memoria delle pagine interamente
+// contenute in un intervallo il cui contenuto non serve piu'.
+void storage_advise(void* addr, size_t len, int advice);
+void storage_unmap(void* base, size_t size);
+
+// Transazioni: le modifiche fatte dopo storage_txn_begin raggiungono il file
+// immagine solo con storage_txn_commit, passando dal giornale indicato.
+// storage_recover va chiamata prima di mappare l'immagine: riapplica un giornale
+// completo rimasto da un commit interrotto (1) o non trova nulla da fare (0).
+int storage_txn_begin(void* base, size_t size);
+int storage_txn_commit(void* base, size_t size, const char* journal);
+int storage_txn_abort(void* base, size_t size);
+int storage_recover(int fd, const char* journal);
+
+// Con la cache i gruppi sporchi di una transazione non possono essere espulsi:
+// vale 1 se per caricarne altri la cache ha dovuto superare il suo budget.
+int storage_txn_overflowed();
+
+#endif
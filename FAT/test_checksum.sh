@@ -0,0 +1,33 @@
+#!/bin/sh
+# Un cluster corrotto nell'immagine deve far fallire copy2host senza lasciare
+# sull'host una copia troncata.
+set -e
+MYFS="$(cd "$(dirname "$0")" && pwd)/myfs"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+head -c 8192 /dev/urandom > in.bin
+printf 'CORRUPTME' | dd of=in.bin bs=1 seek=3000 conv=notrunc 2>/dev/null
+printf 'mkfs\ncopy2fs in.bin in.bin\ncopy2host in.bin ok.bin\n' | "$MYFS" -b - > /dev/null
+cmp in.bin ok.bin
+
+offset=$(grep -obUa CORRUPTME DATATICUS.dat | head -n 1 | cut -d: -f1)
+printf 'X' | dd of=DATATICUS.dat bs=1 seek="$offset" conv=notrunc 2>/dev/null
+
+out=$(printf 'loadfs\ncopy2host in.bin bad.bin\n' | "$MYFS" -b -)
+echo "$out" | grep -q "Checksum mismatch" || { echo "FAIL: corruption not detected"; exit 1; }
+echo "$out" | grep -q "Failed to copy" || { echo "FAIL: copy2host reported success"; exit 1; }
+[ ! -e bad.bin ] || { echo "FAIL: partial host file left behind"; exit 1; }
+echo "$out" | grep -q "(checksum mismatch)" || { echo "FAIL: copy2host did not report the checksum error"; exit 1; }
+
+# Lo stesso per un file compresso: l'errore arriva da load_chunk.
+rm -f DATATICUS.dat*
+yes CORRUPTME | head -c 20000 > z.txt
+printf 'mkfs\ncompression on\ncopy2fs z.txt z.txt\n' | "$MYFS" -b - > /dev/null
+offset=$(grep -obUa CORRUPTME DATATICUS.dat | head -n 1 | cut -d: -f1)
+printf 'X' | dd of=DATATICUS.dat bs=1 seek="$offset" conv=notrunc 2>/dev/null
+out=$(printf 'loadfs\ncopy2host z.txt badz.txt\n' | "$MYFS" -b -)
+echo "$out" | grep -q "(checksum mismatch)" || { echo "FAIL: checksum error on a compressed file not reported"; exit 1; }
+[ ! -e badz.txt ] || { echo "FAIL: partial host file left behind"; exit 1; }
+echo "test_checksum: PASSED"
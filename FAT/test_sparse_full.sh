@@ -0,0 +1,20 @@
+#!/bin/sh
+# Una scrittura oltre la fine che porterebbe un file a catena nel formato sparso
+# deve fallire senza toccare i suoi blocchi quando il volume e' pieno.
+set -e
+MYFS="$(cd "$(dirname "$0")" && pwd)/myfs"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# Oltre SPARSE_MAP_ENTRIES cluster la mappa ha due livelli: resta libero un solo
+# cluster, cosi' la conversione fallisce dopo aver gia' riempito la radice.
+head -c 102400 /dev/urandom > in.bin
+head -c 400 /dev/urandom > one.bin
+printf 'mkfs 1024\ncopy2fs in.bin in.bin\ncopy2fs one.bin one.bin\nmkfile pad.bin\nfallocate pad.bin 1000000\nrmfile one.bin\ndf\n' | "$MYFS" -b - > fill.out
+grep -q " 1 free" fill.out || { echo "FAIL: volume not filled"; cat fill.out; exit 1; }
+
+out=$(printf 'loadfs\nwrite in.bin 1000000 X\ncopy2host in.bin out.bin\nfsck\n' | "$MYFS" -b -)
+cmp in.bin out.bin || { echo "FAIL: file changed by the failed write"; exit 1; }
+echo "$out" | grep -q "fsck: Clean" || { echo "FAIL: image damaged"; echo "$out"; exit 1; }
+echo "test_sparse_full: PASSED"